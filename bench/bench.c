@@ -0,0 +1,526 @@
+#include "sf.h"
+#include <ftw.h>
+#include <math.h>
+
+/*
+ * Benchmarks of the listing pipeline, side view updates and drawing, run
+ * against generated trees. Results are printed as JSON:
+ *
+ *   sf_bench [--quick] [--output file] [directory]
+ *
+ * Trees are generated in directory and kept there for later runs, or in a
+ * temporary directory that's removed afterwards. --quick skips the largest
+ * tree.
+ */
+
+#define SF_BENCH_MIN_ITERATIONS 3
+#define SF_BENCH_MAX_ITERATIONS 1000
+#define SF_BENCH_MIN_SECONDS 0.5
+
+#define SF_BENCH_LINES 50
+#define SF_BENCH_COLS 160
+
+typedef enum sf_bench_tree_kind_t {
+  SF_BENCH_FLAT,  // Empty files
+  SF_BENCH_UTF8,  // Files with long UTF-8 names
+  SF_BENCH_MIXED, // Files, directories, symlinks and fifos
+  SF_BENCH_DIRS,  // Directories of 100 files each
+  SF_BENCH_DEEP,  // Nested directories, each level holding a few files
+} sf_bench_tree_kind_t;
+
+typedef struct sf_bench_tree_t {
+  const char *name;
+  sf_bench_tree_kind_t kind;
+  uint32_t size; // Entries, or levels of a deep tree
+  bool large;    // Skipped by --quick
+  char path[PATH_MAX];
+} sf_bench_tree_t;
+
+sf_bench_tree_t sf_bench_trees[] = {
+    {"flat_10", SF_BENCH_FLAT, 10, false},
+    {"flat_10k", SF_BENCH_FLAT, 10000, false},
+    {"flat_1m", SF_BENCH_FLAT, 1000000, true},
+    {"utf8_10k", SF_BENCH_UTF8, 10000, false},
+    {"mixed_10k", SF_BENCH_MIXED, 10000, false},
+    {"dirs_1k", SF_BENCH_DIRS, 1000, false},
+    {"deep_64", SF_BENCH_DEEP, 64, false},
+};
+
+#define SF_BENCH_TREE_COUNT                                                    \
+  (sizeof(sf_bench_trees) / sizeof(sf_bench_trees[0]))
+
+sf_bench_tree_t *sf_bench_tree(const char *name) {
+  for (uint32_t i = 0; i < SF_BENCH_TREE_COUNT; i++) {
+    if (strcmp(sf_bench_trees[i].name, name) == 0) {
+      return &sf_bench_trees[i];
+    }
+  }
+  return NULL;
+}
+
+FILE *sf_bench_output;
+bool sf_bench_first_result = true;
+
+double sf_bench_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Tree generation
+ */
+bool sf_bench_touch(int dirfd, const char *name) {
+  int fd = openat(dirfd, name, O_CREAT | O_WRONLY | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    return false;
+  }
+  close(fd);
+  return true;
+}
+
+/*
+ * Writes a name of about 50 characters from multibyte pieces to dest
+ */
+void sf_bench_utf8_name(uint32_t i, char *dest, size_t size) {
+  static const char *pieces[] = {
+      "été", "日本語", "Ωμέγα", "ñandú", "русский", "한국어", "🐟", "ü",
+  };
+  uint32_t piece_count = sizeof(pieces) / sizeof(pieces[0]);
+
+  uint32_t state = i * 2654435761u + 1;
+  int length = snprintf(dest, size, "%05u", i);
+  for (uint32_t j = 0; j < 10; j++) {
+    state = state * 1103515245u + 12345u;
+    length += snprintf(
+        dest + length,
+        size - length,
+        "-%s",
+        pieces[(state >> 16) % piece_count]);
+  }
+}
+
+/*
+ * Fills the directory dirfd according to kind. Returns false on failure.
+ */
+bool sf_bench_fill(int dirfd, sf_bench_tree_kind_t kind, uint32_t size) {
+  if (kind == SF_BENCH_DEEP) {
+    if (size == 0) {
+      return true;
+    }
+
+    int fd = -1;
+    bool success = sf_bench_fill(dirfd, SF_BENCH_FLAT, 16) &&
+                   mkdirat(dirfd, "d", 0755) == 0 &&
+                   (fd = openat(dirfd, "d", O_RDONLY | O_DIRECTORY)) != -1 &&
+                   sf_bench_fill(fd, SF_BENCH_DEEP, size - 1);
+    if (fd != -1) {
+      close(fd);
+    }
+    return success;
+  }
+
+  char name[NAME_MAX + 1];
+  for (uint32_t i = 0; i < size; i++) {
+    bool success = true;
+    switch (kind) {
+    case SF_BENCH_FLAT:
+      snprintf(name, sizeof(name), "f%07u", i);
+      success = sf_bench_touch(dirfd, name);
+      break;
+    case SF_BENCH_UTF8:
+      sf_bench_utf8_name(i, name, sizeof(name));
+      success = sf_bench_touch(dirfd, name);
+      break;
+    case SF_BENCH_MIXED:
+      snprintf(name, sizeof(name), "m%05u", i);
+      switch (i % 4) {
+      case 0:
+        success = sf_bench_touch(dirfd, name);
+        break;
+      case 1:
+        success = mkdirat(dirfd, name, 0755) == 0;
+        break;
+      case 2:
+        success = symlinkat("m00000", dirfd, name) == 0;
+        break;
+      case 3:
+        success = mkfifoat(dirfd, name, 0644) == 0;
+        break;
+      }
+      break;
+    case SF_BENCH_DIRS: {
+      snprintf(name, sizeof(name), "d%04u", i);
+      int fd = -1;
+      success = mkdirat(dirfd, name, 0755) == 0 &&
+                (fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY)) != -1 &&
+                sf_bench_fill(fd, SF_BENCH_FLAT, 100);
+      if (fd != -1) {
+        close(fd);
+      }
+      break;
+    }
+    case SF_BENCH_DEEP:
+      break;
+    }
+
+    if (!success) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+int sf_bench_age_entry(
+    const char *path, const struct stat *st, int type, struct FTW *ftw) {
+  // The cache doesn't keep directories modified during the last second
+  struct timespec times[2] = {
+      {.tv_sec = time(NULL) - 3600}, {.tv_sec = time(NULL) - 3600}};
+  if (type == FTW_D || type == FTW_DP) {
+    utimensat(AT_FDCWD, path, times, 0);
+  }
+  return 0;
+}
+
+int sf_bench_remove_entry(
+    const char *path, const struct stat *st, int type, struct FTW *ftw) {
+  return remove(path);
+}
+
+/*
+ * Generates the tree under root unless a previous run left it there
+ */
+bool sf_bench_make_tree(sf_bench_tree_t *tree, const char *root) {
+  snprintf(tree->path, sizeof(tree->path), "%s/%s", root, tree->name);
+
+  char done_path[PATH_MAX + 8];
+  snprintf(done_path, sizeof(done_path), "%s.done", tree->path);
+  if (access(done_path, F_OK) == 0) {
+    return true;
+  }
+
+  fprintf(stderr, "generating %s\n", tree->path);
+  nftw(tree->path, sf_bench_remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+  if (mkdir(tree->path, 0755) != 0) {
+    return false;
+  }
+
+  int fd = open(tree->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1) {
+    return false;
+  }
+  bool success = sf_bench_fill(fd, tree->kind, tree->size);
+  close(fd);
+
+  if (success) {
+    nftw(tree->path, sf_bench_age_entry, 64, FTW_PHYS);
+    int done = creat(done_path, 0644);
+    success = done != -1;
+    if (done != -1) {
+      close(done);
+    }
+  }
+
+  return success;
+}
+
+/*
+ * Timing
+ */
+typedef void (*sf_bench_fn_t)(void *data);
+
+/*
+ * Runs fn until it ran often and long enough and prints its timings
+ */
+void sf_bench_run(
+    const char *name,
+    const char *tree,
+    uint32_t entries,
+    sf_bench_fn_t fn,
+    void *data) {
+  double min = INFINITY, max = 0, total = 0;
+  uint32_t iterations = 0;
+
+  while (iterations < SF_BENCH_MIN_ITERATIONS ||
+         (total < SF_BENCH_MIN_SECONDS &&
+          iterations < SF_BENCH_MAX_ITERATIONS)) {
+    double start = sf_bench_now();
+    fn(data);
+    double elapsed = sf_bench_now() - start;
+
+    min = elapsed < min ? elapsed : min;
+    max = elapsed > max ? elapsed : max;
+    total += elapsed;
+    iterations++;
+  }
+
+  fprintf(
+      sf_bench_output,
+      "%s\n    {\"name\": \"%s\", \"tree\": \"%s\", \"entries\": %u, "
+      "\"iterations\": %u, \"min_ms\": %.4f, \"mean_ms\": %.4f, "
+      "\"max_ms\": %.4f}",
+      sf_bench_first_result ? "" : ",",
+      name,
+      tree,
+      entries,
+      iterations,
+      min * 1e3,
+      total / iterations * 1e3,
+      max * 1e3);
+  sf_bench_first_result = false;
+  fflush(sf_bench_output);
+}
+
+/*
+ * Listing pipeline
+ */
+void sf_bench_cache_reset(size_t max_size) {
+  sf_cache_destroy(&sf_cache);
+  sf_cache_init(&sf_cache, max_size, SF_PREFETCH_MAX_BYTES);
+}
+
+void sf_bench_get_entries(void *data) {
+  const sf_bench_tree_t *tree = data;
+  sf_listing_t listing = {0};
+  sf_get_entries(AT_FDCWD, tree->path, tree->path, NULL, NULL, &listing);
+  sf_listing_destroy(&listing);
+}
+
+void sf_bench_sort(void *data) {
+  const sf_listing_t *sorted = data;
+  sf_listing_t listing = {0};
+  if (!sf_listing_copy(&listing, sorted)) {
+    return;
+  }
+
+  // Reverse the order so the sort has work to do
+  for (uint32_t i = 0; i < listing.count / 2; i++) {
+    uint32_t index = listing.order[i];
+    listing.order[i] = listing.order[listing.count - 1 - i];
+    listing.order[listing.count - 1 - i] = index;
+  }
+
+  sf_listing_sort(&listing);
+  sf_listing_destroy(&listing);
+}
+
+void sf_bench_listings(sf_bench_tree_t *tree) {
+  sf_listing_t listing = {0};
+  sf_get_entries(AT_FDCWD, tree->path, tree->path, NULL, NULL, &listing);
+
+  // Nothing is cached while scanning
+  sf_bench_cache_reset(0);
+  sf_bench_run("scan", tree->name, listing.count, sf_bench_get_entries, tree);
+
+  sf_bench_run("sort", tree->name, listing.count, sf_bench_sort, &listing);
+
+  sf_bench_cache_reset(SIZE_MAX);
+  sf_bench_get_entries(tree);
+  sf_bench_run(
+      "cache_hit", tree->name, listing.count, sf_bench_get_entries, tree);
+
+  sf_listing_destroy(&listing);
+}
+
+/*
+ * Views
+ */
+
+// Runs completions until the current view and the preview are loaded
+void sf_bench_settle() {
+  while (sf_views[sf_current_view].dir->pending != NULL ||
+         sf_side_view.pending != NULL) {
+    sf_poll_events(-1);
+  }
+}
+
+void sf_bench_open(const sf_bench_tree_t *tree) {
+  sf_view_set_path(
+      &sf_views[sf_current_view], AT_FDCWD, tree->path, tree->path, NULL);
+  sf_bench_settle();
+}
+
+// Moves the selection down, from the bottom back to the top
+void sf_bench_select_next() {
+  sf_view_t *view = &sf_views[sf_current_view];
+  if (view->selected_entry + 1 < sf_view_row_count(view)) {
+    sf_handle_key(SF_KEY_DOWN);
+  } else {
+    sf_view_set_selected_entry(view, 0);
+  }
+}
+
+void sf_bench_preview(void *data) {
+  sf_bench_select_next();
+  sf_side_view_sync(&sf_side_view, &sf_views[sf_current_view]);
+  sf_bench_settle();
+}
+
+void sf_bench_side_view(sf_bench_tree_t *tree) {
+  sf_bench_open(tree);
+  uint32_t count = sf_views[sf_current_view].dir->listing.count;
+
+  sf_bench_cache_reset(0);
+  sf_bench_run("side_view", tree->name, count, sf_bench_preview, NULL);
+
+  sf_bench_cache_reset(SIZE_MAX);
+  sf_bench_run("side_view_cached", tree->name, count, sf_bench_preview, NULL);
+}
+
+// Enters the directory nested in each level, down to the bottom
+void sf_bench_descend(void *data) {
+  const sf_bench_tree_t *tree = data;
+  sf_bench_open(tree);
+
+  for (uint32_t level = 1; level < tree->size; level++) {
+    sf_side_view_sync(&sf_side_view, &sf_views[sf_current_view]);
+    sf_bench_settle();
+    sf_handle_key(SF_KEY_FORWARD);
+    sf_bench_settle();
+  }
+}
+
+void sf_bench_deep(sf_bench_tree_t *tree) {
+  sf_bench_cache_reset(0);
+  sf_bench_run("descend", tree->name, tree->size, sf_bench_descend, tree);
+
+  sf_bench_cache_reset(SIZE_MAX);
+  sf_bench_run(
+      "descend_cached", tree->name, tree->size, sf_bench_descend, tree);
+}
+
+/*
+ * Drawing
+ */
+void sf_bench_full_frame(void *data) {
+  sf_header_pane.dirty = sf_main_pane.dirty = sf_side_pane.dirty = true;
+  sf_draw_frame();
+}
+
+void sf_bench_scroll_frame(void *data) {
+  sf_bench_select_next();
+  sf_draw_frame();
+  sf_bench_settle();
+}
+
+void sf_bench_render(sf_bench_tree_t *tree) {
+  sf_bench_open(tree);
+  uint32_t count = sf_views[sf_current_view].dir->listing.count;
+  sf_draw_frame();
+
+  sf_bench_run("render_full", tree->name, count, sf_bench_full_frame, NULL);
+  sf_bench_run("render_scroll", tree->name, count, sf_bench_scroll_frame, NULL);
+
+  sf_show_metadata = true;
+  sf_bench_run(
+      "render_scroll_metadata",
+      tree->name,
+      count,
+      sf_bench_scroll_frame,
+      NULL);
+  sf_show_metadata = false;
+}
+
+int main(int argc, char **argv) {
+  bool quick = false;
+  const char *output = NULL;
+  const char *root = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--quick") == 0) {
+      quick = true;
+    } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+      output = argv[++i];
+    } else {
+      root = argv[i];
+    }
+  }
+
+  char temporary[PATH_MAX] = "";
+  if (root == NULL) {
+    const char *tmpdir = getenv("TMPDIR");
+    snprintf(
+        temporary,
+        sizeof(temporary),
+        "%s/sf_bench.XXXXXX",
+        tmpdir != NULL ? tmpdir : "/tmp");
+    if (mkdtemp(temporary) == NULL) {
+      perror("mkdtemp");
+      return 1;
+    }
+    root = temporary;
+  } else {
+    mkdir(root, 0755);
+  }
+
+  for (uint32_t i = 0; i < SF_BENCH_TREE_COUNT; i++) {
+    if (quick && sf_bench_trees[i].large) {
+      continue;
+    }
+    if (!sf_bench_make_tree(&sf_bench_trees[i], root)) {
+      fprintf(
+          stderr,
+          "can't generate %s: %s\n",
+          sf_bench_trees[i].name,
+          strerror(errno));
+      return 1;
+    }
+  }
+
+  sf_bench_output = stdout;
+  if (output != NULL && (sf_bench_output = fopen(output, "w")) == NULL) {
+    perror(output);
+    return 1;
+  }
+
+  // Views start out in the trees' directory
+  if (chdir(root) != 0) {
+    perror(root);
+    return 1;
+  }
+  sf_init_state();
+  sf_bench_settle();
+
+  fprintf(sf_bench_output, "{\"benchmarks\": [");
+
+  for (uint32_t i = 0; i < SF_BENCH_TREE_COUNT; i++) {
+    if (quick && sf_bench_trees[i].large) {
+      continue;
+    }
+    sf_bench_listings(&sf_bench_trees[i]);
+  }
+
+  sf_bench_side_view(sf_bench_tree("dirs_1k"));
+  sf_bench_deep(sf_bench_tree("deep_64"));
+
+  // Drawn to a terminal that discards everything
+  FILE *null_output = fopen("/dev/null", "w");
+  FILE *null_input = fopen("/dev/null", "r");
+  SCREEN *screen = newterm("xterm", null_output, null_input);
+  if (screen == NULL) {
+    fprintf(stderr, "can't create a headless terminal\n");
+    return 1;
+  }
+  set_term(screen);
+  resize_term(SF_BENCH_LINES, SF_BENCH_COLS);
+  sf_init_screen();
+
+  sf_bench_render(sf_bench_tree("flat_10k"));
+  sf_bench_render(sf_bench_tree("utf8_10k"));
+
+  fprintf(sf_bench_output, "\n]}\n");
+
+  sf_destroy();
+  delscreen(screen);
+  fclose(null_output);
+  fclose(null_input);
+  if (sf_bench_output != stdout) {
+    fclose(sf_bench_output);
+  }
+
+  if (temporary[0] != '\0') {
+    nftw(temporary, sf_bench_remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+  }
+
+  return 0;
+}
@@ -9,6 +9,18 @@
 #define SF_KEY_UP 'k'
 #define SF_KEY_DOWN 'j'
 #define SF_KEY_TOGGLE_HIDDEN 'H'
+#define SF_KEY_TOGGLE_METADATA 'i'
+#define SF_KEY_FILTER '/'
+#define SF_KEY_CANCEL '\x1b'    // Escape, clears the filter
+#define SF_KEY_MARK ' '         // Marks or unmarks the selection
+#define SF_KEY_COPY 'p'         // Copies entries marked in other views here
+#define SF_KEY_MOVE 'm'         // Moves entries marked in other views here
+#define SF_KEY_DELETE 'D'       // Asks to delete the entries marked here
+#define SF_KEY_CONFIRM 'y'      // Answers a prompt, other keys decline
+#define SF_KEY_FIND 'f'         // Finds entries anywhere below this directory
+#define SF_KEY_SORT 's'         // Cycles through the sort orders
+#define SF_KEY_FIND_NEXT '\x0e' // Ctrl-N, selects the next match found
+#define SF_KEY_FIND_PREV '\x10' // Ctrl-P, selects the previous match found
 
 #define SF_VIEW_COUNT 4
 
@@ -19,4 +31,78 @@
 
 #define SF_DRAW_BORDERS
 
+// Upper bound on redraws per second, faster input is handled in batches
+#define SF_MAX_FPS 60
+
+// Threads used for background directory scans
+#define SF_WORKER_COUNT 2
+
+// Threads stat'ing entries whose type or size and modification time are
+// needed, and how many entries each of their jobs handles
+#define SF_STAT_WORKER_COUNT 4
+#define SF_STAT_BATCH_SIZE 256
+
+// Show the size and modification time columns on startup
+// #define SF_SHOW_METADATA
+
+// Match filters as characters appearing in order rather than as substrings
+// #define SF_FILTER_FUZZY
+
+// Memory budget for everything sf holds. Open directories, previews shown
+// and finder results are kept, while cached listings and previews are
+// evicted least recently used first to make room, and the finder stops
+// walking once it no longer fits. The SF_MEMORY_MAX environment variable
+// overrides it, in bytes with an optional K, M or G suffix.
+#define SF_MEMORY_MAX_BYTES (256 * 1024 * 1024)
+
+// Memory budget for cached directory listings, within SF_MEMORY_MAX_BYTES
+#define SF_CACHE_MAX_BYTES (64 * 1024 * 1024)
+
+// Directories likely to be opened next are scanned into the cache while
+// idle: the parent, SF_PREFETCH_SIBLINGS directories on either side of the
+// selection and SF_PREFETCH_DEPTH levels below the previewed one. Listings
+// not opened yet take at most SF_PREFETCH_MAX_BYTES of the cache.
+#define SF_PREFETCH_WORKER_COUNT 1
+#define SF_PREFETCH_SIBLINGS 2
+#define SF_PREFETCH_DEPTH 1
+#define SF_PREFETCH_MAX_BYTES (16 * 1024 * 1024)
+
+// Listings of directories with at least SF_SNAPSHOT_MIN_ENTRIES entries are
+// saved under $XDG_CACHE_HOME/sf and mapped back in when they're opened in
+// a later session. An unchanged directory isn't read again, a changed one
+// shows the saved listing until it's read again in the background.
+// #define SF_SNAPSHOTS
+#define SF_SNAPSHOT_MIN_ENTRIES 50000
+
+// Threads adding up the recursive size and file count of the previewed
+// directory, and how many results are remembered. Results are reused while
+// the directory's modification time stays the same.
+#define SF_DU_WORKER_COUNT 4
+#define SF_DU_MEMO_SIZE 256
+
+// Threads walking the tree below the current directory for the finder
+#define SF_FIND_WORKER_COUNT 4
+
+// Files are previewed in the side pane from their first SF_PREVIEW_MAX_BYTES,
+// never reading further. The last SF_PREVIEW_CACHE_SIZE previews are kept
+// for files whose modification time didn't change.
+#define SF_PREVIEW_MAX_BYTES (16 * 1024)
+#define SF_PREVIEW_CACHE_SIZE 32
+
+// Threads running copies, moves and deletes. With one, operations run in
+// the order they were started.
+#define SF_OP_WORKER_COUNT 1
+
+// Show listing cache hit/miss counters in the header
+// #define SF_DRAW_CACHE_STATS
+
+// Time scans, sorts, side view updates, drawing and spawned programs. They
+// are written as a Chrome/Perfetto trace to the file named by the SF_TRACE
+// environment variable, if it's set when sf starts.
+// #define SF_TRACE
+
+// Show the last scan, sort and draw times and what memory is held by what
+// in the header, implies SF_TRACE
+// #define SF_DRAW_TRACE_STATS
+
 #endif
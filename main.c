@@ -0,0 +1,46 @@
+#include "sf.h"
+
+int main(int argc, char **argv) {
+  // Scripts get the listing sf would show without the terminal interface
+  if (argc > 1 && strcmp(argv[1], "--list") == 0) {
+    return sf_list(argc - 2, argv + 2);
+  }
+
+  sf_init();
+
+  int64_t frame_interval = 1000 / SF_MAX_FPS;
+
+  while (!sf_should_quit) {
+    // Scans started since the last frame get one frame to complete, so
+    // directories that are quick to read never show up partially
+    sf_scan_job_t *scan;
+    int64_t remaining;
+    while (!sf_should_quit &&
+           (scan = sf_views[sf_current_view].dir->pending) != NULL &&
+           (remaining = scan->started_ms + frame_interval - sf_now_ms()) > 0) {
+      sf_poll_events((int)remaining);
+      sf_handle_pending_keys();
+    }
+
+    sf_draw_frame();
+
+    int64_t frame_end = sf_now_ms() + frame_interval;
+
+    if (!sf_handle_pending_keys()) {
+      // Idle until something happens
+      sf_prefetch_schedule();
+      sf_poll_events(-1);
+      sf_handle_pending_keys();
+    }
+
+    // Input arriving faster than the frame rate is folded into one frame
+    while (!sf_should_quit && (remaining = frame_end - sf_now_ms()) > 0) {
+      sf_poll_events((int)remaining);
+      sf_handle_pending_keys();
+    }
+  }
+
+  sf_destroy();
+
+  return 0;
+}
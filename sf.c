@@ -1,133 +1,339 @@
-#include "config.h"
-#include <assert.h>
-#include <dirent.h>
-#include <fcntl.h>
-#include <limits.h>
-#include <ncurses.h>
-#include <signal.h>
-#include <stdarg.h>
-#include <stdbool.h>
-#include <stddef.h>
-#include <stdint.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <sys/wait.h>
-#include <unistd.h>
-
-#define SF_HIGHLIGHT_PAIR 1
-#define SF_EMPTY_PAIR 2
-
-/*
- * sf_spawn flags
- */
-#define SF_FLAG_NOTRACE 1 << 0 // Disable child output
-#define SF_FLAG_TERM 1 << 1    // Exit curses white process is running
-#define SF_FLAG_NOWAIT 1 << 2  // Don't wait for the child process to exit
-
-#define SF_HEADER_WIDTH COLS
-#define SF_HEADER_HEIGHT 1
-#define SF_HEADER_Y 0
-#define SF_HEADER_X 0
-
-#define SF_MAIN_PANE_WIDTH (int)(COLS * (SF_PANE_RATIO))
-#define SF_MAIN_PANE_HEIGHT (LINES - SF_HEADER_HEIGHT)
-#define SF_MAIN_PANE_Y 1
-#define SF_MAIN_PANE_X 0
-
-#define SF_SIDE_PANE_WIDTH (COLS - SF_MAIN_PANE_WIDTH)
-#define SF_SIDE_PANE_HEIGHT (LINES - SF_HEADER_HEIGHT)
-#define SF_SIDE_PANE_Y 1
-#define SF_SIDE_PANE_X (SF_MAIN_PANE_WIDTH)
-
-typedef enum sf_entry_type_t {
-  SF_ENTRY_FILE,
-  SF_ENTRY_DIRECTORY,
-  SF_ENTRY_LINK,
-  SF_ENTRY_UNKNOWN,
-} sf_entry_type_t;
-
-typedef struct sf_entry_t {
-  char name[NAME_MAX + 1];
-  sf_entry_type_t type;
-} sf_entry_t;
-
-typedef struct sf_view_t {
-  char path[PATH_MAX];
-  uint32_t selected_entry;
-  uint32_t entry_count;
-  sf_entry_t *entries;
-} sf_view_t;
+#define _GNU_SOURCE
+#include "sf.h"
 
-typedef struct sf_side_view_t {
-  char path[PATH_MAX];
-  uint32_t entry_count;
-  sf_entry_t *entries;
-  bool has_dir;
-} sf_side_view_t;
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+
+// From linux/ioprio.h
+#define SF_IOPRIO_WHO_PROCESS 1
+#define SF_IOPRIO_CLASS_IDLE (3 << 13)
+#endif
 
-typedef struct sf_pane_t {
-  WINDOW *window;
-} sf_pane_t;
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
-// Path when the program was launched
 char sf_initial_path[PATH_MAX];
 
 bool sf_should_quit;
 
+int sf_signal_fds[2] = {-1, -1};
+
+#ifdef __linux__
+int sf_epoll_fd = -1;
+#endif
+
+int sf_inotify_fd = -1;
+sf_watch_t *sf_watches;
+pthread_mutex_t sf_watches_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 bool sf_show_hidden_files;
 
+sf_sort_t sf_sort;
+
 uint32_t sf_current_view;
 
 sf_view_t sf_views[SF_VIEW_COUNT];
 
+sf_dir_t *sf_dirs;
+
 sf_side_view_t sf_side_view;
 
+sf_cache_t sf_cache;
+
+sf_memory_t sf_memory;
+
+sf_pool_t sf_pool;
+
+sf_pool_t sf_stat_pool;
+
+sf_pool_t sf_prefetch_pool;
+
+sf_prefetcher_t sf_prefetcher;
+
+sf_pool_t sf_du_pool;
+
+sf_du_memo_t sf_du_memo[SF_DU_MEMO_SIZE];
+uint32_t sf_du_memo_next;
+
+sf_pool_t sf_find_pool;
+
+sf_finder_t sf_finder;
+
+sf_preview_t *sf_preview_cache[SF_PREVIEW_CACHE_SIZE];
+pthread_mutex_t sf_preview_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+sf_pool_t sf_op_pool;
+
+sf_op_t *sf_ops;
+char sf_op_message[128];
+
+#ifdef SF_TRACE
+sf_tracer_t sf_tracer;
+#endif
+
+bool sf_show_metadata;
+
+bool sf_collate_bytewise = true;
+
 sf_pane_t sf_header_pane;
 sf_pane_t sf_main_pane;
 sf_pane_t sf_side_pane;
 
 /*
- * argv must be either NULL or a NULL terminated array
+ * Tracing functions
  */
-void sf_spawn(char *const argv[], uint32_t flags) {
-  if (flags & SF_FLAG_TERM) {
-    endwin();
+#ifdef SF_TRACE
+const char *sf_trace_category_names[SF_TRACE_CATEGORY_COUNT] = {
+    [SF_TRACE_FRAME] = "frame",
+    [SF_TRACE_DRAW] = "draw",
+    [SF_TRACE_SCAN] = "scan",
+    [SF_TRACE_SORT] = "sort",
+    [SF_TRACE_SIDE_VIEW] = "side_view",
+    [SF_TRACE_PREFETCH] = "prefetch",
+    [SF_TRACE_SPAWN] = "spawn",
+    [SF_TRACE_IO] = "io",
+};
+
+int64_t sf_trace_now_us() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/*
+ * Starts writing a trace in Chrome's JSON array format, which Perfetto and
+ * chrome://tracing load even if the closing bracket is missing after a crash
+ */
+void sf_trace_open(const char *path) {
+  sf_tracer.file = fopen(path, "we");
+  if (sf_tracer.file != NULL) {
+    fputs("[\n", sf_tracer.file);
   }
+}
 
-  pid_t pid = fork();
-  if (pid == 0) {
-    // Disable child output
-    if (flags & SF_FLAG_NOTRACE) {
-      int fd = open("/dev/null", O_WRONLY, 0200);
+void sf_trace_close() {
+  if (sf_tracer.file != NULL) {
+    fputs("\n]\n", sf_tracer.file);
+    fclose(sf_tracer.file);
+    sf_tracer.file = NULL;
+  }
+}
 
-      dup2(fd, 1); // stdout
-      dup2(fd, 2); // stderr
-      close(fd);
+void sf_trace_write_string(const char *s) {
+  fputc('"', sf_tracer.file);
+  for (; *s != '\0'; s++) {
+    unsigned char c = *s;
+    if (c == '"' || c == '\\') {
+      fprintf(sf_tracer.file, "\\%c", c);
+    } else if (c < 0x20) {
+      fprintf(sf_tracer.file, "\\u%04x", c);
+    } else {
+      fputc(c, sf_tracer.file);
     }
+  }
+  fputc('"', sf_tracer.file);
+}
+
+/*
+ * Records a span from start_us to now, detail (a path or program, may be
+ * NULL) and entries are attached to it. Safe to call from worker threads.
+ */
+void sf_trace_span(
+    sf_trace_category_t category,
+    const char *name,
+    int64_t start_us,
+    const char *detail,
+    uint64_t entries) {
+  int64_t duration_us = sf_trace_now_us() - start_us;
+  atomic_fetch_add(&sf_tracer.totals[category].duration_us, duration_us);
+  atomic_fetch_add(&sf_tracer.totals[category].entries, entries);
+
+  if (sf_tracer.file == NULL) {
+    return;
+  }
 
-    if (flags & SF_FLAG_NOWAIT) {
-      signal(SIGHUP, SIG_IGN);
-      signal(SIGPIPE, SIG_IGN);
-      setsid();
+#ifdef __linux__
+  long tid = syscall(SYS_gettid);
+#else
+  long tid = (long)(uintptr_t)pthread_self();
+#endif
+
+  // Events from different threads mustn't interleave
+  flockfile(sf_tracer.file);
+  fputs(sf_tracer.has_events ? ",\n" : "", sf_tracer.file);
+  sf_tracer.has_events = true;
+
+  fputs("{\"name\":", sf_tracer.file);
+  sf_trace_write_string(name);
+  fprintf(
+      sf_tracer.file,
+      ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%" PRId64 ",\"dur\":%" PRId64
+      ",\"pid\":%ld,\"tid\":%ld,\"args\":{\"entries\":%" PRIu64,
+      sf_trace_category_names[category],
+      start_us,
+      duration_us,
+      (long)getpid(),
+      tid,
+      entries);
+  if (detail != NULL) {
+    fputs(",\"detail\":", sf_tracer.file);
+    sf_trace_write_string(detail);
+  }
+  fputs("}}", sf_tracer.file);
+  funlockfile(sf_tracer.file);
+}
+
+/*
+ * Keeps what each category did since the last call for the header
+ */
+void sf_trace_end_frame() {
+  for (uint32_t i = 0; i < SF_TRACE_CATEGORY_COUNT; i++) {
+    sf_trace_stat_t stat = {
+        .duration_us = atomic_exchange(&sf_tracer.totals[i].duration_us, 0),
+        .entries = atomic_exchange(&sf_tracer.totals[i].entries, 0),
+    };
+    if (stat.duration_us > 0 || stat.entries > 0) {
+      sf_tracer.last[i] = stat;
     }
+  }
 
-    execvp(argv[0], argv);
-    _exit(1);
-  } else {
-    if (!(flags & SF_FLAG_NOWAIT))
-      /* Ignore interruptions */
-      while (waitpid(pid, NULL, 0) == -1) {
-      }
-    if (flags & SF_FLAG_TERM) {
-      refresh();
+  if (sf_tracer.file != NULL) {
+    fflush(sf_tracer.file);
+  }
+}
+#endif
+
+/*
+ * argv must be either NULL or a NULL terminated array.
+ * The child runs in the directory referred to by cwd_fd.
+ * posix_spawn doesn't copy sf's page tables the way fork does, so starting
+ * a program takes the same time however much sf has in memory.
+ */
+void sf_spawn(char *const argv[], int cwd_fd, uint32_t flags) {
+  SF_TRACE_BEGIN(trace_start);
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addfchdir_np(&actions, cwd_fd);
+
+  // Disable child output
+  if (flags & SF_FLAG_NOTRACE) {
+    posix_spawn_file_actions_addopen(
+        &actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+  }
+
+  // The child starts with no signals blocked, and programs left running
+  // get a session of their own so closing the terminal doesn't hang them up
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  sigset_t no_signals;
+  sigemptyset(&no_signals);
+  posix_spawnattr_setsigmask(&attr, &no_signals);
+  short spawn_flags = POSIX_SPAWN_SETSIGMASK;
+  if (flags & SF_FLAG_NOWAIT) {
+    spawn_flags |= POSIX_SPAWN_SETSID;
+  }
+  posix_spawnattr_setflags(&attr, spawn_flags);
+
+  if (flags & SF_FLAG_TERM) {
+    endwin();
+  }
+
+  pid_t pid;
+  if (posix_spawnp(&pid, argv[0], &actions, &attr, argv, environ) == 0 &&
+      !(flags & SF_FLAG_NOWAIT)) {
+    /* Ignore interruptions */
+    while (waitpid(pid, NULL, 0) == -1 && errno == EINTR) {
+    }
+  }
+
+  if (flags & SF_FLAG_TERM) {
+    refresh();
+  }
+
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&actions);
+
+  SF_TRACE_END(trace_start, SF_TRACE_SPAWN, "spawn", argv[0], 0);
+}
+
+#ifndef __linux__
+void sf_on_child_exit(int signal) {
+  (void)signal;
+
+  int saved_errno = errno;
+  char byte = 0;
+  write(sf_signal_fds[1], &byte, 1);
+  errno = saved_errno;
+}
+#endif
+
+/*
+ * Reaps every child that exited. Children waited on by sf_spawn are reaped
+ * there, before the main loop gets to this.
+ */
+void sf_reap_children() {
+  while (waitpid(-1, NULL, WNOHANG) > 0) {
+  }
+}
+
+/*
+ * Handles the signals queued on sf_signal_fds. Several of a kind pending at
+ * once are handled once.
+ */
+void sf_handle_signals() {
+#ifdef __linux__
+  bool resized = false;
+  bool exited = false;
+
+  struct signalfd_siginfo info;
+  while (read(sf_signal_fds[0], &info, sizeof(info)) == sizeof(info)) {
+    resized |= info.ssi_signo == SIGWINCH;
+    exited |= info.ssi_signo == SIGCHLD;
+  }
+
+  if (resized) {
+    // The size ncurses would have read in its own SIGWINCH handler
+    struct winsize size;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0) {
+      resizeterm(size.ws_row, size.ws_col);
     }
+    sf_resize_screen();
+  }
+
+  if (exited) {
+    sf_reap_children();
   }
+#else
+  char bytes[64];
+  while (read(sf_signal_fds[0], bytes, sizeof(bytes)) > 0) {
+  }
+
+  sf_reap_children();
+#endif
+}
+
+int64_t sf_now_ms() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
 }
 
 uint32_t sf_get_path_level(const char *path) {
   char rpath[PATH_MAX];
+  SF_TRACE_BEGIN(trace_start);
   realpath(path, rpath);
+  SF_TRACE_END(trace_start, SF_TRACE_IO, "realpath", path, 0);
 
   assert(strlen(rpath) >= 1);
 
@@ -146,6 +352,36 @@ uint32_t sf_get_path_level(const char *path) {
   return level;
 }
 
+/*
+ * Joins a real directory path and an entry name into dest, false if the
+ * joined path doesn't fit in PATH_MAX
+ */
+bool sf_path_join(const char *dir, const char *name, char *dest) {
+  int length;
+  if (strcmp(dir, "/") == 0) {
+    length = snprintf(dest, PATH_MAX, "/%s", name);
+  } else {
+    length = snprintf(dest, PATH_MAX, "%s/%s", dir, name);
+  }
+  return length >= 0 && length < PATH_MAX;
+}
+
+/*
+ * Writes the parent of a real path to dest. Real paths have no symlinks or
+ * dot components, so the parent can be found without touching the disk.
+ */
+void sf_get_parent_path(const char *path, char *dest) {
+  const char *slash = strrchr(path, '/');
+  if (slash == NULL || slash == path) {
+    strcpy(dest, "/");
+    return;
+  }
+
+  size_t length = (size_t)(slash - path);
+  memmove(dest, path, length);
+  dest[length] = '\0';
+}
+
 void sf_get_top_dir_from_path(const char *path, char *dest) {
   assert(strlen(path) > 0);
 
@@ -165,256 +401,6528 @@ void sf_get_top_dir_from_path(const char *path, char *dest) {
   strncpy(dest, &path[slash_index + 1], strlen(path) - slash_index);
 }
 
-int sf_entry_cmp(const void *a, const void *b) {
-  sf_entry_t *entry_a = (sf_entry_t *)a;
-  sf_entry_t *entry_b = (sf_entry_t *)b;
+/*
+ * Listing functions
+ */
+const sf_entry_t *
+sf_listing_entry(const sf_listing_t *listing, uint32_t position) {
+  return &listing->entries[listing->order[position]];
+}
+
+const char *sf_listing_name(const sf_listing_t *listing, uint32_t position) {
+  return listing->names + sf_listing_entry(listing, position)->name_offset;
+}
 
-  if (entry_a->type == SF_ENTRY_DIRECTORY &&
-      entry_b->type != SF_ENTRY_DIRECTORY) {
-    return -1;
+sf_entry_type_t
+sf_listing_type(const sf_listing_t *listing, uint32_t position) {
+  return (sf_entry_type_t)sf_listing_entry(listing, position)->type;
+}
+
+/*
+ * Metadata of the entry at position, NULL if none was ever requested
+ */
+const sf_entry_meta_t *
+sf_listing_meta(const sf_listing_t *listing, uint32_t position) {
+  if (listing->meta == NULL) {
+    return NULL;
   }
+  return &listing->meta[listing->order[position]];
+}
 
-  if (entry_a->type != SF_ENTRY_DIRECTORY &&
-      entry_b->type == SF_ENTRY_DIRECTORY) {
-    return 1;
+const char *
+sf_listing_key(const sf_listing_t *listing, const sf_entry_t *entry) {
+  return (listing->keys != NULL ? listing->keys : listing->names) +
+         entry->key_offset;
+}
+
+/*
+ * Stops results of the jobs in flight from landing in listing
+ */
+void sf_listing_detach_jobs(sf_listing_t *listing) {
+  for (sf_stat_job_t *job = listing->stat_jobs; job != NULL;
+       job = job->next) {
+    atomic_store(&job->job.cancelled, true);
+    job->listing = NULL;
   }
+  listing->stat_jobs = NULL;
+}
 
-  return strcoll(entry_a->name, entry_b->name);
+void sf_listing_destroy(sf_listing_t *listing) {
+  sf_listing_detach_jobs(listing);
+  if (listing->map != NULL) {
+    munmap(listing->map, listing->map_size);
+  } else {
+    free(listing->entries);
+    free(listing->order);
+    free(listing->hash_slots);
+    free(listing->names);
+    free(listing->keys);
+  }
+  for (uint32_t i = 0; i < SF_SORT_COUNT; i++) {
+    free(listing->orders[i]);
+  }
+  free(listing->meta);
+  free(listing->layouts);
+  memset(listing, 0, sizeof(*listing));
 }
 
-void sf_get_entries(
-    const char *path, uint32_t *entry_count, sf_entry_t *entries) {
-  DIR *d = opendir(path);
-  struct dirent *dir;
+/*
+ * Hands the contents of src over to dest, freeing whatever dest held
+ */
+void sf_listing_move(sf_listing_t *dest, sf_listing_t *src) {
+  sf_listing_destroy(dest);
+  *dest = *src;
+  memset(src, 0, sizeof(*src));
 
-#define IS_VALID_ENTRY(name)                                                   \
-  (strcmp(name, ".") != 0 && strcmp(name, "..") != 0 &&                        \
-   (sf_show_hidden_files ? true : (name[0] != '.')))
-
-  if (d) {
-    *entry_count = 0;
-    while ((dir = readdir(d)) != NULL) {
-      if (IS_VALID_ENTRY(dir->d_name)) {
-        (*entry_count)++;
-      }
-    }
-
-    if (entries != NULL) {
-      rewinddir(d);
-      uint32_t i = 0;
-
-      while ((dir = readdir(d)) != NULL) {
-        if (IS_VALID_ENTRY(dir->d_name)) {
-          strncpy(entries[i].name, dir->d_name, strlen(dir->d_name) + 1);
-
-          switch (dir->d_type) {
-          case DT_REG:
-            entries[i].type = SF_ENTRY_FILE;
-            break;
-          case DT_DIR:
-            entries[i].type = SF_ENTRY_DIRECTORY;
-            break;
-          case DT_LNK:
-            entries[i].type = SF_ENTRY_LINK;
-            break;
-          default:
-            entries[i].type = SF_ENTRY_UNKNOWN;
-            break;
-          }
-
-          i++;
-        }
-      }
+  for (sf_stat_job_t *job = dest->stat_jobs; job != NULL; job = job->next) {
+    job->listing = dest;
+  }
+}
+
+/*
+ * Makes dest an exact-size copy of the live entries of src. Metadata isn't
+ * copied, it goes stale without the directory changing.
+ */
+bool sf_listing_copy(sf_listing_t *dest, const sf_listing_t *src) {
+  sf_listing_t copy = {0};
+
+  if (src->entry_count > 0) {
+    copy.entries = malloc(sizeof(sf_entry_t) * src->entry_count);
+    copy.order = malloc(sizeof(uint32_t) * src->entry_count);
+    copy.hash_slots = malloc(sizeof(uint32_t) * src->hash_capacity);
+    copy.names = malloc(src->names_size);
+    if (src->keys != NULL) {
+      copy.keys = malloc(src->keys_size);
+    }
+    if (copy.entries == NULL || copy.order == NULL ||
+        copy.hash_slots == NULL || copy.names == NULL ||
+        (src->keys != NULL && copy.keys == NULL)) {
+      sf_listing_destroy(&copy);
+      return false;
     }
 
-    closedir(d);
+    memcpy(copy.entries, src->entries, sizeof(sf_entry_t) * src->entry_count);
+    memcpy(copy.order, src->order, sizeof(uint32_t) * src->count);
+    memcpy(
+        copy.hash_slots, src->hash_slots, sizeof(uint32_t) * src->hash_capacity);
+    memcpy(copy.names, src->names, src->names_size);
+    if (src->keys != NULL) {
+      memcpy(copy.keys, src->keys, src->keys_size);
+    }
+    copy.entry_count = copy.entry_capacity = src->entry_count;
+    copy.count = src->count;
+    copy.sort = src->sort;
+    copy.unknown_count = src->unknown_count;
+    copy.hidden_count = src->hidden_count;
+    copy.unsorted = src->unsorted;
+    copy.hash_capacity = src->hash_capacity;
+    copy.names_size = copy.names_capacity = src->names_size;
+    copy.keys_size = copy.keys_capacity = src->keys_size;
+    copy.garbage_size = src->garbage_size;
   }
 
-  if (entries != NULL) {
-    qsort(entries, *entry_count, sizeof(sf_entry_t), sf_entry_cmp);
-  }
+  sf_listing_move(dest, &copy);
+  return true;
 }
 
-void sf_color_on(short pair) {
-  if (has_colors()) {
-    attron(COLOR_PAIR(pair));
+size_t sf_listing_size(const sf_listing_t *listing) {
+  size_t size = (sizeof(sf_entry_t) + sizeof(uint32_t)) *
+                    listing->entry_capacity +
+                sizeof(uint32_t) * listing->hash_capacity +
+                listing->names_capacity + listing->keys_capacity;
+  if (listing->meta != NULL) {
+    size += sizeof(sf_entry_meta_t) * listing->entry_capacity;
+  }
+  if (listing->layouts != NULL) {
+    size += sizeof(sf_entry_layout_t) * listing->entry_capacity;
   }
+  for (uint32_t i = 0; i < SF_SORT_COUNT; i++) {
+    if (listing->orders[i] != NULL) {
+      size += sizeof(uint32_t) * listing->entry_capacity;
+    }
+  }
+  return size;
 }
 
-void sf_color_off(short pair) {
-  if (has_colors()) {
-    attroff(COLOR_PAIR(pair));
-  }
+bool sf_sort_uses_meta(sf_sort_t sort) {
+  return sort == SF_SORT_SIZE || sort == SF_SORT_MTIME;
 }
 
-void sf_pcolor_on(sf_pane_t *pane, short pair) {
-  if (has_colors()) {
-    wattron(pane->window, COLOR_PAIR(pair));
+const char *sf_sort_name(sf_sort_t sort) {
+  switch (sort) {
+  case SF_SORT_NAME:
+    return "name";
+  case SF_SORT_SIZE:
+    return "size";
+  case SF_SORT_MTIME:
+    return "modified";
+  case SF_SORT_EXTENSION:
+    return "extension";
+  case SF_SORT_VERSION:
+    return "version";
+  default:
+    return "";
   }
 }
 
-void sf_pcolor_off(sf_pane_t *pane, short pair) {
-  if (has_colors()) {
-    wattroff(pane->window, COLOR_PAIR(pair));
+/*
+ * Offset of the extension of a name of length bytes, past its last dot, or
+ * length if it has none. Hidden names aren't all extension.
+ */
+uint32_t sf_name_extension(const char *name, uint32_t length) {
+  for (uint32_t i = length; i > 1; i--) {
+    if (name[i - 1] == '.') {
+      return i;
+    }
   }
+  return length;
 }
 
 /*
- * Side view functions
+ * Compares names like ls -v: runs of digits by their value, everything else
+ * bytewise
  */
-void sf_side_view_set_path(sf_side_view_t *side_view, const char *path) {
-  if (strlen(path) == 0) {
-    side_view->entry_count = 0;
-    free(side_view->entries);
-    side_view->entries = NULL;
-    return;
-  }
+int sf_version_cmp(const char *a, const char *b) {
+  while (*a != '\0' && *b != '\0') {
+    if (!isdigit((unsigned char)*a) || !isdigit((unsigned char)*b)) {
+      if (*a != *b) {
+        return (int)(unsigned char)*a - (int)(unsigned char)*b;
+      }
+      a++;
+      b++;
+      continue;
+    }
 
-  char rpath[PATH_MAX];
-  realpath(path, rpath);
-  if (chdir(rpath) == 0) {
-    // Success
-    strncpy(side_view->path, rpath, strlen(rpath) + 1);
-    sf_get_entries(".", &side_view->entry_count, NULL);
-    side_view->entries = realloc(
-        side_view->entries, sizeof(sf_entry_t) * side_view->entry_count);
-    sf_get_entries(".", &side_view->entry_count, side_view->entries);
-
-    chdir(sf_views[sf_current_view].path);
-    side_view->has_dir = true;
-  } else {
-    side_view->has_dir = false;
-    side_view->entry_count = 0;
+    while (*a == '0') {
+      a++;
+    }
+    while (*b == '0') {
+      b++;
+    }
+    const char *digits_a = a, *digits_b = b;
+    while (isdigit((unsigned char)*a)) {
+      a++;
+    }
+    while (isdigit((unsigned char)*b)) {
+      b++;
+    }
+
+    // Without leading zeros, longer numbers are larger
+    if (a - digits_a != b - digits_b) {
+      return a - digits_a < b - digits_b ? -1 : 1;
+    }
+    int result = memcmp(digits_a, digits_b, (size_t)(a - digits_a));
+    if (result != 0) {
+      return result;
+    }
   }
+  return (*a != '\0') - (*b != '\0');
 }
 
-void sf_side_view_init(sf_side_view_t *side_view) {
-  side_view->entry_count = 0;
-  side_view->entries = NULL;
-  side_view->has_dir = false;
-  sf_side_view_set_path(side_view, "");
-}
+/*
+ * First bytes of what the listing's sort compares entries by, in an order
+ * sf_entry_cmp agrees with, so most entries sort by a radix sort of them
+ * and only ties are compared in full
+ */
+uint64_t
+sf_listing_sort_prefix(const sf_listing_t *listing, const sf_entry_t *entry) {
+  switch ((sf_sort_t)listing->sort) {
+  case SF_SORT_SIZE:
+  case SF_SORT_MTIME: {
+    // Entries without metadata come last. Flipping the sign bit orders
+    // signed values as unsigned, inverting puts the largest first.
+    const sf_entry_meta_t *meta =
+        listing->meta != NULL ? &listing->meta[entry - listing->entries]
+                              : NULL;
+    if (meta == NULL || meta->state != SF_META_DONE) {
+      return UINT64_MAX;
+    }
+    int64_t value = listing->sort == SF_SORT_SIZE ? meta->size : meta->mtime;
+    uint64_t prefix = ~((uint64_t)value ^ (1ull << 63));
+    return prefix == UINT64_MAX ? UINT64_MAX - 1 : prefix;
+  }
+  case SF_SORT_EXTENSION: {
+    const char *name = listing->names + entry->name_offset;
+    uint32_t extension = sf_name_extension(name, entry->name_length);
+    return sf_key_prefix(name + extension, entry->name_length - extension);
+  }
+  case SF_SORT_VERSION: {
+    // Runs of digits are written as '0', which orders against anything else
+    // like any digit does, then how many digits there are and the digits,
+    // leading zeros aside
+    const char *name = listing->names + entry->name_offset;
+    uint8_t bytes[8] = {0};
+    uint32_t length = 0;
+    for (uint32_t i = 0; i < entry->name_length && length < 8;) {
+      if (!isdigit((unsigned char)name[i])) {
+        bytes[length++] = (uint8_t)name[i++];
+        continue;
+      }
 
-void sf_side_view_destroy(sf_side_view_t *side_view) {
-  if (side_view->entries != NULL) {
-    free(side_view->entries);
+      while (name[i] == '0') {
+        i++;
+      }
+      uint32_t digits = i;
+      while (isdigit((unsigned char)name[i])) {
+        i++;
+      }
+      bytes[length++] = '0';
+      if (length < 8) {
+        bytes[length++] = (uint8_t)(i - digits);
+      }
+      for (; digits < i && length < 8; digits++) {
+        bytes[length++] = (uint8_t)name[digits];
+      }
+    }
+    return sf_key_prefix((const char *)bytes, 8);
+  }
+  default:
+    return entry->key_prefix;
   }
 }
 
-void sf_side_view_update(sf_side_view_t *side_view, sf_view_t *view) {
-  if (view->entry_count <= 0) {
-    side_view->has_dir = false;
-    return;
+/*
+ * Compares two entries of the same listing by what its sort orders them by,
+ * before their names
+ */
+int sf_entry_sort_cmp(
+    const sf_listing_t *listing, const sf_entry_t *a, const sf_entry_t *b) {
+  uint64_t prefix_a = sf_listing_sort_prefix(listing, a);
+  uint64_t prefix_b = sf_listing_sort_prefix(listing, b);
+  if (prefix_a != prefix_b) {
+    return prefix_a < prefix_b ? -1 : 1;
   }
 
-  sf_entry_t *entry = &view->entries[view->selected_entry];
-  if (entry->type == SF_ENTRY_DIRECTORY) {
-    // Show directory in side pane
-    char path[PATH_MAX] = "";
-    strcat(path, view->path);
-    strcat(path, "/");
-    strcat(path, entry->name);
-    sf_side_view_set_path(side_view, path);
-  } else {
-    side_view->has_dir = false;
+  const char *name_a = listing->names + a->name_offset;
+  const char *name_b = listing->names + b->name_offset;
+  switch ((sf_sort_t)listing->sort) {
+  case SF_SORT_EXTENSION: {
+    uint32_t extension_a = sf_name_extension(name_a, a->name_length);
+    uint32_t extension_b = sf_name_extension(name_b, b->name_length);
+    uint32_t length_a = a->name_length - extension_a;
+    uint32_t length_b = b->name_length - extension_b;
+    int result = memcmp(
+        name_a + extension_a,
+        name_b + extension_b,
+        length_a < length_b ? length_a : length_b);
+    if (result != 0) {
+      return result;
+    }
+    return (int)length_a - (int)length_b;
+  }
+  case SF_SORT_VERSION: {
+    return sf_version_cmp(name_a, name_b);
+  }
+  default:
+    return 0;
   }
 }
 
 /*
- * View functions
+ * Compares two entries of the same listing: directories first, then by the
+ * listing's sort, then by collation key, which orders like strcoll on the
+ * names
  */
-void sf_view_set_selected_entry(sf_view_t *view, uint32_t entry_index) {
-  view->selected_entry = entry_index;
+int sf_entry_cmp(const void *a, const void *b, void *listing) {
+  const sf_entry_t *entry_a = (const sf_entry_t *)a;
+  const sf_entry_t *entry_b = (const sf_entry_t *)b;
 
-  if (entry_index >= view->entry_count) {
-    entry_index = view->entry_count - 1;
+  if (entry_a->sort_class != entry_b->sort_class) {
+    return (int)entry_a->sort_class - (int)entry_b->sort_class;
   }
 
-  if (entry_index < 0) {
-    entry_index = 0;
+  if (((sf_listing_t *)listing)->sort != SF_SORT_NAME) {
+    int result = sf_entry_sort_cmp(listing, entry_a, entry_b);
+    if (result != 0) {
+      return result;
+    }
   }
 
-  sf_side_view_update(&sf_side_view, view);
-}
-
-void sf_view_update_entries(sf_view_t *view) {
-  sf_get_entries(".", &view->entry_count, NULL);
-  view->entries =
-      realloc(view->entries, sizeof(sf_entry_t) * view->entry_count);
-  sf_get_entries(".", &view->entry_count, view->entries);
-}
-
-bool sf_view_set_path(sf_view_t *view, const char *path) {
-  char rpath[PATH_MAX];
-  realpath(path, rpath);
-  if (chdir(rpath) == 0) {
-    // Success
-    strncpy(view->path, rpath, strlen(rpath) + 1);
-    sf_view_update_entries(view);
-    chdir(sf_views[sf_current_view].path);
-    return true;
+  if (entry_a->key_prefix != entry_b->key_prefix) {
+    return entry_a->key_prefix < entry_b->key_prefix ? -1 : 1;
   }
 
-  return false;
-}
+  uint16_t length = entry_a->key_length < entry_b->key_length
+                        ? entry_a->key_length
+                        : entry_b->key_length;
+  int result = memcmp(
+      sf_listing_key(listing, entry_a),
+      sf_listing_key(listing, entry_b),
+      length);
+  if (result != 0) {
+    return result;
+  }
 
-void sf_view_init(sf_view_t *view) {
-  view->entry_count = 0;
-  view->entries = NULL;
-  view->selected_entry = 0;
-  sf_view_set_path(view, sf_initial_path);
+  return (int)entry_a->key_length - (int)entry_b->key_length;
 }
 
-void sf_view_destroy(sf_view_t *view) {
-  if (view->entries != NULL) {
-    free(view->entries);
-  }
+/*
+ * Compares two entry indices of listing
+ */
+int sf_index_cmp(const void *a, const void *b, void *data) {
+  sf_listing_t *listing = (sf_listing_t *)data;
+  return sf_entry_cmp(
+      &listing->entries[*(const uint32_t *)a],
+      &listing->entries[*(const uint32_t *)b],
+      listing);
 }
 
-void sf_set_view(uint32_t view_index) {
-  assert(view_index >= 0 && view_index < SF_VIEW_COUNT);
-  sf_current_view = view_index;
+/*
+ * What the sort moves around instead of the entries themselves
+ */
+typedef struct sf_sort_item_t {
+  uint64_t key_prefix;
+  uint32_t index;
+} sf_sort_item_t;
 
-  chdir(sf_views[sf_current_view].path);
-  sf_side_view_update(&sf_side_view, &sf_views[sf_current_view]);
+int sf_sort_item_cmp(const void *a, const void *b, void *data) {
+  sf_listing_t *listing = (sf_listing_t *)data;
+  return sf_entry_cmp(
+      &listing->entries[((const sf_sort_item_t *)a)->index],
+      &listing->entries[((const sf_sort_item_t *)b)->index],
+      listing);
 }
 
 /*
- * Pane functions
+ * Sorts items by key_prefix with an LSD radix sort, skipping the byte
+ * positions where every item has the same value
  */
-void sf_pane_init(sf_pane_t *pane, int height, int width, int y, int x) {
-  pane->window = newwin(height, width, y, x);
-}
+void sf_sort_items_radix_sort(
+    sf_sort_item_t *items, sf_sort_item_t *tmp, uint32_t n) {
+  uint32_t counts[8][256] = {{0}};
+  for (uint32_t i = 0; i < n; i++) {
+    for (uint32_t byte = 0; byte < 8; byte++) {
+      counts[byte][(items[i].key_prefix >> (byte * 8)) & 0xff]++;
+    }
+  }
 
-void sf_pane_resize(sf_pane_t *pane, int height, int width, int y, int x) {
-  delwin(pane->window);
-  pane->window = newwin(height, width, y, x);
-}
+  sf_sort_item_t *src = items;
+  sf_sort_item_t *dst = tmp;
+  for (uint32_t byte = 0; byte < 8; byte++) {
+    uint32_t *count = counts[byte];
+    if (count[(src[0].key_prefix >> (byte * 8)) & 0xff] == n) {
+      continue;
+    }
 
-void sf_pane_destroy(sf_pane_t *pane) { delwin(pane->window); }
+    uint32_t offset = 0;
+    for (uint32_t value = 0; value < 256; value++) {
+      uint32_t c = count[value];
+      count[value] = offset;
+      offset += c;
+    }
 
-void sf_init() {
-  sf_should_quit = false;
-  sf_show_hidden_files = false;
+    for (uint32_t i = 0; i < n; i++) {
+      dst[count[(src[i].key_prefix >> (byte * 8)) & 0xff]++] = src[i];
+    }
 
-  getcwd(sf_initial_path, sizeof(sf_initial_path));
+    sf_sort_item_t *swap = src;
+    src = dst;
+    dst = swap;
+  }
 
-  for (uint32_t i = 0; i < SF_VIEW_COUNT; i++) {
-    sf_view_init(&sf_views[i]);
+  if (src != items) {
+    memcpy(items, src, sizeof(sf_sort_item_t) * n);
   }
+}
 
-  sf_side_view_init(&sf_side_view);
+/*
+ * Whether entries with the same sort prefix as entry tie in the listing's
+ * sort, and are only ordered by name then
+ */
+bool sf_listing_sort_prefix_exact(
+    const sf_listing_t *listing, const sf_entry_t *entry) {
+  switch ((sf_sort_t)listing->sort) {
+  case SF_SORT_SIZE:
+  case SF_SORT_MTIME: {
+    return true;
+  }
+  case SF_SORT_EXTENSION: {
+    const char *name = listing->names + entry->name_offset;
+    return entry->name_length - sf_name_extension(name, entry->name_length) <
+           8;
+  }
+  default:
+    return false;
+  }
+}
+
+/*
+ * Sorts one run of items sharing a sort class using their precomputed
+ * keys. Only items whose key prefixes tie need a full key comparison.
+ * Unless by_name is set the prefixes are sort prefixes, and runs of them
+ * that tie in the sort are sorted again by their names' key prefixes.
+ */
+void sf_listing_sort_run(
+    sf_listing_t *listing,
+    sf_sort_item_t *items,
+    sf_sort_item_t *tmp,
+    uint32_t n,
+    bool by_name) {
+  if (n < 2) {
+    return;
+  }
+
+  sf_sort_items_radix_sort(items, tmp, n);
+
+  for (uint32_t start = 0; start < n;) {
+    uint32_t end = start + 1;
+    const sf_entry_t *entries = listing->entries;
+    bool exact =
+        !by_name &&
+        sf_listing_sort_prefix_exact(listing, &entries[items[start].index]);
+    while (end < n && items[end].key_prefix == items[start].key_prefix) {
+      exact = exact &&
+              sf_listing_sort_prefix_exact(listing, &entries[items[end].index]);
+      end++;
+    }
+
+    if (end - start > 1 && exact) {
+      for (uint32_t i = start; i < end; i++) {
+        items[i].key_prefix = listing->entries[items[i].index].key_prefix;
+      }
+      sf_listing_sort_run(listing, items + start, tmp, end - start, true);
+    } else if (end - start > 1) {
+      qsort_r(
+          &items[start],
+          end - start,
+          sizeof(sf_sort_item_t),
+          sf_sort_item_cmp,
+          listing);
+    }
+
+    start = end;
+  }
+}
+
+/*
+ * Sorts the display order of the live entries in the listing's sort
+ */
+void sf_listing_sort(sf_listing_t *listing) {
+  listing->unsorted = false;
+
+  uint32_t n = listing->count;
+  if (n < 2) {
+    return;
+  }
+
+  sf_sort_item_t *items = malloc(sizeof(sf_sort_item_t) * n * 2);
+  if (items == NULL) {
+    qsort_r(listing->order, n, sizeof(uint32_t), sf_index_cmp, listing);
+    return;
+  }
+  sf_sort_item_t *tmp = items + n;
+  SF_TRACE_BEGIN(trace_start);
+
+  // Stable partition of directories before everything else in one pass
+  uint32_t directory_count = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    if (sf_listing_entry(listing, i)->sort_class == 0) {
+      directory_count++;
+    }
+  }
+
+  bool by_name = listing->sort == SF_SORT_NAME;
+  uint32_t dirs = 0, others = directory_count;
+  for (uint32_t i = 0; i < n; i++) {
+    const sf_entry_t *entry = sf_listing_entry(listing, i);
+    items[entry->sort_class == 0 ? dirs++ : others++] = (sf_sort_item_t){
+        .key_prefix = by_name ? entry->key_prefix
+                              : sf_listing_sort_prefix(listing, entry),
+        .index = listing->order[i],
+    };
+  }
+
+  sf_listing_sort_run(listing, items, tmp, directory_count, by_name);
+  sf_listing_sort_run(
+      listing, items + directory_count, tmp, n - directory_count, by_name);
+
+  for (uint32_t i = 0; i < n; i++) {
+    listing->order[i] = items[i].index;
+  }
+
+  free(items);
+  SF_TRACE_END(
+      trace_start, SF_TRACE_SORT, "sort", sf_sort_name(listing->sort), n);
+}
+
+/*
+ * Drops the display orders kept for other sorts, once they're outdated
+ */
+void sf_listing_drop_orders(sf_listing_t *listing) {
+  for (uint32_t i = 0; i < SF_SORT_COUNT; i++) {
+    free(listing->orders[i]);
+    listing->orders[i] = NULL;
+  }
+}
+
+/*
+ * Switches the display order to the one of sort. The current order is kept
+ * if it's sorted, and the one of sort is reused if it was kept, otherwise
+ * the listing is left unsorted for its owner to sort.
+ */
+bool sf_listing_set_sort(sf_listing_t *listing, sf_sort_t sort) {
+  if (listing->sort == sort) {
+    return true;
+  }
+
+  if (listing->entry_capacity == 0) {
+    listing->sort = sort;
+    return true;
+  }
+
+  if (!sf_listing_unmap(listing)) {
+    return false;
+  }
+
+  uint32_t *order = listing->orders[sort];
+  bool kept = order != NULL;
+  if (!kept) {
+    order = malloc(sizeof(uint32_t) * listing->entry_capacity);
+    if (order == NULL) {
+      return false;
+    }
+    memcpy(order, listing->order, sizeof(uint32_t) * listing->count);
+  }
+  listing->orders[sort] = NULL;
+
+  if (listing->unsorted) {
+    free(listing->order);
+  } else {
+    listing->orders[listing->sort] = listing->order;
+  }
+  listing->order = order;
+  listing->sort = sort;
+  listing->unsorted = !kept;
+  return true;
+}
+
+// Hidden entries are kept, views decide whether to show them
+#define IS_VALID_ENTRY(name) (strcmp(name, ".") != 0 && strcmp(name, "..") != 0)
+
+sf_entry_type_t sf_entry_type_from_dtype(unsigned char d_type) {
+  switch (d_type) {
+  case DT_REG:
+    return SF_ENTRY_FILE;
+  case DT_DIR:
+    return SF_ENTRY_DIRECTORY;
+  case DT_LNK:
+    return SF_ENTRY_LINK;
+  default:
+    return SF_ENTRY_UNKNOWN;
+  }
+}
+
+/*
+ * Capacity an arena of size bytes out of capacity grows to for needed more
+ */
+uint32_t sf_arena_capacity(uint32_t capacity, uint32_t size, size_t needed) {
+  if (size + needed <= capacity) {
+    return capacity;
+  }
+
+  uint32_t new_capacity =
+      capacity == 0 ? SF_SCAN_INITIAL_CAPACITY * 16 : capacity * 2;
+  while (size + needed > new_capacity) {
+    new_capacity *= 2;
+  }
+  return new_capacity;
+}
+
+/*
+ * Grows an arena so at least needed more bytes fit
+ */
+bool sf_arena_reserve(
+    char **data, uint32_t *capacity, uint32_t size, size_t needed) {
+  if (size + needed <= *capacity) {
+    return true;
+  }
+
+  uint32_t new_capacity = sf_arena_capacity(*capacity, size, needed);
+  char *new_data = realloc(*data, new_capacity);
+  if (new_data == NULL) {
+    return false;
+  }
+
+  *data = new_data;
+  *capacity = new_capacity;
+  return true;
+}
+
+uint64_t sf_key_prefix(const char *key, size_t length) {
+  uint64_t prefix = 0;
+  for (size_t i = 0; i < 8; i++) {
+    prefix <<= 8;
+    if (i < length) {
+      prefix |= (unsigned char)key[i];
+    }
+  }
+  return prefix;
+}
+
+/*
+ * Computes the collation key of the entry, once, when it's added
+ */
+bool sf_listing_set_key(sf_listing_t *listing, sf_entry_t *entry) {
+  const char *name = listing->names + entry->name_offset;
+
+  if (sf_collate_bytewise) {
+    entry->key_offset = entry->name_offset;
+    entry->key_length = entry->name_length;
+    entry->key_prefix = sf_key_prefix(name, entry->name_length);
+    return true;
+  }
+
+  size_t guess = entry->name_length * 4 + 16;
+  for (;;) {
+    if (!sf_arena_reserve(
+            &listing->keys,
+            &listing->keys_capacity,
+            listing->keys_size,
+            guess)) {
+      return false;
+    }
+
+    char *key = listing->keys + listing->keys_size;
+    size_t length = strxfrm(key, name, guess);
+    if (length < guess) {
+      entry->key_offset = listing->keys_size;
+      entry->key_length = length > UINT16_MAX ? UINT16_MAX : (uint16_t)length;
+      entry->key_prefix = sf_key_prefix(key, length);
+      listing->keys_size += length + 1;
+      return true;
+    }
+
+    guess = length + 1;
+  }
+}
+
+/*
+ * FNV-1a hash of a name
+ */
+uint32_t sf_name_hash(const char *name, size_t length) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (unsigned char)name[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+uint32_t sf_listing_hash_slot(const sf_listing_t *listing, uint32_t index) {
+  const sf_entry_t *entry = &listing->entries[index];
+  return sf_name_hash(listing->names + entry->name_offset, entry->name_length) &
+         (listing->hash_capacity - 1);
+}
+
+void sf_listing_hash_insert(sf_listing_t *listing, uint32_t index) {
+  uint32_t mask = listing->hash_capacity - 1;
+  uint32_t slot = sf_listing_hash_slot(listing, index);
+  while (listing->hash_slots[slot] != 0) {
+    slot = (slot + 1) & mask;
+  }
+  listing->hash_slots[slot] = index + 1;
+}
+
+/*
+ * Makes room in the hash for count live entries, keeping it at most half
+ * full so probe sequences stay short
+ */
+bool sf_listing_hash_reserve(sf_listing_t *listing, uint32_t count) {
+  if (count * 2 <= listing->hash_capacity) {
+    return true;
+  }
+
+  uint32_t capacity = listing->hash_capacity == 0 ? SF_SCAN_INITIAL_CAPACITY * 2
+                                                 : listing->hash_capacity;
+  while (count * 2 > capacity) {
+    capacity *= 2;
+  }
+
+  uint32_t *slots = calloc(capacity, sizeof(uint32_t));
+  if (slots == NULL) {
+    return false;
+  }
+
+  free(listing->hash_slots);
+  listing->hash_slots = slots;
+  listing->hash_capacity = capacity;
+  for (uint32_t i = 0; i < listing->count; i++) {
+    sf_listing_hash_insert(listing, listing->order[i]);
+  }
+  return true;
+}
+
+/*
+ * Removes an entry from the hash, shifting back the entries that probed
+ * past it so no tombstone is needed
+ */
+void sf_listing_hash_remove(sf_listing_t *listing, uint32_t index) {
+  uint32_t mask = listing->hash_capacity - 1;
+  uint32_t hole = sf_listing_hash_slot(listing, index);
+  while (listing->hash_slots[hole] != index + 1) {
+    if (listing->hash_slots[hole] == 0) {
+      return;
+    }
+    hole = (hole + 1) & mask;
+  }
+
+  for (uint32_t slot = (hole + 1) & mask; listing->hash_slots[slot] != 0;
+       slot = (slot + 1) & mask) {
+    uint32_t home =
+        sf_listing_hash_slot(listing, listing->hash_slots[slot] - 1);
+    // Entries whose home is cyclically within (hole, slot] stay put
+    bool stays = hole <= slot ? (home > hole && home <= slot)
+                              : (home > hole || home <= slot);
+    if (!stays) {
+      listing->hash_slots[hole] = listing->hash_slots[slot];
+      hole = slot;
+    }
+  }
+  listing->hash_slots[hole] = 0;
+}
+
+/*
+ * Finds the index of the live entry called name
+ */
+bool sf_listing_lookup(
+    const sf_listing_t *listing, const char *name, uint32_t *index) {
+  if (listing->hash_capacity == 0) {
+    return false;
+  }
+
+  size_t length = strlen(name);
+  uint32_t mask = listing->hash_capacity - 1;
+  for (uint32_t slot = sf_name_hash(name, length) & mask;
+       listing->hash_slots[slot] != 0;
+       slot = (slot + 1) & mask) {
+    const sf_entry_t *entry = &listing->entries[listing->hash_slots[slot] - 1];
+    if (entry->name_length == length &&
+        memcmp(listing->names + entry->name_offset, name, length) == 0) {
+      *index = listing->hash_slots[slot] - 1;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/*
+ * Grows the entry table, and everything indexed like it, to capacity
+ */
+bool sf_listing_reserve(sf_listing_t *listing, uint32_t capacity) {
+  sf_entry_t *entries =
+      realloc(listing->entries, sizeof(sf_entry_t) * capacity);
+  if (entries == NULL) {
+    return false;
+  }
+  listing->entries = entries;
+
+  uint32_t *order = realloc(listing->order, sizeof(uint32_t) * capacity);
+  if (order == NULL) {
+    return false;
+  }
+  listing->order = order;
+
+  if (listing->meta != NULL) {
+    sf_entry_meta_t *meta =
+        realloc(listing->meta, sizeof(sf_entry_meta_t) * capacity);
+    if (meta == NULL) {
+      return false;
+    }
+    memset(
+        meta + listing->entry_capacity,
+        0,
+        sizeof(sf_entry_meta_t) * (capacity - listing->entry_capacity));
+    listing->meta = meta;
+  }
+
+  if (listing->layouts != NULL) {
+    sf_entry_layout_t *layouts =
+        realloc(listing->layouts, sizeof(sf_entry_layout_t) * capacity);
+    if (layouts == NULL) {
+      return false;
+    }
+    memset(
+        layouts + listing->entry_capacity,
+        0,
+        sizeof(sf_entry_layout_t) * (capacity - listing->entry_capacity));
+    listing->layouts = layouts;
+  }
+
+  listing->entry_capacity = capacity;
+  return true;
+}
+
+/*
+ * Adds an entry at the end of the display order
+ */
+bool sf_listing_push(
+    sf_listing_t *listing, const char *name, unsigned char d_type) {
+  if (!sf_listing_unmap(listing)) {
+    return false;
+  }
+  sf_listing_drop_orders(listing);
+  // Metadata of the new entry is fetched too
+  listing->meta_requested = false;
+
+  if (listing->entry_count == listing->entry_capacity &&
+      !sf_listing_reserve(
+          listing,
+          listing->entry_capacity == 0 ? SF_SCAN_INITIAL_CAPACITY
+                                       : listing->entry_capacity * 2)) {
+    return false;
+  }
+
+  size_t length = strlen(name);
+  if (!sf_listing_hash_reserve(listing, listing->count + 1) ||
+      !sf_arena_reserve(
+          &listing->names,
+          &listing->names_capacity,
+          listing->names_size,
+          length + 1)) {
+    return false;
+  }
+
+  sf_entry_t *entry = &listing->entries[listing->entry_count];
+  entry->name_offset = listing->names_size;
+  entry->name_length = (uint16_t)length;
+  entry->type = sf_entry_type_from_dtype(d_type);
+  entry->sort_class = entry->type == SF_ENTRY_DIRECTORY ? 0 : 1;
+  entry->hidden = name[0] == '.';
+
+  memcpy(listing->names + listing->names_size, name, length + 1);
+  listing->names_size += length + 1;
+
+  if (!sf_listing_set_key(listing, entry)) {
+    listing->names_size -= length + 1;
+    return false;
+  }
+
+  if (entry->type == SF_ENTRY_UNKNOWN) {
+    listing->unknown_count++;
+  }
+  listing->hidden_count += entry->hidden;
+
+  if (listing->meta != NULL) {
+    memset(&listing->meta[listing->entry_count], 0, sizeof(sf_entry_meta_t));
+  }
+  if (listing->layouts != NULL) {
+    memset(
+        &listing->layouts[listing->entry_count], 0, sizeof(sf_entry_layout_t));
+  }
+
+  sf_listing_hash_insert(listing, listing->entry_count);
+  listing->order[listing->count++] = listing->entry_count++;
+  listing->unsorted = true;
+  return true;
+}
+
+/*
+ * Adds the entries at positions [first, count) of src at the end of dest,
+ * reusing their collation keys
+ */
+bool sf_listing_append(
+    sf_listing_t *dest, const sf_listing_t *src, uint32_t first) {
+  if (first < src->count && !sf_listing_unmap(dest)) {
+    return false;
+  }
+  if (first < src->count) {
+    sf_listing_drop_orders(dest);
+    dest->meta_requested = false;
+  }
+
+  for (uint32_t i = first; i < src->count; i++) {
+    if (dest->entry_count == dest->entry_capacity &&
+        !sf_listing_reserve(
+            dest,
+            dest->entry_capacity == 0 ? SF_SCAN_INITIAL_CAPACITY
+                                      : dest->entry_capacity * 2)) {
+      return false;
+    }
+
+    sf_entry_t entry = *sf_listing_entry(src, i);
+    if (!sf_listing_hash_reserve(dest, dest->count + 1) ||
+        !sf_arena_reserve(
+            &dest->names,
+            &dest->names_capacity,
+            dest->names_size,
+            entry.name_length + 1)) {
+      return false;
+    }
+    if (src->keys != NULL &&
+        !sf_arena_reserve(
+            &dest->keys,
+            &dest->keys_capacity,
+            dest->keys_size,
+            entry.key_length + 1)) {
+      return false;
+    }
+
+    memcpy(
+        dest->names + dest->names_size,
+        src->names + entry.name_offset,
+        entry.name_length + 1);
+    entry.name_offset = dest->names_size;
+    dest->names_size += entry.name_length + 1;
+
+    if (src->keys == NULL) {
+      entry.key_offset = entry.name_offset;
+    } else {
+      memcpy(
+          dest->keys + dest->keys_size,
+          src->keys + entry.key_offset,
+          entry.key_length + 1);
+      entry.key_offset = dest->keys_size;
+      dest->keys_size += entry.key_length + 1;
+    }
+
+    if (entry.type == SF_ENTRY_UNKNOWN) {
+      dest->unknown_count++;
+    }
+    dest->hidden_count += entry.hidden;
+    if (dest->meta != NULL) {
+      memset(&dest->meta[dest->entry_count], 0, sizeof(sf_entry_meta_t));
+    }
+    if (dest->layouts != NULL) {
+      memset(&dest->layouts[dest->entry_count], 0, sizeof(sf_entry_layout_t));
+    }
+
+    dest->entries[dest->entry_count] = entry;
+    sf_listing_hash_insert(dest, dest->entry_count);
+    dest->order[dest->count++] = dest->entry_count++;
+    dest->unsorted = true;
+  }
+
+  return true;
+}
+
+/*
+ * Position of the first entry not ordered before entry
+ */
+uint32_t sf_listing_lower_bound(
+    sf_listing_t *listing, const sf_entry_t *entry, uint32_t count) {
+  uint32_t low = 0, high = count;
+  while (low < high) {
+    uint32_t mid = low + (high - low) / 2;
+    if (sf_entry_cmp(sf_listing_entry(listing, mid), entry, listing) < 0) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+/*
+ * Adds one entry to a sorted listing at its sorted position
+ */
+bool sf_listing_insert(
+    sf_listing_t *listing,
+    const char *name,
+    unsigned char d_type,
+    uint32_t *position) {
+  bool unsorted = listing->unsorted;
+  if (!sf_listing_push(listing, name, d_type)) {
+    return false;
+  }
+  listing->unsorted = unsorted;
+
+  uint32_t last = listing->count - 1;
+  uint32_t index = listing->order[last];
+  uint32_t lower =
+      sf_listing_lower_bound(listing, &listing->entries[index], last);
+
+  memmove(
+      &listing->order[lower + 1],
+      &listing->order[lower],
+      sizeof(uint32_t) * (last - lower));
+  listing->order[lower] = index;
+
+  *position = lower;
+  return true;
+}
+
+/*
+ * Finds the position of the live entry index. Sorted listings are binary
+ * searched, others scanned.
+ */
+uint32_t sf_listing_position(sf_listing_t *listing, uint32_t index) {
+  if (index < listing->count && listing->order[index] == index) {
+    return index;
+  }
+
+  if (!listing->unsorted) {
+    const sf_entry_t *entry = &listing->entries[index];
+    for (uint32_t i = sf_listing_lower_bound(listing, entry, listing->count);
+         i < listing->count &&
+         sf_entry_cmp(sf_listing_entry(listing, i), entry, listing) == 0;
+         i++) {
+      if (listing->order[i] == index) {
+        return i;
+      }
+    }
+  }
+
+  // Types fetched since the last sort may have moved the entry
+  for (uint32_t i = 0; i < listing->count; i++) {
+    if (listing->order[i] == index) {
+      return i;
+    }
+  }
+
+  assert(false);
+  return 0;
+}
+
+/*
+ * Finds the position of the entry called name
+ */
+bool sf_listing_find(
+    sf_listing_t *listing, const char *name, uint32_t *position) {
+  uint32_t index;
+  if (!sf_listing_lookup(listing, name, &index)) {
+    return false;
+  }
+
+  *position = sf_listing_position(listing, index);
+  return true;
+}
+
+/*
+ * Rewrites the entry table and the arenas without removed entries. Entries
+ * get new indices, so metadata requests in flight are dropped and names are
+ * measured again when next drawn.
+ */
+bool sf_listing_compact(sf_listing_t *listing) {
+  sf_listing_t compact = {0};
+  if (listing->count > 0 && !sf_listing_reserve(&compact, listing->count)) {
+    sf_listing_destroy(&compact);
+    return false;
+  }
+  if (listing->meta != NULL && listing->count > 0) {
+    compact.meta = calloc(listing->count, sizeof(sf_entry_meta_t));
+    if (compact.meta == NULL) {
+      sf_listing_destroy(&compact);
+      return false;
+    }
+  }
+
+  for (uint32_t i = 0; i < listing->count; i++) {
+    uint32_t index = listing->order[i];
+    sf_entry_t entry = listing->entries[index];
+    const char *key = sf_listing_key(listing, &entry);
+
+    if (!sf_arena_reserve(
+            &compact.names,
+            &compact.names_capacity,
+            compact.names_size,
+            entry.name_length + 1)) {
+      sf_listing_destroy(&compact);
+      return false;
+    }
+    memcpy(
+        compact.names + compact.names_size,
+        listing->names + entry.name_offset,
+        entry.name_length + 1);
+    entry.name_offset = compact.names_size;
+    compact.names_size += entry.name_length + 1;
+
+    if (listing->keys == NULL) {
+      entry.key_offset = entry.name_offset;
+    } else {
+      if (!sf_arena_reserve(
+              &compact.keys,
+              &compact.keys_capacity,
+              compact.keys_size,
+              entry.key_length + 1)) {
+        sf_listing_destroy(&compact);
+        return false;
+      }
+      memcpy(compact.keys + compact.keys_size, key, entry.key_length + 1);
+      entry.key_offset = compact.keys_size;
+      compact.keys_size += entry.key_length + 1;
+    }
+
+    if (entry.type == SF_ENTRY_UNKNOWN) {
+      compact.unknown_count++;
+    }
+    compact.hidden_count += entry.hidden;
+    if (compact.meta != NULL) {
+      compact.meta[i] = listing->meta[index];
+      if (compact.meta[i].state == SF_META_PENDING) {
+        compact.meta[i].state = SF_META_NONE;
+      }
+    }
+
+    compact.entries[i] = entry;
+    compact.order[i] = i;
+  }
+  compact.entry_count = compact.count = listing->count;
+  compact.sort = listing->sort;
+  compact.unsorted = listing->unsorted;
+  if (!sf_listing_hash_reserve(&compact, compact.count)) {
+    sf_listing_destroy(&compact);
+    return false;
+  }
+
+  sf_listing_move(listing, &compact);
+  return true;
+}
+
+void sf_listing_remove(sf_listing_t *listing, uint32_t position) {
+  sf_listing_drop_orders(listing);
+
+  const sf_entry_t *entry = sf_listing_entry(listing, position);
+  listing->garbage_size += sizeof(sf_entry_t) + entry->name_length + 1;
+  if (listing->keys != NULL) {
+    listing->garbage_size += entry->key_length + 1;
+  }
+  listing->hidden_count -= entry->hidden;
+
+  sf_listing_hash_remove(listing, listing->order[position]);
+  memmove(
+      &listing->order[position],
+      &listing->order[position + 1],
+      sizeof(uint32_t) * (listing->count - position - 1));
+  listing->count--;
+
+  if (listing->garbage_size > SF_LISTING_MAX_GARBAGE &&
+      listing->garbage_size > (listing->names_size + listing->keys_size) / 2) {
+    sf_listing_compact(listing);
+  }
+}
+
+/*
+ * Hands the entries of listing read since the last call over to the main
+ * thread, at most every SF_SCAN_PROGRESS_INTERVAL_MS except for the first
+ * ones. published is the number of entries already handed over.
+ */
+void sf_scan_progress_update(
+    sf_scan_progress_t *progress,
+    const sf_listing_t *listing,
+    uint32_t *published) {
+  int64_t now = sf_now_ms();
+  if (*published == listing->count ||
+      (*published > 0 &&
+       now - progress->published_ms < SF_SCAN_PROGRESS_INTERVAL_MS)) {
+    return;
+  }
+
+  // Entries that don't fit are only shown once the scan completes
+  pthread_mutex_lock(&progress->mutex);
+  sf_listing_append(&progress->chunk, listing, *published);
+  pthread_mutex_unlock(&progress->mutex);
+
+  *published = listing->count;
+  progress->published_ms = now;
+
+  sf_notify(progress->wake_fd);
+}
+
+#ifdef __linux__
+/*
+ * Record layout returned by the getdents64 syscall
+ */
+typedef struct sf_linux_dirent64_t {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+} sf_linux_dirent64_t;
+
+/*
+ * Reads the directory in large getdents64 batches, which costs far fewer
+ * syscalls than readdir's small internal buffer on huge directories.
+ * Takes ownership of fd. Stops early and returns false if cancelled is set.
+ * Entries are published to progress, if set, as they're read.
+ */
+bool sf_scan_fd(
+    int fd,
+    const atomic_bool *cancelled,
+    sf_scan_progress_t *progress,
+    sf_listing_t *listing) {
+  char *dents = malloc(SF_SCAN_BUFFER_SIZE);
+  if (dents == NULL) {
+    close(fd);
+    return false;
+  }
+
+  // A listing missing entries that didn't fit isn't passed off as complete
+  bool success = true;
+  uint32_t published = 0;
+  long nread;
+  while (success &&
+         (nread = syscall(SYS_getdents64, fd, dents, SF_SCAN_BUFFER_SIZE)) >
+             0) {
+    if (cancelled != NULL && atomic_load(cancelled)) {
+      break;
+    }
+
+    for (long offset = 0; offset < nread;) {
+      sf_linux_dirent64_t *dent = (sf_linux_dirent64_t *)(dents + offset);
+      offset += dent->d_reclen;
+
+      if (IS_VALID_ENTRY(dent->d_name) &&
+          !sf_listing_push(listing, dent->d_name, dent->d_type)) {
+        success = false;
+        break;
+      }
+    }
+
+    if (progress != NULL) {
+      sf_scan_progress_update(progress, listing, &published);
+    }
+  }
+
+  free(dents);
+  close(fd);
+  return success && nread == 0;
+}
+#else
+bool sf_scan_fd(
+    int fd,
+    const atomic_bool *cancelled,
+    sf_scan_progress_t *progress,
+    sf_listing_t *listing) {
+  DIR *d = fdopendir(fd);
+  if (d == NULL) {
+    close(fd);
+    return false;
+  }
+
+  bool success = true;
+  uint32_t published = 0;
+  struct dirent *dir;
+  for (uint32_t i = 1; (dir = readdir(d)) != NULL; i++) {
+    if (cancelled != NULL && atomic_load(cancelled)) {
+      success = false;
+      break;
+    }
+
+    if (IS_VALID_ENTRY(dir->d_name) &&
+        !sf_listing_push(listing, dir->d_name, dir->d_type)) {
+      success = false;
+      break;
+    }
+
+    if (progress != NULL && i % 1024 == 0) {
+      sf_scan_progress_update(progress, listing, &published);
+    }
+  }
+
+  closedir(d);
+  return success;
+}
+#endif
+
+/*
+ * Listing cache functions
+ */
+void sf_cache_init(
+    sf_cache_t *cache, size_t max_size, size_t max_prefetched_size) {
+  memset(cache, 0, sizeof(*cache));
+  pthread_mutex_init(&cache->mutex, NULL);
+  cache->max_size = max_size;
+  cache->max_prefetched_size = max_prefetched_size;
+}
+
+void sf_cache_unlink(sf_cache_t *cache, sf_cache_entry_t *entry) {
+  if (entry->prev != NULL) {
+    entry->prev->next = entry->next;
+  } else {
+    cache->head = entry->next;
+  }
+
+  if (entry->next != NULL) {
+    entry->next->prev = entry->prev;
+  } else {
+    cache->tail = entry->prev;
+  }
+
+  entry->prev = entry->next = NULL;
+}
+
+void sf_cache_push_front(sf_cache_t *cache, sf_cache_entry_t *entry) {
+  entry->prev = NULL;
+  entry->next = cache->head;
+  if (cache->head != NULL) {
+    cache->head->prev = entry;
+  } else {
+    cache->tail = entry;
+  }
+  cache->head = entry;
+}
+
+void sf_cache_remove(sf_cache_t *cache, sf_cache_entry_t *entry) {
+  sf_cache_unlink(cache, entry);
+  cache->entry_count--;
+  cache->size -= entry->size;
+  if (entry->prefetched) {
+    cache->prefetched_size -= entry->size;
+  }
+
+  sf_listing_destroy(&entry->listing);
+  free(entry->path);
+  free(entry);
+}
+
+void sf_cache_destroy(sf_cache_t *cache) {
+  while (cache->head != NULL) {
+    sf_cache_remove(cache, cache->head);
+  }
+  pthread_mutex_destroy(&cache->mutex);
+}
+
+sf_cache_entry_t *sf_cache_find(sf_cache_t *cache, const char *path) {
+  for (sf_cache_entry_t *entry = cache->head; entry != NULL;
+       entry = entry->next) {
+    if (strcmp(entry->path, path) == 0) {
+      return entry;
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Copies the cached listing for path into listing if the directory hasn't
+ * changed since it was scanned. Lookups by the prefetcher don't count as
+ * uses, and only check whether the listing is cached if listing is NULL.
+ */
+bool sf_cache_lookup(
+    sf_cache_t *cache,
+    const char *path,
+    const struct stat *st,
+    bool prefetch,
+    sf_listing_t *listing) {
+  pthread_mutex_lock(&cache->mutex);
+
+  bool hit = false;
+  sf_cache_entry_t *entry = sf_cache_find(cache, path);
+
+  if (entry != NULL) {
+    if (entry->dev != st->st_dev || entry->ino != st->st_ino ||
+        entry->mtime.tv_sec != st->st_mtim.tv_sec ||
+        entry->mtime.tv_nsec != st->st_mtim.tv_nsec) {
+      // Stale
+      sf_cache_remove(cache, entry);
+    } else if (listing == NULL || sf_listing_copy(listing, &entry->listing)) {
+      if (!prefetch) {
+        sf_cache_unlink(cache, entry);
+        sf_cache_push_front(cache, entry);
+        if (entry->prefetched) {
+          entry->prefetched = false;
+          cache->prefetched_size -= entry->size;
+        }
+        entry->used_ms = sf_now_ms();
+      }
+      hit = true;
+    }
+  }
+
+  if (prefetch) {
+    // Not a use
+  } else if (hit) {
+    cache->hits++;
+  } else {
+    cache->misses++;
+  }
+
+  pthread_mutex_unlock(&cache->mutex);
+  return hit;
+}
+
+/*
+ * Stores a copy of listing, evicting least recently used listings to stay
+ * under the cache's memory budget, or under the prefetch budget if the
+ * listing is prefetched.
+ * scan_start is when the scan began: a directory modified within the same
+ * second could change again without its mtime moving, so it isn't cached.
+ */
+void sf_cache_insert(
+    sf_cache_t *cache,
+    const char *path,
+    const struct stat *st,
+    struct timespec scan_start,
+    bool prefetched,
+    const sf_listing_t *listing) {
+  if (st->st_mtim.tv_sec >= scan_start.tv_sec) {
+    return;
+  }
+
+  size_t size = sizeof(sf_cache_entry_t) + strlen(path) + 1 +
+                (sizeof(sf_entry_t) + sizeof(uint32_t)) * listing->entry_count +
+                listing->names_size + listing->keys_size;
+  if (size > (prefetched ? cache->max_prefetched_size : cache->max_size)) {
+    return;
+  }
+
+  // Copy outside of the lock, it's the expensive part
+  sf_cache_entry_t *entry = calloc(1, sizeof(sf_cache_entry_t));
+  if (entry == NULL) {
+    return;
+  }
+
+  entry->path = strdup(path);
+  if (entry->path == NULL || !sf_listing_copy(&entry->listing, listing)) {
+    free(entry->path);
+    free(entry);
+    return;
+  }
+
+  entry->dev = st->st_dev;
+  entry->ino = st->st_ino;
+  entry->mtime = st->st_mtim;
+  entry->size = size;
+  entry->prefetched = prefetched;
+  entry->used_ms = sf_now_ms();
+
+  pthread_mutex_lock(&cache->mutex);
+
+  sf_cache_entry_t *existing = sf_cache_find(cache, path);
+  if (existing != NULL) {
+    sf_cache_remove(cache, existing);
+  }
+
+  if (prefetched) {
+    sf_cache_entry_t *victim = cache->tail;
+    while (victim != NULL &&
+           cache->prefetched_size + size > cache->max_prefetched_size) {
+      sf_cache_entry_t *prev = victim->prev;
+      if (victim->prefetched) {
+        sf_cache_remove(cache, victim);
+      }
+      victim = prev;
+    }
+  }
+
+  while (cache->tail != NULL && cache->size + size > cache->max_size) {
+    sf_cache_remove(cache, cache->tail);
+  }
+
+  sf_cache_push_front(cache, entry);
+  cache->entry_count++;
+  cache->size += size;
+  if (prefetched) {
+    cache->prefetched_size += size;
+  }
+
+  pthread_mutex_unlock(&cache->mutex);
+}
+
+/*
+ * Fills listing with the sorted entries of the directory name, relative to
+ * dirfd. path is the directory's real path, used as the cache key.
+ * The directory is read once, or not at all if it's cached and unchanged.
+ * Entries read are published to progress, if set, before they're sorted.
+ * Safe to call from worker threads. Returns false if the directory couldn't
+ * be read or the scan was cancelled.
+ */
+bool sf_get_entries(
+    int dirfd,
+    const char *name,
+    const char *path,
+    const atomic_bool *cancelled,
+    sf_scan_progress_t *progress,
+    sf_listing_t *listing) {
+  sf_listing_t scanned = {0};
+
+  SF_TRACE_BEGIN(open_start);
+  int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  SF_TRACE_END(open_start, SF_TRACE_IO, "open", path, 0);
+  if (fd == -1) {
+    sf_listing_move(listing, &scanned);
+    return false;
+  }
+
+  struct stat st;
+  bool have_stat = fstat(fd, &st) == 0;
+  if (have_stat) {
+    if (sf_cache_lookup(&sf_cache, path, &st, false, listing)) {
+      close(fd);
+      return true;
+    }
+  }
+
+#ifdef SF_SNAPSHOTS
+  // Stale snapshots are only of use to scans that publish their progress
+  bool current;
+  if (have_stat &&
+      sf_snapshot_load(path, &st, progress != NULL, &scanned, &current)) {
+    if (current) {
+      close(fd);
+      sf_listing_move(listing, &scanned);
+      return true;
+    }
+
+    // Shown while the directory is read again, the scan then only hands
+    // over the listing it completes with
+    if (progress != NULL) {
+      pthread_mutex_lock(&progress->mutex);
+      sf_listing_move(&progress->chunk, &scanned);
+      pthread_mutex_unlock(&progress->mutex);
+      progress->published_ms = sf_now_ms();
+      sf_notify(progress->wake_fd);
+      progress = NULL;
+    }
+    sf_listing_destroy(&scanned);
+  }
+#endif
+
+  struct timespec scan_start;
+  clock_gettime(CLOCK_REALTIME, &scan_start);
+
+  SF_TRACE_BEGIN(scan_start_us);
+  bool success = sf_scan_fd(fd, cancelled, progress, &scanned);
+  SF_TRACE_END(scan_start_us, SF_TRACE_SCAN, "scan", path, scanned.count);
+  if (success) {
+    sf_listing_sort(&scanned);
+    // Listings are cached by the directory's identity, which is unknown
+    // without a stat
+    if (have_stat) {
+      sf_cache_insert(&sf_cache, path, &st, scan_start, false, &scanned);
+    }
+#ifdef SF_SNAPSHOTS
+    // Like the cache, changes within the second the scan started in might
+    // not move the modification time
+    if (have_stat && scanned.count >= SF_SNAPSHOT_MIN_ENTRIES &&
+        st.st_mtim.tv_sec < scan_start.tv_sec) {
+      sf_snapshot_save(path, &st, &scanned);
+    }
+#endif
+  }
+
+  sf_listing_move(listing, &scanned);
+  return success;
+}
+
+/*
+ * Listing snapshot functions
+ */
+
+/*
+ * Copies the arrays of a listing mapped from a snapshot to the heap, where
+ * they can grow
+ */
+bool sf_listing_unmap(sf_listing_t *listing) {
+  if (listing->map == NULL) {
+    return true;
+  }
+
+  sf_entry_t *entries = malloc(sizeof(sf_entry_t) * listing->entry_capacity);
+  uint32_t *order = malloc(sizeof(uint32_t) * listing->entry_capacity);
+  uint32_t *hash_slots = malloc(sizeof(uint32_t) * listing->hash_capacity);
+  char *names = malloc(listing->names_capacity);
+  char *keys = listing->keys != NULL ? malloc(listing->keys_capacity) : NULL;
+  if (entries == NULL || order == NULL || hash_slots == NULL ||
+      names == NULL || (listing->keys != NULL && keys == NULL)) {
+    free(entries);
+    free(order);
+    free(hash_slots);
+    free(names);
+    free(keys);
+    return false;
+  }
+
+  memcpy(entries, listing->entries, sizeof(sf_entry_t) * listing->entry_count);
+  memcpy(order, listing->order, sizeof(uint32_t) * listing->count);
+  memcpy(
+      hash_slots,
+      listing->hash_slots,
+      sizeof(uint32_t) * listing->hash_capacity);
+  memcpy(names, listing->names, listing->names_size);
+  if (keys != NULL) {
+    memcpy(keys, listing->keys, listing->keys_size);
+  }
+
+  munmap(listing->map, listing->map_size);
+  listing->map = NULL;
+  listing->map_size = 0;
+  listing->entries = entries;
+  listing->order = order;
+  listing->hash_slots = hash_slots;
+  listing->names = names;
+  listing->keys = keys;
+  return true;
+}
+
+/*
+ * 64 bit FNV-1a hash of a path, which names its snapshot
+ */
+uint64_t sf_snapshot_hash(const char *path) {
+  uint64_t hash = 14695981039346656037u;
+  for (; *path != '\0'; path++) {
+    hash ^= (unsigned char)*path;
+    hash *= 1099511628211u;
+  }
+  return hash;
+}
+
+/*
+ * Writes the file name of the snapshot of the directory at path to dest,
+ * which holds PATH_MAX bytes, creating the snapshot directory if create is
+ * set
+ */
+bool sf_snapshot_path(const char *path, char *dest, bool create) {
+  char dir[PATH_MAX];
+  const char *cache_home = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  int length;
+  if (cache_home != NULL && cache_home[0] == '/') {
+    length = snprintf(dir, sizeof(dir), "%s", cache_home);
+  } else if (home != NULL && home[0] == '/') {
+    length = snprintf(dir, sizeof(dir), "%s/.cache", home);
+  } else {
+    return false;
+  }
+  if (length < 0 || (size_t)length + 4 >= sizeof(dir)) {
+    return false;
+  }
+
+  if (create) {
+    mkdir(dir, 0700);
+  }
+  strcat(dir, "/sf");
+  if (create && mkdir(dir, 0700) != 0 && errno != EEXIST) {
+    return false;
+  }
+
+  length = snprintf(
+      dest, PATH_MAX, "%s/%016" PRIx64, dir, sf_snapshot_hash(path));
+  return length > 0 && length < PATH_MAX;
+}
+
+/*
+ * LC_COLLATE the collation keys are made in, empty if the names are their
+ * own keys
+ */
+void sf_snapshot_collate(char *dest, size_t size) {
+  const char *collate = sf_collate_bytewise ? "" : setlocale(LC_COLLATE, NULL);
+  snprintf(dest, size, "%s", collate != NULL ? collate : "");
+}
+
+/*
+ * Maps the snapshot of the directory at path, which st describes, into the
+ * empty listing. current is set if the directory wasn't modified since,
+ * otherwise the listing is what it held then. Stale snapshots are only
+ * mapped if stale is set. Returns false if there's no snapshot of it that
+ * this sf can use. A snapshot is trusted like any other file of the user's
+ * cache, only its header is checked.
+ */
+bool sf_snapshot_load(
+    const char *path,
+    const struct stat *st,
+    bool stale,
+    sf_listing_t *listing,
+    bool *current) {
+  char file_path[PATH_MAX];
+  if (!sf_snapshot_path(path, file_path, false)) {
+    return false;
+  }
+
+  SF_TRACE_BEGIN(load_start);
+  int fd = open(file_path, O_RDONLY | O_CLOEXEC);
+  struct stat file_st;
+  if (fd == -1 || fstat(fd, &file_st) != 0 ||
+      (size_t)file_st.st_size < sizeof(sf_snapshot_header_t)) {
+    if (fd != -1) {
+      close(fd);
+    }
+    return false;
+  }
+
+  // The header alone tells if a snapshot is stale, without mapping it all
+  sf_snapshot_header_t peek;
+  if (!stale && (pread(fd, &peek, sizeof(peek), 0) != sizeof(peek) ||
+                 peek.mtime_sec != st->st_mtim.tv_sec ||
+                 peek.mtime_nsec != st->st_mtim.tv_nsec)) {
+    close(fd);
+    return false;
+  }
+
+  // Written pages stay private to sf
+  size_t size = (size_t)file_st.st_size;
+  char *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return false;
+  }
+
+  const sf_snapshot_header_t *header = (const sf_snapshot_header_t *)map;
+  char collate[sizeof(header->collate)];
+  sf_snapshot_collate(collate, sizeof(collate));
+
+  uint64_t entries_size = sizeof(sf_entry_t) * (uint64_t)header->count;
+  uint64_t order_size = sizeof(uint32_t) * (uint64_t)header->count;
+  uint64_t hash_size = sizeof(uint32_t) * (uint64_t)header->hash_capacity;
+  bool valid =
+      memcmp(header->magic, SF_SNAPSHOT_MAGIC, sizeof(header->magic)) == 0 &&
+      header->version == SF_SNAPSHOT_VERSION &&
+      header->entry_size == sizeof(sf_entry_t) &&
+      header->dev == (uint64_t)st->st_dev &&
+      header->ino == (uint64_t)st->st_ino &&
+      strncmp(header->collate, collate, sizeof(collate)) == 0 &&
+      (header->keys_size > 0) == !sf_collate_bytewise &&
+      sizeof(sf_snapshot_header_t) + header->path_length <= size &&
+      header->path_length == strlen(path) &&
+      memcmp(map + sizeof(sf_snapshot_header_t), path, header->path_length) ==
+          0 &&
+      // Lookups rely on free hash slots to stop
+      header->count > 0 &&
+      (uint64_t)header->count * 2 <= header->hash_capacity &&
+      (header->hash_capacity & (header->hash_capacity - 1)) == 0 &&
+      header->entries_offset + entries_size <= size &&
+      header->order_offset + order_size <= size &&
+      header->hash_offset + hash_size <= size &&
+      header->names_offset + header->names_size <= size &&
+      header->keys_offset + header->keys_size <= size;
+  if (!valid) {
+    munmap(map, size);
+    return false;
+  }
+
+  sf_listing_destroy(listing);
+  listing->map = map;
+  listing->map_size = size;
+  listing->entries = (sf_entry_t *)(map + header->entries_offset);
+  listing->order = (uint32_t *)(map + header->order_offset);
+  listing->hash_slots = (uint32_t *)(map + header->hash_offset);
+  listing->names = map + header->names_offset;
+  listing->keys = header->keys_size > 0 ? map + header->keys_offset : NULL;
+  listing->entry_count = listing->entry_capacity = header->count;
+  listing->count = header->count;
+  listing->unknown_count = header->unknown_count;
+  listing->hidden_count = header->hidden_count;
+  listing->hash_capacity = header->hash_capacity;
+  listing->names_size = listing->names_capacity = header->names_size;
+  listing->keys_size = listing->keys_capacity = header->keys_size;
+
+  *current = header->mtime_sec == st->st_mtim.tv_sec &&
+             header->mtime_nsec == st->st_mtim.tv_nsec;
+
+  SF_TRACE_END(load_start, SF_TRACE_IO, "load snapshot", path, listing->count);
+  return true;
+}
+
+bool sf_snapshot_write(int fd, const void *data, uint64_t size) {
+  for (uint64_t written = 0; written < size;) {
+    ssize_t n = write(fd, (const char *)data + written, size - written);
+    if (n <= 0) {
+      return false;
+    }
+    written += n;
+  }
+  return true;
+}
+
+/*
+ * Saves the sorted listing of the directory at path, which st describes,
+ * replacing its previous snapshot at once so readers never see half of it.
+ * The listing must not have removed entries.
+ */
+void sf_snapshot_save(
+    const char *path, const struct stat *st, const sf_listing_t *listing) {
+  if (listing->entry_count != listing->count || listing->unsorted) {
+    return;
+  }
+
+  char file_path[PATH_MAX];
+  char temp_path[PATH_MAX + 8];
+  if (!sf_snapshot_path(path, file_path, true)) {
+    return;
+  }
+  snprintf(temp_path, sizeof(temp_path), "%s.XXXXXX", file_path);
+
+  SF_TRACE_BEGIN(save_start);
+  int fd = mkostemp(temp_path, O_CLOEXEC);
+  if (fd == -1) {
+    return;
+  }
+
+  sf_snapshot_header_t header = {
+      .magic = SF_SNAPSHOT_MAGIC,
+      .version = SF_SNAPSHOT_VERSION,
+      .entry_size = sizeof(sf_entry_t),
+      .dev = (uint64_t)st->st_dev,
+      .ino = (uint64_t)st->st_ino,
+      .mtime_sec = st->st_mtim.tv_sec,
+      .mtime_nsec = st->st_mtim.tv_nsec,
+      .path_length = (uint32_t)strlen(path),
+      .count = listing->count,
+      .unknown_count = listing->unknown_count,
+      .hidden_count = listing->hidden_count,
+      .hash_capacity = listing->hash_capacity,
+      .names_size = listing->names_size,
+      .keys_size = listing->keys != NULL ? listing->keys_size : 0,
+  };
+  sf_snapshot_collate(header.collate, sizeof(header.collate));
+
+  // Sections start 8 byte aligned, entries hold 64 bit prefixes
+  const void *sections[] = {
+      listing->entries,
+      listing->order,
+      listing->hash_slots,
+      listing->names,
+      header.keys_size > 0 ? listing->keys : NULL,
+  };
+  uint64_t sizes[] = {
+      sizeof(sf_entry_t) * (uint64_t)listing->count,
+      sizeof(uint32_t) * (uint64_t)listing->count,
+      sizeof(uint32_t) * (uint64_t)listing->hash_capacity,
+      listing->names_size,
+      header.keys_size,
+  };
+  uint64_t *offsets[] = {
+      &header.entries_offset,
+      &header.order_offset,
+      &header.hash_offset,
+      &header.names_offset,
+      &header.keys_offset,
+  };
+  uint64_t offset = sizeof(header) + header.path_length;
+  for (uint32_t i = 0; i < 5; i++) {
+    offset = (offset + 7) & ~(uint64_t)7;
+    *offsets[i] = offset;
+    offset += sizes[i];
+  }
+
+  static const char padding[8] = {0};
+  bool written = sf_snapshot_write(fd, &header, sizeof(header)) &&
+                 sf_snapshot_write(fd, path, header.path_length);
+  offset = sizeof(header) + header.path_length;
+  for (uint32_t i = 0; i < 5 && written; i++) {
+    written = sf_snapshot_write(fd, padding, *offsets[i] - offset) &&
+              (sizes[i] == 0 || sf_snapshot_write(fd, sections[i], sizes[i]));
+    offset = *offsets[i] + sizes[i];
+  }
+
+  if (close(fd) != 0 || !written || rename(temp_path, file_path) != 0) {
+    unlink(temp_path);
+  }
+
+  SF_TRACE_END(save_start, SF_TRACE_IO, "save snapshot", path, listing->count);
+}
+
+/*
+ * Directory watch functions
+ */
+#ifdef __linux__
+#define SF_WATCH_EVENTS                                                        \
+  (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR |          \
+   IN_EXCL_UNLINK)
+
+/*
+ * Creates the inotify instance every directory is watched on. One instance
+ * is shared since closing one has the kernel wait for readers to finish,
+ * which would stall leaving each directory, and instances per user are few.
+ */
+void sf_watch_init() {
+  sf_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+}
+
+void sf_watch_destroy() {
+  pthread_mutex_lock(&sf_watches_mutex);
+  while (sf_watches != NULL) {
+    sf_watch_t *watch = sf_watches;
+    sf_watches = watch->next;
+    free(watch->events);
+    free(watch);
+  }
+  pthread_mutex_unlock(&sf_watches_mutex);
+
+  if (sf_inotify_fd != -1) {
+    close(sf_inotify_fd);
+    sf_inotify_fd = -1;
+  }
+}
+
+/*
+ * Watch with the descriptor wd, the caller holds sf_watches_mutex
+ */
+sf_watch_t *sf_watch_find(int wd) {
+  for (sf_watch_t *watch = sf_watches; watch != NULL; watch = watch->next) {
+    if (watch->wd == wd) {
+      return watch;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Starts watching the directory dirfd refers to, returning its watch
+ * descriptor or -1 on failure. Watching a directory that's watched already
+ * returns the same descriptor, each has to be closed. Safe to call from
+ * worker threads.
+ */
+int sf_watch_open(int dirfd) {
+  if (sf_inotify_fd == -1) {
+    return -1;
+  }
+
+  char proc_path[64];
+  snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", dirfd);
+
+  // Added under the lock so a descriptor closed meanwhile isn't reused
+  pthread_mutex_lock(&sf_watches_mutex);
+  int wd = inotify_add_watch(sf_inotify_fd, proc_path, SF_WATCH_EVENTS);
+  sf_watch_t *watch = wd != -1 ? sf_watch_find(wd) : NULL;
+  if (watch != NULL) {
+    watch->refs++;
+  } else if (wd != -1) {
+    watch = calloc(1, sizeof(sf_watch_t));
+    if (watch != NULL) {
+      watch->wd = wd;
+      watch->refs = 1;
+      watch->next = sf_watches;
+      sf_watches = watch;
+    } else {
+      inotify_rm_watch(sf_inotify_fd, wd);
+      wd = -1;
+    }
+  }
+  pthread_mutex_unlock(&sf_watches_mutex);
+
+  return wd;
+}
+
+/*
+ * Reads what the kernel reported and queues each event with its watch, to
+ * be applied by the directory once it isn't being read
+ */
+void sf_watch_take_events() {
+  char buffer[16 * 1024]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+
+  pthread_mutex_lock(&sf_watches_mutex);
+  ssize_t length;
+  while ((length = read(sf_inotify_fd, buffer, sizeof(buffer))) > 0) {
+    for (char *ptr = buffer; ptr < buffer + length;) {
+      struct inotify_event *event = (struct inotify_event *)ptr;
+      ptr += sizeof(struct inotify_event) + event->len;
+
+      if (event->mask & IN_Q_OVERFLOW) {
+        for (sf_watch_t *watch = sf_watches; watch != NULL;
+             watch = watch->next) {
+          watch->overflowed = true;
+        }
+        continue;
+      }
+
+      sf_watch_t *watch = sf_watch_find(event->wd);
+      if (watch == NULL || event->len == 0) {
+        continue;
+      }
+
+      // Queued as the mask followed by the NUL terminated name
+      size_t name_length = strlen(event->name);
+      if (!sf_arena_reserve(
+              &watch->events,
+              &watch->events_capacity,
+              watch->events_size,
+              sizeof(uint32_t) + name_length + 1)) {
+        watch->overflowed = true;
+        continue;
+      }
+      char *queued = watch->events + watch->events_size;
+      memcpy(queued, &event->mask, sizeof(uint32_t));
+      memcpy(queued + sizeof(uint32_t), event->name, name_length + 1);
+      watch->events_size += sizeof(uint32_t) + name_length + 1;
+    }
+  }
+  pthread_mutex_unlock(&sf_watches_mutex);
+}
+
+/*
+ * Whether events were queued for the watch since they were last read
+ */
+bool sf_watch_pending(int wd) {
+  if (wd == -1) {
+    return false;
+  }
+
+  pthread_mutex_lock(&sf_watches_mutex);
+  sf_watch_t *watch = sf_watch_find(wd);
+  bool pending =
+      watch != NULL && (watch->events_size > 0 || watch->overflowed);
+  pthread_mutex_unlock(&sf_watches_mutex);
+  return pending;
+}
+
+/*
+ * Calls handle for every event queued for the watch. Returns false if
+ * events were lost, in which case changes were missed.
+ */
+bool sf_watch_read(
+    int wd,
+    void (*handle)(void *data, uint32_t mask, const char *name),
+    void *data) {
+  if (wd == -1) {
+    return true;
+  }
+
+  // Handled outside of the lock, handle may stat entries
+  pthread_mutex_lock(&sf_watches_mutex);
+  sf_watch_t *watch = sf_watch_find(wd);
+  char *events = NULL;
+  uint32_t events_size = 0;
+  bool complete = true;
+  if (watch != NULL) {
+    events = watch->events;
+    events_size = watch->events_size;
+    complete = !watch->overflowed;
+    watch->events = NULL;
+    watch->events_size = watch->events_capacity = 0;
+    watch->overflowed = false;
+  }
+  pthread_mutex_unlock(&sf_watches_mutex);
+
+  for (uint32_t at = 0; at < events_size;) {
+    uint32_t mask;
+    memcpy(&mask, events + at, sizeof(mask));
+    const char *name = events + at + sizeof(mask);
+    handle(data, mask, name);
+    at += sizeof(mask) + strlen(name) + 1;
+  }
+  free(events);
+
+  return complete;
+}
+
+/*
+ * Stops watching once the last watch of the directory is closed, only
+ * removing the watch from the shared instance
+ */
+void sf_watch_close(int *wd) {
+  if (*wd == -1) {
+    return;
+  }
+
+  pthread_mutex_lock(&sf_watches_mutex);
+  for (sf_watch_t **link = &sf_watches; *link != NULL;
+       link = &(*link)->next) {
+    sf_watch_t *watch = *link;
+    if (watch->wd == *wd) {
+      if (--watch->refs == 0) {
+        *link = watch->next;
+        inotify_rm_watch(sf_inotify_fd, watch->wd);
+        free(watch->events);
+        free(watch);
+      }
+      break;
+    }
+  }
+  pthread_mutex_unlock(&sf_watches_mutex);
+
+  *wd = -1;
+}
+#else
+void sf_watch_init() {}
+
+void sf_watch_destroy() {}
+
+int sf_watch_open(int dirfd) { return -1; }
+
+void sf_watch_take_events() {}
+
+bool sf_watch_pending(int wd) { return false; }
+
+bool sf_watch_read(
+    int wd,
+    void (*handle)(void *data, uint32_t mask, const char *name),
+    void *data) {
+  return true;
+}
+
+void sf_watch_close(int *wd) { *wd = -1; }
+#endif
+
+unsigned char sf_dtype_from_mode(mode_t mode) {
+  if (S_ISREG(mode)) {
+    return DT_REG;
+  }
+  if (S_ISDIR(mode)) {
+    return DT_DIR;
+  }
+  if (S_ISLNK(mode)) {
+    return DT_LNK;
+  }
+  return DT_UNKNOWN;
+}
+
+/*
+ * Applies one inotify event to a sorted listing of the directory dirfd.
+ * on_insert and on_remove, when set, are told about the changed positions.
+ */
+void sf_listing_apply_event(
+    sf_listing_t *listing,
+    int dirfd,
+    uint32_t mask,
+    const char *name,
+    void (*on_insert)(void *data, uint32_t index),
+    void (*on_remove)(void *data, uint32_t index),
+    void *data) {
+  if (!IS_VALID_ENTRY(name)) {
+    return;
+  }
+
+  // Events are applied idempotently: an entry that's created is first
+  // removed, since the scan may have already seen it
+  uint32_t index;
+  if (sf_listing_find(listing, name, &index)) {
+    sf_listing_remove(listing, index);
+    if (on_remove != NULL) {
+      on_remove(data, index);
+    }
+  }
+
+  if (mask & (IN_CREATE | IN_MOVED_TO)) {
+    struct stat st;
+    if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+        sf_listing_insert(
+            listing, name, sf_dtype_from_mode(st.st_mode), &index)) {
+      if (on_insert != NULL) {
+        on_insert(data, index);
+      }
+    }
+  }
+}
+
+/*
+ * Worker pool functions
+ */
+
+/*
+ * Opens what sf_notify signals and the main loop waits on. An eventfd
+ * counts any number of notifications in one fd where a pipe would fill up
+ * with a byte each, so fds gets the same eventfd twice on Linux.
+ */
+bool sf_notifier_open(int fds[2]) {
+#ifdef __linux__
+  fds[0] = fds[1] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  return fds[0] != -1;
+#else
+  return pipe2(fds, O_CLOEXEC | O_NONBLOCK) == 0;
+#endif
+}
+
+void sf_notifier_close(int fds[2]) {
+  close(fds[0]);
+  if (fds[1] != fds[0]) {
+    close(fds[1]);
+  }
+}
+
+/*
+ * Wakes up the main loop waiting on the read end of a notifier. Safe to call
+ * from any thread.
+ */
+void sf_notify(int fd) {
+#ifdef __linux__
+  uint64_t count = 1;
+  write(fd, &count, sizeof(count));
+#else
+  char byte = 0;
+  write(fd, &byte, 1);
+#endif
+}
+
+void sf_notify_drain(int fd) {
+#ifdef __linux__
+  uint64_t count;
+  read(fd, &count, sizeof(count));
+#else
+  char bytes[64];
+  while (read(fd, bytes, sizeof(bytes)) > 0) {
+  }
+#endif
+}
+
+/*
+ * Lowers the calling thread's CPU and I/O priority to idle
+ */
+void sf_thread_set_idle() {
+#ifdef __linux__
+  struct sched_param param = {0};
+  pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+#ifdef SYS_ioprio_set
+  // No glibc wrapper, 0 is the calling thread
+  syscall(SYS_ioprio_set, SF_IOPRIO_WHO_PROCESS, 0, SF_IOPRIO_CLASS_IDLE);
+#endif
+#endif
+}
+
+void *sf_pool_worker(void *arg) {
+  sf_pool_t *pool = (sf_pool_t *)arg;
+
+  if (pool->idle) {
+    sf_thread_set_idle();
+  }
+
+  pthread_mutex_lock(&pool->mutex);
+  for (;;) {
+    while (pool->pending_head == NULL && !pool->stopping) {
+      pthread_cond_wait(&pool->cond, &pool->mutex);
+    }
+
+    if (pool->stopping) {
+      break;
+    }
+
+    sf_job_t *job = pool->pending_head;
+    pool->pending_head = job->next;
+    if (pool->pending_head == NULL) {
+      pool->pending_tail = NULL;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    if (!atomic_load(&job->cancelled)) {
+      job->run(job);
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    job->next = pool->done;
+    pool->done = job;
+    pthread_mutex_unlock(&pool->mutex);
+
+    // Wake up the main loop
+    sf_notify(pool->notify_fds[1]);
+
+    pthread_mutex_lock(&pool->mutex);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+
+  return NULL;
+}
+
+bool sf_pool_init(sf_pool_t *pool, uint32_t thread_count, bool idle) {
+  memset(pool, 0, sizeof(*pool));
+  pool->idle = idle;
+
+  if (!sf_notifier_open(pool->notify_fds)) {
+    return false;
+  }
+
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->cond, NULL);
+
+  // Workers inherit a fully blocked signal mask so signals such as SIGWINCH
+  // always reach the main loop
+  sigset_t all_signals, old_signals;
+  sigfillset(&all_signals);
+  pthread_sigmask(SIG_SETMASK, &all_signals, &old_signals);
+
+  pool->threads = calloc(thread_count, sizeof(pthread_t));
+  for (uint32_t i = 0; i < thread_count; i++) {
+    if (pthread_create(&pool->threads[i], NULL, sf_pool_worker, pool) != 0) {
+      break;
+    }
+    pool->thread_count++;
+  }
+
+  pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+
+  return pool->thread_count > 0;
+}
+
+void sf_pool_submit(sf_pool_t *pool, sf_job_t *job) {
+  atomic_init(&job->cancelled, false);
+  job->next = NULL;
+
+  pthread_mutex_lock(&pool->mutex);
+  if (pool->pending_tail != NULL) {
+    pool->pending_tail->next = job;
+  } else {
+    pool->pending_head = job;
+  }
+  pool->pending_tail = job;
+  pthread_cond_signal(&pool->cond);
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+/*
+ * Runs the completion callback of every finished job on the calling (main)
+ * thread. Returns true if any job completed.
+ */
+bool sf_pool_dispatch(sf_pool_t *pool) {
+  sf_notify_drain(pool->notify_fds[0]);
+
+  pthread_mutex_lock(&pool->mutex);
+  sf_job_t *job = pool->done;
+  pool->done = NULL;
+  pthread_mutex_unlock(&pool->mutex);
+
+  bool completed = job != NULL;
+  while (job != NULL) {
+    sf_job_t *next = job->next;
+    job->complete(job);
+    job = next;
+  }
+
+  return completed;
+}
+
+void sf_pool_destroy(sf_pool_t *pool) {
+  pthread_mutex_lock(&pool->mutex);
+  pool->stopping = true;
+  pthread_cond_broadcast(&pool->cond);
+  pthread_mutex_unlock(&pool->mutex);
+
+  for (uint32_t i = 0; i < pool->thread_count; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+  free(pool->threads);
+
+  // Jobs that never ran still get completed so they can free themselves
+  sf_pool_dispatch(pool);
+  for (sf_job_t *job = pool->pending_head; job != NULL;) {
+    sf_job_t *next = job->next;
+    atomic_store(&job->cancelled, true);
+    job->complete(job);
+    job = next;
+  }
+
+  sf_notifier_close(pool->notify_fds);
+  pthread_mutex_destroy(&pool->mutex);
+  pthread_cond_destroy(&pool->cond);
+}
+
+/*
+ * Metadata functions
+ */
+void sf_stat_entry(
+    int dirfd,
+    const char *name,
+    sf_entry_meta_t *meta,
+    unsigned char *d_type) {
+#ifdef STATX_TYPE
+  // Cached attributes are good enough here, and spare network filesystems
+  // a round trip to revalidate them
+  struct statx stx;
+  if (statx(
+          dirfd,
+          name,
+          AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+          STATX_TYPE | STATX_SIZE | STATX_MTIME,
+          &stx) == 0) {
+    meta->size = (int64_t)stx.stx_size;
+    meta->mtime = stx.stx_mtime.tv_sec;
+    meta->state = SF_META_DONE;
+    *d_type = sf_dtype_from_mode(stx.stx_mode);
+    return;
+  }
+
+  if (errno != ENOSYS) {
+    meta->state = SF_META_FAILED;
+    *d_type = DT_UNKNOWN;
+    return;
+  }
+#endif
+
+  struct stat st;
+  if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+    meta->size = st.st_size;
+    meta->mtime = st.st_mtim.tv_sec;
+    meta->state = SF_META_DONE;
+    *d_type = sf_dtype_from_mode(st.st_mode);
+    return;
+  }
+
+  meta->state = SF_META_FAILED;
+  *d_type = DT_UNKNOWN;
+}
+
+void sf_stat_job_run(sf_job_t *job) {
+  sf_stat_job_t *batch = (sf_stat_job_t *)job;
+
+  for (; batch->done < batch->count && !atomic_load(&job->cancelled);
+       batch->done++) {
+    sf_stat_entry(
+        batch->dirfd,
+        batch->names + batch->name_offsets[batch->done],
+        &batch->meta[batch->done],
+        &batch->types[batch->done]);
+  }
+}
+
+/*
+ * Stores the results of a batch. Entries that turn out to be directories
+ * move, as may any entry if the listing is sorted by metadata, so the
+ * listing is marked unsorted and its owner sorts it again.
+ */
+void sf_listing_apply_stats(sf_listing_t *listing, sf_stat_job_t *batch) {
+  for (uint32_t i = 0; i < batch->count; i++) {
+    uint32_t index = batch->indices[i];
+
+    if (i >= batch->done) {
+      // Cancelled before it was stat'd, it may be requested again
+      listing->meta[index].state = SF_META_NONE;
+      continue;
+    }
+
+    listing->meta[index] = batch->meta[i];
+    if (sf_sort_uses_meta(listing->sort)) {
+      listing->unsorted = true;
+    }
+
+    sf_entry_t *entry = &listing->entries[index];
+    sf_entry_type_t type = sf_entry_type_from_dtype(batch->types[i]);
+    if (entry->type == SF_ENTRY_UNKNOWN && type != SF_ENTRY_UNKNOWN) {
+      entry->type = type;
+      listing->unknown_count--;
+      if (type == SF_ENTRY_DIRECTORY) {
+        entry->sort_class = 0;
+        listing->unsorted = true;
+        sf_listing_drop_orders(listing);
+      }
+    }
+  }
+}
+
+void sf_stat_job_complete(sf_job_t *job) {
+  sf_stat_job_t *batch = (sf_stat_job_t *)job;
+  sf_listing_t *listing = batch->listing;
+
+  if (listing != NULL) {
+    for (sf_stat_job_t **link = &listing->stat_jobs; *link != NULL;
+         link = &(*link)->next) {
+      if (*link == batch) {
+        *link = batch->next;
+        break;
+      }
+    }
+
+    sf_listing_apply_stats(listing, batch);
+    (*batch->generation)++;
+  }
+
+  close(batch->dirfd);
+  free(batch->names);
+  free(batch);
+}
+
+sf_stat_job_t *
+sf_stat_job_create(sf_listing_t *listing, int dirfd, uint32_t *generation) {
+  sf_stat_job_t *batch = calloc(1, sizeof(sf_stat_job_t));
+  if (batch == NULL) {
+    return NULL;
+  }
+
+  // The owner may move on and close its fd while the job runs
+  batch->dirfd = fcntl(dirfd, F_DUPFD_CLOEXEC, 0);
+  if (batch->dirfd == -1) {
+    free(batch);
+    return NULL;
+  }
+
+  batch->job.run = sf_stat_job_run;
+  batch->job.complete = sf_stat_job_complete;
+  batch->listing = listing;
+  batch->generation = generation;
+  return batch;
+}
+
+bool sf_stat_job_add(sf_stat_job_t *batch, uint32_t index, const char *name) {
+  size_t length = strlen(name);
+  if (!sf_arena_reserve(
+          &batch->names,
+          &batch->names_capacity,
+          batch->names_size,
+          length + 1)) {
+    return false;
+  }
+
+  memcpy(batch->names + batch->names_size, name, length + 1);
+  batch->name_offsets[batch->count] = batch->names_size;
+  batch->names_size += length + 1;
+  batch->indices[batch->count++] = index;
+  return true;
+}
+
+void sf_stat_job_submit(sf_listing_t *listing, sf_stat_job_t *batch) {
+  batch->next = listing->stat_jobs;
+  listing->stat_jobs = batch;
+  sf_pool_submit(&sf_stat_pool, &batch->job);
+}
+
+/*
+ * Queues stat jobs for the entries at positions [first, last), or at
+ * positions[first, last) if positions is set, or only for those without a
+ * type if unknown_only is set, skipping entries already fetched or in
+ * flight. The listing is of the directory dirfd, generation belongs to its
+ * owner and is bumped as results land.
+ */
+void sf_listing_request_meta(
+    sf_listing_t *listing,
+    int dirfd,
+    uint32_t *generation,
+    const uint32_t *positions,
+    uint32_t first,
+    uint32_t last,
+    bool unknown_only) {
+  if (dirfd == -1 || first >= last) {
+    return;
+  }
+
+  if (listing->meta == NULL) {
+    listing->meta = calloc(listing->entry_capacity, sizeof(sf_entry_meta_t));
+    if (listing->meta == NULL) {
+      return;
+    }
+  }
+
+  sf_stat_job_t *batch = NULL;
+  for (uint32_t i = first; i < last; i++) {
+    uint32_t index = listing->order[positions != NULL ? positions[i] : i];
+    const sf_entry_t *entry = &listing->entries[index];
+    if ((unknown_only && entry->type != SF_ENTRY_UNKNOWN) ||
+        listing->meta[index].state != SF_META_NONE) {
+      continue;
+    }
+
+    if (batch == NULL) {
+      batch = sf_stat_job_create(listing, dirfd, generation);
+      if (batch == NULL) {
+        return;
+      }
+    }
+
+    if (!sf_stat_job_add(batch, index, listing->names + entry->name_offset)) {
+      break;
+    }
+    listing->meta[index].state = SF_META_PENDING;
+
+    if (batch->count == SF_STAT_BATCH_SIZE) {
+      sf_stat_job_submit(listing, batch);
+      batch = NULL;
+    }
+  }
+
+  if (batch != NULL) {
+    if (batch->count > 0) {
+      sf_stat_job_submit(listing, batch);
+    } else {
+      sf_stat_job_complete(&batch->job);
+    }
+  }
+}
+
+/*
+ * Starts fetching the types of the entries scanned without one, once per
+ * listing
+ */
+void sf_listing_request_types(
+    sf_listing_t *listing, int dirfd, uint32_t *generation) {
+  if (listing->types_requested || listing->unknown_count == 0) {
+    return;
+  }
+
+  listing->types_requested = true;
+  sf_listing_request_meta(
+      listing, dirfd, generation, NULL, 0, listing->count, true);
+}
+
+/*
+ * Formats a byte count with a binary unit suffix, e.g. 512B, 1.5K or 20M
+ */
+void sf_format_size(uint64_t size, char *dest, size_t dest_size) {
+  const char *units = "BKMGTPE";
+  double value = (double)size;
+  uint32_t unit = 0;
+  while (value >= 1024 && unit + 1 < strlen(units)) {
+    value /= 1024;
+    unit++;
+  }
+
+  if (unit == 0) {
+    snprintf(dest, dest_size, "%" PRIu64 "B", size);
+  } else {
+    snprintf(
+        dest, dest_size, value < 10 ? "%.1f%c" : "%.0f%c", value, units[unit]);
+  }
+}
+
+/*
+ * Formats the metadata columns of an entry, blank until its stat is known
+ */
+void sf_format_meta(
+    const sf_entry_meta_t *meta, sf_entry_type_t type, char *dest) {
+  if (meta == NULL || meta->state != SF_META_DONE) {
+    snprintf(dest, SF_META_COLUMNS_WIDTH + 1, "%*s", SF_META_COLUMNS_WIDTH, "");
+    return;
+  }
+
+  char size[16] = "-";
+  if (type != SF_ENTRY_DIRECTORY) {
+    sf_format_size(meta->size, size, sizeof(size));
+  }
+
+  char mtime[32] = "";
+  time_t seconds = (time_t)meta->mtime;
+  struct tm tm;
+  if (localtime_r(&seconds, &tm) != NULL) {
+    strftime(mtime, sizeof(mtime), "%Y-%m-%d %H:%M", &tm);
+  }
+
+  snprintf(
+      dest,
+      SF_META_COLUMNS_WIDTH + 1,
+      "%*s %-16s",
+      SF_META_SIZE_WIDTH,
+      size,
+      mtime);
+}
+
+/*
+ * Filter matching
+ */
+char sf_ascii_lower(char c) {
+  return (c >= 'A' && c <= 'Z') ? (char)(c - 'A' + 'a') : c;
+}
+
+char sf_ascii_upper(char c) {
+  return (c >= 'a' && c <= 'z') ? (char)(c - 'a' + 'A') : c;
+}
+
+/*
+ * Compares length bytes, b being lowercase if ignore_case is set
+ */
+bool sf_bytes_equal(
+    const char *a, const char *b, uint32_t length, bool ignore_case) {
+  if (!ignore_case) {
+    return memcmp(a, b, length) == 0;
+  }
+
+  for (uint32_t i = 0; i < length; i++) {
+    if (sf_ascii_lower(a[i]) != b[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * Offset of the first occurrence of needle in the length bytes at haystack,
+ * or -1. With ignore_case needle is lowercase and ASCII letters match either
+ * case. Candidates are found 16 offsets at a time by comparing the first and
+ * last byte of needle, only those are compared in full. Blocks may read past
+ * the haystack, up to end.
+ */
+int32_t sf_find(
+    const char *haystack,
+    uint32_t length,
+    const char *end,
+    const char *needle,
+    uint32_t needle_length,
+    bool ignore_case) {
+  if (needle_length == 0) {
+    return 0;
+  } else if (needle_length > length) {
+    return -1;
+  }
+
+  uint32_t starts = length - needle_length + 1; // Offsets needle can be at
+  char first = needle[0];
+  char last = needle[needle_length - 1];
+  uint32_t i = 0;
+
+#if defined(__SSE2__)
+  __m128i first_lower = _mm_set1_epi8(first);
+  __m128i first_upper =
+      _mm_set1_epi8(ignore_case ? sf_ascii_upper(first) : first);
+  __m128i last_lower = _mm_set1_epi8(last);
+  __m128i last_upper = _mm_set1_epi8(ignore_case ? sf_ascii_upper(last) : last);
+
+  for (; i < starts && end - (haystack + i + needle_length - 1) >= 16;
+       i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(haystack + i));
+    __m128i b =
+        _mm_loadu_si128((const __m128i *)(haystack + i + needle_length - 1));
+    __m128i candidates = _mm_and_si128(
+        _mm_or_si128(
+            _mm_cmpeq_epi8(a, first_lower), _mm_cmpeq_epi8(a, first_upper)),
+        _mm_or_si128(
+            _mm_cmpeq_epi8(b, last_lower), _mm_cmpeq_epi8(b, last_upper)));
+    uint32_t mask = (uint32_t)_mm_movemask_epi8(candidates);
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  uint8x16_t first_lower = vdupq_n_u8((uint8_t)first);
+  uint8x16_t first_upper =
+      vdupq_n_u8((uint8_t)(ignore_case ? sf_ascii_upper(first) : first));
+  uint8x16_t last_lower = vdupq_n_u8((uint8_t)last);
+  uint8x16_t last_upper =
+      vdupq_n_u8((uint8_t)(ignore_case ? sf_ascii_upper(last) : last));
+  const uint8x16_t bits = {
+      1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+
+  for (; i < starts && end - (haystack + i + needle_length - 1) >= 16;
+       i += 16) {
+    uint8x16_t a = vld1q_u8((const uint8_t *)(haystack + i));
+    uint8x16_t b =
+        vld1q_u8((const uint8_t *)(haystack + i + needle_length - 1));
+    uint8x16_t candidates = vandq_u8(
+        vorrq_u8(vceqq_u8(a, first_lower), vceqq_u8(a, first_upper)),
+        vorrq_u8(vceqq_u8(b, last_lower), vceqq_u8(b, last_upper)));
+    // NEON has no movemask, each half is summed into a byte instead
+    candidates = vandq_u8(candidates, bits);
+    uint32_t mask = vaddv_u8(vget_low_u8(candidates)) |
+                    ((uint32_t)vaddv_u8(vget_high_u8(candidates)) << 8);
+#endif
+#if defined(__SSE2__) || (defined(__ARM_NEON) && defined(__aarch64__))
+    if (starts - i < 16) {
+      mask &= (1u << (starts - i)) - 1;
+    }
+
+    while (mask != 0) {
+      uint32_t offset = i + __builtin_ctz(mask);
+      if (sf_bytes_equal(
+              haystack + offset + 1,
+              needle + 1,
+              needle_length - 1,
+              ignore_case)) {
+        return offset;
+      }
+      mask &= mask - 1;
+    }
+  }
+#endif
+
+  // What's left too close to end for a whole block
+  for (; i < starts; i++) {
+    char c = ignore_case ? sf_ascii_lower(haystack[i]) : haystack[i];
+    if (c == first && sf_bytes_equal(
+                          haystack + i + 1,
+                          needle + 1,
+                          needle_length - 1,
+                          ignore_case)) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+/*
+ * Filters are case sensitive only if they contain an uppercase letter
+ */
+bool sf_filter_ignores_case(const char *filter) {
+  for (const char *c = filter; *c != '\0'; c++) {
+    if (*c >= 'A' && *c <= 'Z') {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * Whether the name of the entry at index contains filter, or its characters
+ * in order if SF_FILTER_FUZZY is set
+ */
+bool sf_listing_matches(
+    const sf_listing_t *listing,
+    uint32_t index,
+    const char *filter,
+    uint32_t filter_length,
+    bool ignore_case) {
+  const sf_entry_t *entry = &listing->entries[index];
+  const char *name = listing->names + entry->name_offset;
+  // Blocks may read into the names stored after this one
+  const char *end = listing->names + listing->names_capacity;
+
+#ifdef SF_FILTER_FUZZY
+  uint32_t offset = 0;
+  for (uint32_t i = 0; i < filter_length; i++) {
+    int32_t found = sf_find(
+        name + offset,
+        entry->name_length - offset,
+        end,
+        filter + i,
+        1,
+        ignore_case);
+    if (found < 0) {
+      return false;
+    }
+    offset += found + 1;
+  }
+  return true;
+#else
+  int32_t found = sf_find(
+      name, entry->name_length, end, filter, filter_length, ignore_case);
+  return found >= 0;
+#endif
+}
+
+void sf_color_on(short pair) {
+  if (has_colors()) {
+    attron(COLOR_PAIR(pair));
+  }
+}
+
+void sf_color_off(short pair) {
+  if (has_colors()) {
+    attroff(COLOR_PAIR(pair));
+  }
+}
+
+void sf_pcolor_on(sf_pane_t *pane, short pair) {
+  if (has_colors()) {
+    wattron(pane->window, COLOR_PAIR(pair));
+  }
+}
+
+void sf_pcolor_off(sf_pane_t *pane, short pair) {
+  if (has_colors()) {
+    wattroff(pane->window, COLOR_PAIR(pair));
+  }
+}
+
+/*
+ * Display width functions
+ */
+
+/*
+ * Decodes the character at offset into size bytes taking width columns.
+ * Returns false for what can't be drawn as it is: control characters, and
+ * each byte that isn't valid in the locale's encoding, which are then a
+ * single byte drawn as '?'.
+ */
+bool sf_text_next(
+    const char *text,
+    uint32_t length,
+    uint32_t offset,
+    mbstate_t *state,
+    uint32_t *size,
+    uint32_t *width) {
+  *size = 1;
+  *width = 1;
+
+  // Printable ASCII, most names are nothing else
+  unsigned char c = (unsigned char)text[offset];
+  if (c >= 0x20 && c < 0x7f) {
+    return true;
+  }
+
+  wchar_t wc;
+  size_t decoded = mbrtowc(&wc, text + offset, length - offset, state);
+  if (decoded == (size_t)-1 || decoded == (size_t)-2 || decoded == 0) {
+    memset(state, 0, sizeof(*state));
+    return false;
+  }
+
+  int columns = wcwidth(wc);
+  if (columns < 0) {
+    return false;
+  }
+
+  *size = (uint32_t)decoded;
+  *width = (uint32_t)columns;
+  return true;
+}
+
+/*
+ * Measures text of length bytes as drawn: its display width, and in
+ * fit_length how many of its bytes fit in columns without splitting a
+ * character. Returns false if some of it is drawn as '?', see sf_text_next.
+ */
+bool sf_text_measure(
+    const char *text,
+    uint32_t length,
+    uint32_t columns,
+    uint32_t *width,
+    uint32_t *fit_length) {
+  mbstate_t state;
+  memset(&state, 0, sizeof(state));
+
+  bool plain = true;
+  bool fits = true;
+  *width = 0;
+  *fit_length = length;
+
+  for (uint32_t i = 0; i < length;) {
+    uint32_t size, char_width;
+    plain &= sf_text_next(text, length, i, &state, &size, &char_width);
+
+    if (fits && *width + char_width > columns) {
+      fits = false;
+      *fit_length = i;
+    }
+
+    *width += char_width;
+    i += size;
+  }
+
+  return plain;
+}
+
+/*
+ * Copies the first length bytes of text to dest, which needs length + 1
+ * bytes, with '?' in place of what can't be drawn
+ */
+void sf_text_sanitize(const char *text, uint32_t length, char *dest) {
+  mbstate_t state;
+  memset(&state, 0, sizeof(state));
+
+  for (uint32_t i = 0; i < length;) {
+    uint32_t size, width;
+    if (sf_text_next(text, length, i, &state, &size, &width)) {
+      memcpy(dest + i, text + i, size);
+    } else {
+      dest[i] = '?';
+    }
+    i += size;
+  }
+  dest[length] = '\0';
+}
+
+/*
+ * Layout of the name of the entry at position drawn in columns. Names are
+ * measured once, and only those too wide are measured again when drawn at
+ * another width.
+ */
+sf_entry_layout_t
+sf_listing_layout(sf_listing_t *listing, uint32_t position, uint32_t columns) {
+  uint32_t index = listing->order[position];
+  const sf_entry_t *entry = &listing->entries[index];
+  const char *name = listing->names + entry->name_offset;
+
+  if (columns > UINT16_MAX) {
+    columns = UINT16_MAX;
+  }
+
+  if (listing->layouts == NULL && listing->entry_capacity > 0) {
+    listing->layouts =
+        calloc(listing->entry_capacity, sizeof(sf_entry_layout_t));
+  }
+
+  // Measured on every call if there's no memory to keep it
+  sf_entry_layout_t measured = {0};
+  sf_entry_layout_t *layout =
+      listing->layouts != NULL ? &listing->layouts[index] : &measured;
+
+  if (layout->width != 0 && layout->fit_columns == columns) {
+    return *layout;
+  }
+
+  if (layout->width != 0 && layout->width - 1u <= columns) {
+    layout->fit_length = entry->name_length;
+  } else {
+    uint32_t width, fit_length;
+    layout->plain = sf_text_measure(
+        name, entry->name_length, columns, &width, &fit_length);
+    layout->width = (uint16_t)(width + 1);
+    layout->fit_length = (uint16_t)fit_length;
+  }
+  layout->fit_columns = (uint16_t)columns;
+
+  return *layout;
+}
+
+/*
+ * Directory functions
+ */
+sf_dir_t *sf_dir_find(const char *path) {
+  for (sf_dir_t *dir = sf_dirs; dir != NULL; dir = dir->next) {
+    if (strcmp(dir->path, path) == 0) {
+      return dir;
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Adds an empty directory to the open ones, taking ownership of fd and
+ * watch. The caller holds its only reference.
+ */
+sf_dir_t *sf_dir_create(const char *path, int fd, int watch) {
+  size_t length = strlen(path);
+  sf_dir_t *dir =
+      length < sizeof(dir->path) ? calloc(1, sizeof(sf_dir_t)) : NULL;
+  if (dir == NULL) {
+    sf_watch_close(&watch);
+    if (fd != -1) {
+      close(fd);
+    }
+    return NULL;
+  }
+
+  memcpy(dir->path, path, length + 1);
+  dir->dirfd = fd;
+  dir->watch = watch;
+  dir->refs = 1;
+  dir->next = sf_dirs;
+  sf_dirs = dir;
+  return dir;
+}
+
+/*
+ * Applies the changes of dir queued since they were last applied. Changes
+ * made while the directory is read stay queued until the scan completes,
+ * which calls this again.
+ */
+void sf_dir_apply_events(sf_dir_t *dir) {
+  if (dir->pending == NULL && sf_watch_pending(dir->watch)) {
+    sf_dir_process_events(dir);
+  }
+}
+
+/*
+ * Opens the directory name, relative to dirfd, whose real path is path, and
+ * starts reading it. A directory that's open already is shared instead.
+ * Returns NULL if it can't be opened.
+ */
+sf_dir_t *sf_dir_open(int dirfd, const char *name, const char *path) {
+  sf_dir_t *dir = sf_dir_find(path);
+  if (dir != NULL) {
+    dir->refs++;
+    return dir;
+  }
+
+  int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1) {
+    return NULL;
+  }
+
+  // Watch before scanning so changes made during the scan aren't missed
+  dir = sf_dir_create(path, fd, sf_watch_open(fd));
+  if (dir != NULL) {
+    sf_dir_load(dir);
+  }
+  return dir;
+}
+
+void sf_dir_release(sf_dir_t *dir) {
+  if (dir == NULL || --dir->refs > 0) {
+    return;
+  }
+
+  for (sf_dir_t **link = &sf_dirs; *link != NULL; link = &(*link)->next) {
+    if (*link == dir) {
+      *link = dir->next;
+      break;
+    }
+  }
+
+  sf_dir_cancel_scan(dir);
+  sf_listing_destroy(&dir->listing);
+  sf_watch_close(&dir->watch);
+  if (dir->dirfd != -1) {
+    close(dir->dirfd);
+  }
+  free(dir);
+}
+
+/*
+ * Marks the listing of dir changed. The preview follows the selection of the
+ * current view, which may have moved if the view shows dir.
+ */
+void sf_dir_touch(sf_dir_t *dir) {
+  dir->generation++;
+  if (sf_views[sf_current_view].dir == dir) {
+    sf_side_view_invalidate(&sf_side_view);
+  }
+}
+
+void sf_dir_scan_run(sf_job_t *job) {
+  sf_scan_job_t *scan = (sf_scan_job_t *)job;
+  scan->success = sf_get_entries(
+      scan->dirfd,
+      ".",
+      scan->path,
+      &job->cancelled,
+      &scan->progress,
+      &scan->listing);
+}
+
+/*
+ * Adds the entries the directory's scan read since the last call to the
+ * listing
+ */
+void sf_dir_take_progress(sf_dir_t *dir) {
+  sf_scan_job_t *scan = dir->pending;
+  if (scan == NULL) {
+    return;
+  }
+
+  uint32_t first = dir->listing.count;
+
+  // The first chunk is taken as it is, a snapshot is never copied
+  pthread_mutex_lock(&scan->progress.mutex);
+  if (dir->listing.entry_count == 0) {
+    sf_listing_move(&dir->listing, &scan->progress.chunk);
+  } else {
+    sf_listing_append(&dir->listing, &scan->progress.chunk, 0);
+    sf_listing_destroy(&scan->progress.chunk);
+  }
+  pthread_mutex_unlock(&scan->progress.mutex);
+
+  if (dir->listing.count == first) {
+    return;
+  }
+
+  for (uint32_t i = 0; i < SF_VIEW_COUNT; i++) {
+    sf_view_t *view = &sf_views[i];
+    if (view->dir == dir && view->select[0] != '\0') {
+      sf_view_select_name(view, view->select);
+    }
+  }
+
+  sf_dir_touch(dir);
+}
+
+/*
+ * Swaps the sorted listing in, keeping the entries that were picked while
+ * the directory was read selected
+ */
+void sf_dir_scan_complete(sf_job_t *job) {
+  sf_scan_job_t *scan = (sf_scan_job_t *)job;
+  sf_dir_t *dir = scan->dir;
+
+  if (dir != NULL) {
+    dir->pending = NULL;
+
+    // Entries picked in a sorted listing shown meanwhile, a snapshot's,
+    // stay selected
+    for (uint32_t i = 0; i < SF_VIEW_COUNT; i++) {
+      sf_view_t *view = &sf_views[i];
+      if (view->dir == dir && view->select[0] == '\0' &&
+          !dir->listing.unsorted &&
+          view->selected_entry < dir->listing.count) {
+        strncpy(
+            view->select,
+            sf_listing_name(&dir->listing, view->selected_entry),
+            sizeof(view->select) - 1);
+      }
+    }
+
+    if (scan->success) {
+      sf_listing_move(&dir->listing, &scan->listing);
+    } else {
+      // Keep what could be read
+      sf_listing_sort(&dir->listing);
+    }
+
+    for (uint32_t i = 0; i < SF_VIEW_COUNT; i++) {
+      sf_view_t *view = &sf_views[i];
+      if (view->dir != dir) {
+        continue;
+      }
+
+      if (!sf_view_select_name(view, view->select)) {
+        view->selected_entry = 0;
+      }
+      view->select[0] = '\0';
+    }
+
+    sf_dir_touch(dir);
+    sf_dir_apply_events(dir);
+
+#ifdef SF_TRACE
+    if (!sf_tracer.first_listing_traced) {
+      sf_tracer.first_listing_traced = true;
+      sf_trace_span(
+          SF_TRACE_SCAN,
+          "time to first listing",
+          sf_tracer.started_us,
+          dir->path,
+          dir->listing.count);
+    }
+#endif
+  }
+
+  sf_listing_destroy(&scan->listing);
+  sf_listing_destroy(&scan->progress.chunk);
+  pthread_mutex_destroy(&scan->progress.mutex);
+  close(scan->dirfd);
+  free(scan);
+}
+
+void sf_dir_cancel_scan(sf_dir_t *dir) {
+  if (dir->pending != NULL) {
+    atomic_store(&dir->pending->job.cancelled, true);
+    dir->pending->dir = NULL;
+    dir->pending = NULL;
+  }
+}
+
+/*
+ * Starts reading the directory in the background, entries show up as
+ * they're read. Each view showing it keeps its selected entry selected.
+ */
+void sf_dir_load(sf_dir_t *dir) {
+  for (uint32_t i = 0; i < SF_VIEW_COUNT; i++) {
+    sf_view_t *view = &sf_views[i];
+    if (view->dir != dir) {
+      continue;
+    }
+
+    if (view->select[0] == '\0' && dir->listing.count > 0) {
+      strncpy(
+          view->select,
+          sf_listing_name(&dir->listing, view->selected_entry),
+          sizeof(view->select) - 1);
+    }
+    view->selected_entry = 0;
+  }
+
+  sf_dir_cancel_scan(dir);
+  sf_listing_destroy(&dir->listing);
+  sf_dir_touch(dir);
+
+  if (dir->dirfd == -1) {
+    return;
+  }
+
+  // A cancelled scan doesn't apply the queued changes once it completes
+  sf_scan_job_t *scan = calloc(1, sizeof(sf_scan_job_t));
+  if (scan == NULL) {
+    sf_dir_apply_events(dir);
+    return;
+  }
+
+  // The directory may be closed while the scan runs
+  scan->dirfd = fcntl(dir->dirfd, F_DUPFD_CLOEXEC, 0);
+  if (scan->dirfd == -1) {
+    free(scan);
+    sf_dir_apply_events(dir);
+    return;
+  }
+
+  scan->job.run = sf_dir_scan_run;
+  scan->job.complete = sf_dir_scan_complete;
+  scan->fd = scan->watch = -1;
+  strcpy(scan->path, dir->path);
+  scan->dir = dir;
+  pthread_mutex_init(&scan->progress.mutex, NULL);
+  scan->progress.wake_fd = sf_pool.notify_fds[1];
+  scan->started_ms = sf_now_ms();
+
+  dir->pending = scan;
+  sf_pool_submit(&sf_pool, &scan->job);
+}
+
+void sf_dir_on_insert(void *data, uint32_t index) {
+  sf_dir_t *dir = (sf_dir_t *)data;
+  for (uint32_t i = 0; i < SF_VIEW_COUNT; i++) {
+    sf_view_t *view = &sf_views[i];
+    if (view->dir == dir && dir->listing.count > 1 &&
+        index <= view->selected_entry) {
+      view->selected_entry++;
+    }
+  }
+}
+
+void sf_dir_on_remove(void *data, uint32_t index) {
+  sf_dir_t *dir = (sf_dir_t *)data;
+  for (uint32_t i = 0; i < SF_VIEW_COUNT; i++) {
+    sf_view_t *view = &sf_views[i];
+    if (view->dir == dir &&
+        (index < view->selected_entry ||
+         (view->selected_entry > 0 &&
+          view->selected_entry >= dir->listing.count))) {
+      view->selected_entry--;
+    }
+  }
+}
+
+void sf_dir_handle_event(void *data, uint32_t mask, const char *name) {
+  sf_dir_t *dir = (sf_dir_t *)data;
+  sf_listing_apply_event(
+      &dir->listing,
+      dir->dirfd,
+      mask,
+      name,
+      sf_dir_on_insert,
+      sf_dir_on_remove,
+      dir);
+}
+
+/*
+ * Applies pending changes of the directory to its listing, keeping the same
+ * entries selected in the views showing it
+ */
+void sf_dir_process_events(sf_dir_t *dir) {
+  sf_view_t *view = &sf_views[sf_current_view];
+  char selected[NAME_MAX + 1] = "";
+  if (view->dir == dir && dir->listing.count > 0) {
+    strncpy(
+        selected,
+        sf_listing_name(&dir->listing, view->selected_entry),
+        sizeof(selected) - 1);
+  }
+
+  dir->generation++;
+
+  if (!sf_watch_read(dir->watch, sf_dir_handle_event, dir)) {
+    // Events were lost
+    sf_dir_load(dir);
+  }
+
+  if (view->dir == dir &&
+      (dir->listing.count == 0 ||
+       strcmp(
+           selected, sf_listing_name(&dir->listing, view->selected_entry)) !=
+           0)) {
+    sf_side_view_invalidate(&sf_side_view);
+  }
+}
+
+/*
+ * Sorts the listing in sf_sort, keeping what views select selected. Orders
+ * by metadata are only sorted once all of it was fetched, the listing is
+ * shown as it was until then.
+ */
+void sf_dir_sort(sf_dir_t *dir) {
+  sf_listing_t *listing = &dir->listing;
+
+  uint32_t selected[SF_VIEW_COUNT];
+  for (uint32_t i = 0; i < SF_VIEW_COUNT; i++) {
+    if (sf_views[i].dir == dir && listing->count > 0) {
+      selected[i] = listing->order[sf_views[i].selected_entry];
+    }
+  }
+
+  sf_listing_set_sort(listing, sf_sort);
+  if (listing->unsorted &&
+      !(sf_sort_uses_meta(listing->sort) && listing->stat_jobs != NULL)) {
+    sf_listing_sort(listing);
+  }
+
+  for (uint32_t i = 0; i < SF_VIEW_COUNT; i++) {
+    if (sf_views[i].dir == dir && listing->count > 0) {
+      sf_views[i].selected_entry = sf_listing_position(listing, selected[i]);
+    }
+  }
+
+  // The selection may have turned out to be a directory
+  sf_dir_touch(dir);
+}
+
+/*
+ * Fetches the types the scan couldn't provide, so directories are shown and
+ * sorted as such, and the metadata of every entry if it's sorted by it
+ */
+void sf_dir_sync_metadata(sf_dir_t *dir) {
+  sf_listing_t *listing = &dir->listing;
+  if (dir->pending != NULL) {
+    // Fetched once the listing is complete
+    return;
+  }
+
+  sf_listing_request_types(listing, dir->dirfd, &dir->generation);
+
+  if (sf_sort_uses_meta(sf_sort) && !listing->meta_requested) {
+    listing->meta_requested = true;
+    sf_listing_request_meta(
+        listing, dir->dirfd, &dir->generation, NULL, 0, listing->count, false);
+  }
+
+  bool waiting = sf_sort_uses_meta(sf_sort) && listing->stat_jobs != NULL;
+  if (listing->sort != sf_sort || (listing->unsorted && !waiting)) {
+    sf_dir_sort(dir);
+  }
+}
+
+/*
+ * Directory size functions
+ */
+
+/*
+ * Whether a walk depth levels below the directory its job started at
+ * queues a subdirectory rather than walking it in place: while fewer jobs
+ * are queued than there are workers in pool to take them, and always past
+ * SF_WALK_MAX_DEPTH. Busy workers thus keep splitting off work for idle
+ * ones, and each keeps a bounded number of directories open.
+ */
+bool sf_walk_queues(
+    const sf_pool_t *pool, atomic_uint *queued, uint32_t depth) {
+  return depth + 1 >= SF_WALK_MAX_DEPTH ||
+         atomic_load(queued) < pool->thread_count;
+}
+
+/*
+ * Opens the directory path in fd to walk it, without following links. The
+ * walk is marked truncated if it failed for lack of fds.
+ */
+int sf_walk_open(int fd, const char *path, atomic_bool *truncated) {
+  int subdir_fd =
+      openat(fd, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (subdir_fd == -1 && (errno == EMFILE || errno == ENFILE)) {
+    atomic_store(truncated, true);
+  }
+  return subdir_fd;
+}
+
+/*
+ * Opens the directory a queued job walks, at the length bytes of path
+ * relative to root_fd, which are empty for the root itself
+ */
+int sf_walk_open_path(
+    int root_fd, char *path, uint32_t length, atomic_bool *truncated) {
+  if (length == 0) {
+    return sf_walk_open(root_fd, ".", truncated);
+  }
+
+  // A trailing '/' would follow a link swapped in since it was queued
+  path[length - 1] = '\0';
+  int fd = sf_walk_open(root_fd, path, truncated);
+  path[length - 1] = '/';
+  return fd;
+}
+
+/*
+ * Records a file with several links, returns false if it was seen already
+ */
+bool sf_du_add_link(sf_du_t *du, const struct stat *st) {
+  pthread_mutex_lock(&du->links_mutex);
+
+  // Grow at half load
+  if (du->link_count * 2 >= du->link_capacity) {
+    uint32_t capacity = du->link_capacity == 0 ? 64 : du->link_capacity * 2;
+    sf_du_link_t *links = calloc(capacity, sizeof(sf_du_link_t));
+    if (links == NULL) {
+      pthread_mutex_unlock(&du->links_mutex);
+      return true;
+    }
+
+    for (uint32_t i = 0; i < du->link_capacity; i++) {
+      sf_du_link_t *link = &du->links[i];
+      if (link->dev == 0 && link->ino == 0) {
+        continue;
+      }
+
+      uint32_t slot = (uint32_t)link->ino & (capacity - 1);
+      while (links[slot].dev != 0 || links[slot].ino != 0) {
+        slot = (slot + 1) & (capacity - 1);
+      }
+      links[slot] = *link;
+    }
+
+    free(du->links);
+    du->links = links;
+    du->link_capacity = capacity;
+  }
+
+  bool added = true;
+  uint32_t slot = (uint32_t)st->st_ino & (du->link_capacity - 1);
+  for (;; slot = (slot + 1) & (du->link_capacity - 1)) {
+    sf_du_link_t *link = &du->links[slot];
+    if (link->dev == 0 && link->ino == 0) {
+      link->dev = st->st_dev;
+      link->ino = st->st_ino;
+      du->link_count++;
+      break;
+    }
+
+    if (link->dev == st->st_dev && link->ino == st->st_ino) {
+      added = false;
+      break;
+    }
+  }
+
+  pthread_mutex_unlock(&du->links_mutex);
+  return added;
+}
+
+/*
+ * Adds the entries below the directory fd, which is closed, to the totals of
+ * du. Its path relative to the root is the length bytes at path, entries
+ * are appended to it as they're walked, which needs PATH_MAX bytes.
+ * Subdirectories are queued or walked here as sf_walk_queues decides.
+ */
+void sf_du_walk(
+    sf_du_t *du, int fd, char *path, uint32_t length, uint32_t depth) {
+  DIR *dir = fdopendir(fd);
+  if (dir == NULL) {
+    close(fd);
+    return;
+  }
+
+  uint32_t visited = 0;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL &&
+         !atomic_load_explicit(&du->cancelled, memory_order_relaxed)) {
+    if (!IS_VALID_ENTRY(entry->d_name)) {
+      continue;
+    }
+
+    struct stat st;
+    if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+      continue;
+    }
+
+    if (S_ISDIR(st.st_mode) || st.st_nlink <= 1 || sf_du_add_link(du, &st)) {
+      atomic_fetch_add_explicit(
+          &du->bytes, (uint64_t)st.st_blocks * 512, memory_order_relaxed);
+    }
+
+    if (!S_ISDIR(st.st_mode)) {
+      atomic_fetch_add_explicit(&du->files, 1, memory_order_relaxed);
+    } else if (st.st_dev == du->dev) {
+      // Like du -x, other filesystems mounted below aren't walked
+      uint32_t name_length = strlen(entry->d_name);
+      if (length + name_length + 1 >= PATH_MAX) {
+        atomic_store(&du->truncated, true);
+        continue;
+      }
+      memcpy(path + length, entry->d_name, name_length);
+      path[length + name_length] = '/';
+      path[length + name_length + 1] = '\0';
+
+      if (!sf_walk_queues(&sf_du_pool, &du->queued, depth) ||
+          !sf_du_submit(du, path)) {
+        int subdir_fd = sf_walk_open(dirfd(dir), entry->d_name, &du->truncated);
+        if (subdir_fd != -1) {
+          sf_du_walk(
+              du, subdir_fd, path, length + name_length + 1, depth + 1);
+        }
+      }
+    }
+
+    if (++visited % SF_DU_PROGRESS_BATCH == 0) {
+      sf_du_publish(du);
+    }
+  }
+
+  closedir(dir);
+}
+
+/*
+ * Wakes up the main loop to draw the totals so far, at most every
+ * SF_DU_PROGRESS_INTERVAL_MS across all workers
+ */
+void sf_du_publish(sf_du_t *du) {
+  int64_t now = sf_now_ms();
+  int_fast64_t published = atomic_load(&du->published_ms);
+  if (now - published < SF_DU_PROGRESS_INTERVAL_MS ||
+      !atomic_compare_exchange_strong(&du->published_ms, &published, now)) {
+    return;
+  }
+
+  sf_notify(sf_du_pool.notify_fds[1]);
+}
+
+/*
+ * Queues a job walking the directory at path relative to the root of du
+ */
+bool sf_du_submit(sf_du_t *du, const char *path) {
+  size_t length = strlen(path);
+  sf_du_job_t *walk = calloc(1, sizeof(sf_du_job_t) + length + 1);
+  if (walk == NULL) {
+    return false;
+  }
+
+  walk->job.run = sf_du_job_run;
+  walk->job.complete = sf_du_job_complete;
+  walk->du = du;
+  memcpy(walk->path, path, length + 1);
+
+  atomic_fetch_add(&du->jobs, 1);
+  atomic_fetch_add(&du->queued, 1);
+  sf_pool_submit(&sf_du_pool, &walk->job);
+  return true;
+}
+
+void sf_du_job_run(sf_job_t *job) {
+  sf_du_job_t *walk = (sf_du_job_t *)job;
+
+  sf_du_t *du = walk->du;
+  atomic_fetch_sub(&du->queued, 1);
+  walk->ran = true;
+
+  char path[PATH_MAX];
+  uint32_t length = strlen(walk->path);
+  memcpy(path, walk->path, length + 1);
+  int fd = sf_walk_open_path(du->fd, path, length, &du->truncated);
+  if (fd != -1) {
+    sf_du_walk(du, fd, path, length, 0);
+  }
+  sf_du_publish(du);
+}
+
+void sf_du_job_complete(sf_job_t *job) {
+  sf_du_job_t *walk = (sf_du_job_t *)job;
+  sf_du_t *du = walk->du;
+
+  // Jobs cancelled before running leave the totals short
+  if (!walk->ran) {
+    atomic_store(&du->cancelled, true);
+  }
+  free(walk);
+
+  // Jobs are submitted while their parent runs, so the count only drops to
+  // zero once the whole tree was walked
+  if (atomic_fetch_sub(&du->jobs, 1) > 1) {
+    return;
+  }
+
+  if (du->released) {
+    sf_du_free(du);
+    return;
+  }
+
+  // No worker is left to look up links
+  free(du->links);
+  du->links = NULL;
+  du->link_capacity = du->link_count = 0;
+
+  if (!atomic_load(&du->cancelled)) {
+    du->done = true;
+  }
+
+  // Totals short of directories that couldn't be opened aren't memoized
+  if (du->done && !atomic_load(&du->truncated)) {
+    sf_du_memo_t *memo = sf_du_memo_find(du->dev, du->ino);
+    if (memo == NULL) {
+      memo = &sf_du_memo[sf_du_memo_next];
+      sf_du_memo_next = (sf_du_memo_next + 1) % SF_DU_MEMO_SIZE;
+    }
+    memo->valid = true;
+    memo->dev = du->dev;
+    memo->ino = du->ino;
+    memo->mtime = du->mtime;
+    memo->bytes = atomic_load(&du->bytes);
+    memo->files = atomic_load(&du->files);
+  }
+
+  if (sf_side_view.du == du) {
+    sf_side_view.generation++;
+  }
+}
+
+sf_du_memo_t *sf_du_memo_find(dev_t dev, ino_t ino) {
+  for (uint32_t i = 0; i < SF_DU_MEMO_SIZE; i++) {
+    if (sf_du_memo[i].valid && sf_du_memo[i].dev == dev &&
+        sf_du_memo[i].ino == ino) {
+      return &sf_du_memo[i];
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Starts adding up the size of the directory name in dirfd. A result
+ * memoized for the same directory and modification time is reused right
+ * away, so changes deeper down that leave it untouched aren't seen then.
+ */
+sf_du_t *sf_du_start(int dirfd, const char *name) {
+  int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1) {
+    return NULL;
+  }
+
+  struct stat st;
+  sf_du_t *du = fstat(fd, &st) == 0 ? calloc(1, sizeof(sf_du_t)) : NULL;
+  if (du == NULL) {
+    close(fd);
+    return NULL;
+  }
+
+  du->dev = st.st_dev;
+  du->ino = st.st_ino;
+  du->mtime = st.st_mtim;
+  du->fd = fd;
+  atomic_init(&du->bytes, (uint64_t)st.st_blocks * 512);
+  atomic_init(&du->files, 0);
+  atomic_init(&du->cancelled, false);
+  atomic_init(&du->truncated, false);
+  atomic_init(&du->jobs, 0);
+  atomic_init(&du->queued, 0);
+  atomic_init(&du->published_ms, 0);
+  pthread_mutex_init(&du->links_mutex, NULL);
+
+  sf_du_memo_t *memo = sf_du_memo_find(du->dev, du->ino);
+  if (memo != NULL && memo->mtime.tv_sec == du->mtime.tv_sec &&
+      memo->mtime.tv_nsec == du->mtime.tv_nsec) {
+    atomic_store(&du->bytes, memo->bytes);
+    atomic_store(&du->files, memo->files);
+    du->done = true;
+    close(fd);
+    du->fd = -1;
+    return du;
+  }
+
+  if (!sf_du_submit(du, "")) {
+    sf_du_free(du);
+    return NULL;
+  }
+
+  return du;
+}
+
+void sf_du_free(sf_du_t *du) {
+  if (du->fd != -1) {
+    close(du->fd);
+  }
+  pthread_mutex_destroy(&du->links_mutex);
+  free(du->links);
+  free(du);
+}
+
+/*
+ * Cancels the walk, du is freed once none of its jobs are left
+ */
+void sf_du_release(sf_du_t *du) {
+  if (du == NULL) {
+    return;
+  }
+
+  atomic_store(&du->cancelled, true);
+  du->released = true;
+  if (atomic_load(&du->jobs) == 0) {
+    sf_du_free(du);
+  }
+}
+
+/*
+ * Finder functions
+ */
+
+/*
+ * Hands the paths in batch over to the main thread if it's full, or if it's
+ * time to wake the main thread up again, which happens at most every
+ * SF_FIND_PROGRESS_INTERVAL_MS across all workers
+ */
+void sf_find_publish(sf_find_walk_t *walk, sf_find_batch_t *batch, bool full) {
+  if (batch->size == 0) {
+    return;
+  }
+
+  int64_t now = sf_now_ms();
+  int_fast64_t published = atomic_load(&walk->published_ms);
+  bool notify =
+      now - published >= SF_FIND_PROGRESS_INTERVAL_MS &&
+      atomic_compare_exchange_strong(&walk->published_ms, &published, now);
+  if (!full && !notify) {
+    return;
+  }
+
+  // Paths that don't fit are lost, as if they weren't there
+  pthread_mutex_lock(&walk->mutex);
+  if (sf_arena_reserve(
+          &walk->found, &walk->found_capacity, walk->found_size, batch->size)) {
+    memcpy(walk->found + walk->found_size, batch->data, batch->size);
+    walk->found_size += batch->size;
+  }
+  pthread_mutex_unlock(&walk->mutex);
+  batch->size = 0;
+
+  if (notify) {
+    sf_notify(sf_find_pool.notify_fds[1]);
+  }
+}
+
+void sf_find_add(
+    sf_find_walk_t *walk,
+    sf_find_batch_t *batch,
+    sf_entry_type_t type,
+    const char *path,
+    uint32_t length) {
+  if (batch->size + length + 2 > sizeof(batch->data)) {
+    sf_find_publish(walk, batch, true);
+  }
+
+  batch->data[batch->size] = (char)type;
+  memcpy(batch->data + batch->size + 1, path, length + 1);
+  batch->size += length + 2;
+}
+
+/*
+ * Finds the entries below the directory fd, which is closed, whose path
+ * relative to the root is the length bytes at path. Entries found are
+ * appended to path as they are walked, which needs PATH_MAX bytes.
+ * Subdirectories are queued or walked here as sf_walk_queues decides.
+ */
+void sf_find_walk(
+    sf_find_walk_t *walk,
+    int fd,
+    char *path,
+    uint32_t length,
+    uint32_t depth,
+    sf_find_batch_t *batch) {
+  DIR *dir = fdopendir(fd);
+  if (dir == NULL) {
+    close(fd);
+    return;
+  }
+
+  uint32_t visited = 0;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL &&
+         !atomic_load_explicit(&walk->cancelled, memory_order_relaxed)) {
+    if (!IS_VALID_ENTRY(entry->d_name) ||
+        (!walk->show_hidden_files && entry->d_name[0] == '.')) {
+      continue;
+    }
+
+    uint32_t name_length = strlen(entry->d_name);
+    if (length + name_length + 1 >= PATH_MAX) {
+      continue;
+    }
+    memcpy(path + length, entry->d_name, name_length + 1);
+
+    sf_entry_type_t type = sf_entry_type_from_dtype(entry->d_type);
+    struct stat st;
+    if (type == SF_ENTRY_UNKNOWN &&
+        fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+      type = sf_entry_type_from_dtype(sf_dtype_from_mode(st.st_mode));
+    }
+    sf_find_add(walk, batch, type, path, length + name_length);
+
+    // Links aren't followed, so every directory is walked once
+    if (type == SF_ENTRY_DIRECTORY) {
+      path[length + name_length] = '/';
+      path[length + name_length + 1] = '\0';
+      if (!sf_walk_queues(&sf_find_pool, &walk->queued, depth) ||
+          !sf_find_submit(walk, path)) {
+        int subdir_fd =
+            sf_walk_open(dirfd(dir), entry->d_name, &walk->truncated);
+        if (subdir_fd != -1) {
+          sf_find_walk(
+              walk,
+              subdir_fd,
+              path,
+              length + name_length + 1,
+              depth + 1,
+              batch);
+        }
+      }
+    }
+
+    if (++visited % SF_FIND_PROGRESS_BATCH == 0) {
+      sf_find_publish(walk, batch, false);
+    }
+  }
+
+  closedir(dir);
+}
+
+/*
+ * Queues a job walking the directory at path relative to the root of walk
+ */
+bool sf_find_submit(sf_find_walk_t *walk, const char *path) {
+  size_t length = strlen(path);
+  sf_find_job_t *job = calloc(1, sizeof(sf_find_job_t) + length + 1);
+  if (job == NULL) {
+    return false;
+  }
+
+  job->job.run = sf_find_job_run;
+  job->job.complete = sf_find_job_complete;
+  job->walk = walk;
+  memcpy(job->path, path, length + 1);
+
+  atomic_fetch_add(&walk->jobs, 1);
+  atomic_fetch_add(&walk->queued, 1);
+  sf_pool_submit(&sf_find_pool, &job->job);
+  return true;
+}
+
+void sf_find_job_run(sf_job_t *job) {
+  sf_find_job_t *find = (sf_find_job_t *)job;
+  sf_find_walk_t *walk = find->walk;
+
+  atomic_fetch_sub(&walk->queued, 1);
+  sf_find_batch_t *batch = malloc(sizeof(sf_find_batch_t));
+  if (batch == NULL) {
+    return;
+  }
+  batch->size = 0;
+
+  find->ran = true;
+
+  char path[PATH_MAX];
+  uint32_t length = strlen(find->path);
+  memcpy(path, find->path, length + 1);
+  int fd = sf_walk_open_path(walk->fd, path, length, &walk->truncated);
+  if (fd != -1) {
+    sf_find_walk(walk, fd, path, length, 0, batch);
+  }
+  sf_find_publish(walk, batch, true);
+  free(batch);
+}
+
+void sf_find_job_complete(sf_job_t *job) {
+  sf_find_job_t *find = (sf_find_job_t *)job;
+  sf_find_walk_t *walk = find->walk;
+
+  // Jobs cancelled before running leave parts of the tree unsearched
+  if (!find->ran) {
+    atomic_store(&walk->truncated, true);
+  }
+  free(find);
+
+  // Jobs are submitted while their parent runs, so the count only drops to
+  // zero once the whole tree was walked
+  if (atomic_fetch_sub(&walk->jobs, 1) > 1) {
+    return;
+  }
+
+  if (walk->released) {
+    sf_find_walk_free(walk);
+    return;
+  }
+
+  sf_finder_take_results(&sf_finder);
+  sf_finder.walk = NULL;
+  sf_finder.version++;
+  sf_find_walk_free(walk);
+}
+
+void sf_find_walk_free(sf_find_walk_t *walk) {
+  close(walk->fd);
+  pthread_mutex_destroy(&walk->mutex);
+  free(walk->found);
+  free(walk);
+}
+
+/*
+ * Cancels the walk, which is freed once none of its jobs are left
+ */
+void sf_find_walk_release(sf_find_walk_t *walk) {
+  if (walk == NULL) {
+    return;
+  }
+
+  atomic_store(&walk->cancelled, true);
+  walk->released = true;
+  if (atomic_load(&walk->jobs) == 0) {
+    sf_find_walk_free(walk);
+  }
+}
+
+/*
+ * Ranks a path of length bytes found for query, lower is better: matches
+ * in the last component first, then shorter paths, then matches closer to
+ * the start. Returns UINT32_MAX if path doesn't contain query. Blocks may
+ * read past the path, up to end.
+ */
+uint32_t sf_finder_score(
+    const char *path,
+    uint32_t length,
+    const char *end,
+    const char *query,
+    uint32_t query_length,
+    bool ignore_case) {
+  uint32_t name_offset = length;
+  while (name_offset > 0 && path[name_offset - 1] != '/') {
+    name_offset--;
+  }
+
+  uint32_t score = 0;
+  int32_t found = sf_find(
+      path + name_offset,
+      length - name_offset,
+      end,
+      query,
+      query_length,
+      ignore_case);
+  if (found == -1) {
+    found = sf_find(path, length, end, query, query_length, ignore_case);
+    if (found == -1) {
+      return UINT32_MAX;
+    }
+    score |= 1u << 31;
+  }
+
+  score |= (length < 0xffff ? length : 0xffff) << 15;
+  score |= found < 0x7fff ? (uint32_t)found : 0x7fff;
+  return score;
+}
+
+/*
+ * Adds the path at index to the ranked matches if it's among the best, after
+ * those that rank the same
+ */
+void sf_finder_rank(sf_finder_t *finder, uint32_t index, uint32_t score) {
+  uint32_t count = finder->ranked_count;
+  if (count == SF_FIND_RANKED_COUNT && score >= finder->scores[count - 1]) {
+    return;
+  }
+
+  uint32_t low = 0, high = count;
+  while (low < high) {
+    uint32_t middle = low + (high - low) / 2;
+    if (finder->scores[middle] <= score) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+
+  // The worst match falls off a full ranking
+  if (count == SF_FIND_RANKED_COUNT) {
+    count--;
+  }
+  memmove(
+      &finder->ranked[low + 1],
+      &finder->ranked[low],
+      (count - low) * sizeof(uint32_t));
+  memmove(
+      &finder->scores[low + 1],
+      &finder->scores[low],
+      (count - low) * sizeof(uint32_t));
+  finder->ranked[low] = index;
+  finder->scores[low] = score;
+  finder->ranked_count = count + 1;
+}
+
+/*
+ * Matches the paths found since the last call against the query. If refine
+ * is set the query was only extended, so the matches of the shorter one are
+ * looked through instead of every path found, and ranked again.
+ */
+void sf_finder_match(sf_finder_t *finder, bool refine) {
+  uint32_t query_length = strlen(finder->query);
+  bool ignore_case = sf_filter_ignores_case(finder->query);
+  // Blocks may read into the paths stored after the one matched
+  const char *end = finder->paths + finder->paths_capacity;
+
+  if (refine) {
+    uint32_t match_count = 0;
+    finder->ranked_count = 0;
+    for (uint32_t i = 0; i < finder->match_count; i++) {
+      uint32_t index = finder->matches[i];
+      const char *path = finder->paths + finder->offsets[index];
+      uint32_t score = sf_finder_score(
+          path, strlen(path), end, finder->query, query_length, ignore_case);
+      if (score != UINT32_MAX) {
+        finder->matches[match_count++] = index;
+        sf_finder_rank(finder, index, score);
+      }
+    }
+    finder->match_count = match_count;
+  }
+
+  for (uint32_t i = finder->matched; i < finder->count; i++) {
+    const char *path = finder->paths + finder->offsets[i];
+    uint32_t score = sf_finder_score(
+        path, strlen(path), end, finder->query, query_length, ignore_case);
+    if (score == UINT32_MAX) {
+      continue;
+    }
+
+    if (finder->match_count == finder->match_capacity) {
+      uint32_t capacity =
+          finder->match_capacity == 0 ? 1024 : finder->match_capacity * 2;
+      uint32_t *matches =
+          realloc(finder->matches, capacity * sizeof(uint32_t));
+      if (matches == NULL) {
+        break;
+      }
+      finder->matches = matches;
+      finder->match_capacity = capacity;
+    }
+    finder->matches[finder->match_count++] = i;
+    sf_finder_rank(finder, i, score);
+  }
+  finder->matched = finder->count;
+
+  if (finder->selected >= finder->ranked_count) {
+    finder->selected = finder->ranked_count > 0 ? finder->ranked_count - 1 : 0;
+  }
+  finder->version++;
+}
+
+/*
+ * Takes the paths the walk found since the last call and matches them
+ */
+void sf_finder_take_results(sf_finder_t *finder) {
+  sf_find_walk_t *walk = finder->walk;
+  if (walk == NULL) {
+    return;
+  }
+
+  // Paths held by the finder are never evicted, so the walk stops once they
+  // don't fit in the memory budget
+  pthread_mutex_lock(&walk->mutex);
+  size_t growth = sf_arena_capacity(
+                      finder->paths_capacity,
+                      finder->paths_size,
+                      walk->found_size) -
+                  finder->paths_capacity;
+  if (finder->paths_size + (uint64_t)walk->found_size > SF_FIND_MAX_BYTES ||
+      sf_memory.sizes[SF_MEMORY_VIEWS] + sf_memory.sizes[SF_MEMORY_SIDE_VIEW] +
+              sf_finder_memory_size(finder) + growth >
+          sf_memory.max_size ||
+      !sf_arena_reserve(
+          &finder->paths,
+          &finder->paths_capacity,
+          finder->paths_size,
+          walk->found_size)) {
+    finder->truncated = true;
+    atomic_store(&walk->cancelled, true);
+    walk->found_size = 0;
+  } else if (walk->found_size > 0) {
+    memcpy(finder->paths + finder->paths_size, walk->found, walk->found_size);
+  }
+  if (atomic_load(&walk->truncated)) {
+    finder->truncated = true;
+  }
+
+  uint32_t at = 0;
+  while (at < walk->found_size) {
+    if (finder->count == finder->capacity) {
+      uint32_t capacity = finder->capacity == 0 ? 1024 : finder->capacity * 2;
+      uint32_t *offsets =
+          realloc(finder->offsets, capacity * sizeof(uint32_t));
+      if (offsets == NULL) {
+        // Paths that can't be matched are dropped, and none are looked for
+        finder->truncated = true;
+        atomic_store(&walk->cancelled, true);
+        break;
+      }
+      finder->offsets = offsets;
+      finder->capacity = capacity;
+    }
+
+    // Paths follow their type
+    uint32_t offset = finder->paths_size + at + 1;
+    finder->offsets[finder->count++] = offset;
+    at += strlen(finder->paths + offset) + 2;
+  }
+  finder->paths_size += at;
+  walk->found_size = 0;
+  pthread_mutex_unlock(&walk->mutex);
+
+  if (finder->matched < finder->count) {
+    sf_finder_match(finder, false);
+  }
+}
+
+/*
+ * Starts finding entries below the directory of view
+ */
+bool sf_finder_start(sf_finder_t *finder, const sf_view_t *view) {
+  int fd =
+      openat(view->dir->dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1) {
+    return false;
+  }
+
+  sf_find_walk_t *walk = calloc(1, sizeof(sf_find_walk_t));
+  if (walk == NULL) {
+    close(fd);
+    return false;
+  }
+  walk->show_hidden_files = sf_show_hidden_files;
+  walk->fd = fd;
+  atomic_init(&walk->cancelled, false);
+  atomic_init(&walk->truncated, false);
+  atomic_init(&walk->jobs, 0);
+  atomic_init(&walk->queued, 0);
+  atomic_init(&walk->published_ms, 0);
+  pthread_mutex_init(&walk->mutex, NULL);
+
+  if (!sf_find_submit(walk, "")) {
+    sf_find_walk_free(walk);
+    return false;
+  }
+
+  sf_finder_stop(finder);
+  finder->active = true;
+  strcpy(finder->root, view->dir->path);
+  finder->walk = walk;
+  finder->version++;
+  sf_main_pane.dirty = true;
+  sf_header_pane.dirty = true;
+  return true;
+}
+
+/*
+ * Cancels the walk and drops everything found, the query is cleared
+ */
+void sf_finder_stop(sf_finder_t *finder) {
+  sf_find_walk_release(finder->walk);
+  free(finder->paths);
+  free(finder->offsets);
+  free(finder->matches);
+
+  uint64_t version = finder->version;
+  memset(finder, 0, sizeof(*finder));
+  finder->version = version + 1;
+
+  sf_main_pane.dirty = true;
+  sf_header_pane.dirty = true;
+}
+
+/*
+ * Appends c to the query, or removes its last character if c is backspace
+ */
+void sf_finder_edit_query(sf_finder_t *finder, int c) {
+  uint32_t length = strlen(finder->query);
+
+  if (c == KEY_BACKSPACE || c == 127 || c == '\b') {
+    if (length == 0) {
+      return;
+    }
+    finder->query[length - 1] = '\0';
+    finder->match_count = 0;
+    finder->ranked_count = 0;
+    finder->matched = 0;
+    finder->selected = 0;
+    sf_finder_match(finder, false);
+  } else if (length + 1 < sizeof(finder->query)) {
+    finder->query[length] = (char)c;
+    finder->query[length + 1] = '\0';
+    finder->selected = 0;
+    sf_finder_match(finder, true);
+  }
+}
+
+/*
+ * Shows the directory of the selected match in view, with the match
+ * selected
+ */
+bool sf_finder_open_selected(sf_finder_t *finder, sf_view_t *view) {
+  if (finder->selected >= finder->ranked_count) {
+    return false;
+  }
+
+  char path[PATH_MAX], dir_path[PATH_MAX], name[NAME_MAX + 1];
+  if (!sf_path_join(
+          finder->root,
+          finder->paths + finder->offsets[finder->ranked[finder->selected]],
+          path)) {
+    return false;
+  }
+  sf_get_parent_path(path, dir_path);
+  sf_get_top_dir_from_path(path, name);
+
+  // Links aren't followed, so the path found is a real path
+  return sf_view_set_path(view, AT_FDCWD, dir_path, dir_path, name);
+}
+
+/*
+ * File preview functions
+ */
+
+/*
+ * Finds the end of each line in the length bytes at data, 16 bytes at a
+ * time. Returns false as soon as a NUL byte shows the data is binary.
+ * line_ends needs room for length + 1 offsets.
+ */
+bool sf_preview_split(
+    const char *data, uint32_t length, uint32_t *line_ends, uint32_t *count) {
+  uint32_t n = 0;
+  uint32_t i = 0;
+
+#if defined(__SSE2__)
+  __m128i zero = _mm_setzero_si128();
+  __m128i newline = _mm_set1_epi8('\n');
+
+  for (; length - i >= 16; i += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i *)(data + i));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(block, zero)) != 0) {
+      return false;
+    }
+    uint32_t mask =
+        (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(block, newline));
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  uint8x16_t newline = vdupq_n_u8('\n');
+  const uint8x16_t bits = {
+      1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+
+  for (; length - i >= 16; i += 16) {
+    uint8x16_t block = vld1q_u8((const uint8_t *)(data + i));
+    if (vminvq_u8(block) == 0) {
+      return false;
+    }
+    uint8x16_t newlines = vandq_u8(vceqq_u8(block, newline), bits);
+    uint32_t mask = vaddv_u8(vget_low_u8(newlines)) |
+                    ((uint32_t)vaddv_u8(vget_high_u8(newlines)) << 8);
+#endif
+#if defined(__SSE2__) || (defined(__ARM_NEON) && defined(__aarch64__))
+    while (mask != 0) {
+      line_ends[n++] = i + __builtin_ctz(mask);
+      mask &= mask - 1;
+    }
+  }
+#endif
+
+  // What's left of the last block
+  for (; i < length; i++) {
+    if (data[i] == '\0') {
+      return false;
+    } else if (data[i] == '\n') {
+      line_ends[n++] = i;
+    }
+  }
+
+  // The last line may be unterminated, or cut at the end of the window
+  if (length > 0 && (n == 0 || line_ends[n - 1] + 1 < length)) {
+    line_ends[n++] = length;
+  }
+
+  *count = n;
+  return true;
+}
+
+/*
+ * Turns the first length bytes of the file st describes into a preview with
+ * a single reference. Tabs are expanded, a CR ending a line is dropped and
+ * other control characters are shown as '?'.
+ */
+sf_preview_t *sf_preview_render(
+    const struct stat *st, const char *data, uint32_t length) {
+  sf_preview_t *preview = calloc(1, sizeof(sf_preview_t));
+  uint32_t *line_ends = malloc(sizeof(uint32_t) * (length + 1));
+  if (preview == NULL || line_ends == NULL) {
+    free(preview);
+    free(line_ends);
+    return NULL;
+  }
+
+  preview->dev = st->st_dev;
+  preview->ino = st->st_ino;
+  preview->mtime = st->st_mtim;
+  preview->size = st->st_size;
+  atomic_init(&preview->refs, 1);
+
+  uint32_t count = 0;
+  preview->binary = !sf_preview_split(data, length, line_ends, &count);
+  if (preview->binary || count == 0) {
+    free(line_ends);
+    return preview;
+  }
+
+  // A byte takes at most a tab's worth of columns
+  preview->text_capacity = length * SF_PREVIEW_TAB_WIDTH + count;
+  preview->text = malloc(preview->text_capacity);
+  preview->lines = malloc(sizeof(uint32_t) * count);
+  if (preview->text == NULL || preview->lines == NULL) {
+    free(line_ends);
+    sf_preview_release(preview);
+    return NULL;
+  }
+
+  uint32_t size = 0;
+  uint32_t start = 0;
+  for (uint32_t line = 0; line < count; line++) {
+    preview->lines[line] = size;
+
+    uint32_t columns = 0;
+    for (uint32_t i = start;
+         i < line_ends[line] && columns < SF_PREVIEW_MAX_COLUMNS;
+         i++) {
+      unsigned char c = (unsigned char)data[i];
+      if (c == '\t') {
+        do {
+          preview->text[size++] = ' ';
+          columns++;
+        } while (columns % SF_PREVIEW_TAB_WIDTH != 0 &&
+                 columns < SF_PREVIEW_MAX_COLUMNS);
+      } else if (c != '\r' || i + 1 != line_ends[line]) {
+        preview->text[size++] = c < 0x20 || c == 0x7f ? '?' : (char)c;
+        columns++;
+      }
+    }
+
+    preview->text[size++] = '\0';
+    start = line_ends[line] + 1;
+  }
+  preview->line_count = count;
+
+  // Previews are cached, so they give back what tabs didn't take
+  char *text = realloc(preview->text, size);
+  if (text != NULL) {
+    preview->text = text;
+    preview->text_capacity = size;
+  }
+
+  free(line_ends);
+  return preview;
+}
+
+/*
+ * Returns a new reference to the cached preview of the file st describes,
+ * or NULL if it changed since or was never read
+ */
+sf_preview_t *sf_preview_cache_find(const struct stat *st) {
+  sf_preview_t *found = NULL;
+
+  pthread_mutex_lock(&sf_preview_cache_mutex);
+  for (uint32_t i = 0; i < SF_PREVIEW_CACHE_SIZE; i++) {
+    sf_preview_t *preview = sf_preview_cache[i];
+    if (preview != NULL && preview->dev == st->st_dev &&
+        preview->ino == st->st_ino && preview->size == st->st_size &&
+        preview->mtime.tv_sec == st->st_mtim.tv_sec &&
+        preview->mtime.tv_nsec == st->st_mtim.tv_nsec) {
+      atomic_fetch_add(&preview->refs, 1);
+      preview->used_ms = sf_now_ms();
+      found = preview;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&sf_preview_cache_mutex);
+
+  return found;
+}
+
+/*
+ * Adds preview to the cache in an empty slot, or in place of the least
+ * recently used preview
+ */
+void sf_preview_cache_insert(sf_preview_t *preview) {
+  atomic_fetch_add(&preview->refs, 1);
+
+  pthread_mutex_lock(&sf_preview_cache_mutex);
+  uint32_t slot = 0;
+  for (uint32_t i = 0; i < SF_PREVIEW_CACHE_SIZE; i++) {
+    if (sf_preview_cache[i] == NULL) {
+      slot = i;
+      break;
+    }
+    if (sf_preview_cache[i]->used_ms < sf_preview_cache[slot]->used_ms) {
+      slot = i;
+    }
+  }
+  sf_preview_t *evicted = sf_preview_cache[slot];
+  sf_preview_cache[slot] = preview;
+  preview->used_ms = sf_now_ms();
+  pthread_mutex_unlock(&sf_preview_cache_mutex);
+
+  sf_preview_release(evicted);
+}
+
+void sf_preview_release(sf_preview_t *preview) {
+  if (preview == NULL || atomic_fetch_sub(&preview->refs, 1) > 1) {
+    return;
+  }
+
+  free(preview->text);
+  free(preview->lines);
+  free(preview);
+}
+
+void sf_preview_job_run(sf_job_t *job) {
+  sf_preview_job_t *read = (sf_preview_job_t *)job;
+  SF_TRACE_BEGIN(trace_start);
+
+  // Opening a FIFO would otherwise wait for a writer
+  int fd = openat(
+      read->dirfd, read->name, O_RDONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+  if (fd == -1) {
+    return;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    close(fd);
+    return;
+  }
+
+  read->preview = sf_preview_cache_find(&st);
+  if (read->preview == NULL) {
+    // Reading a copy rather than mapping the file, a file truncated in the
+    // meantime can't fault
+    char *data = malloc(SF_PREVIEW_MAX_BYTES);
+    uint32_t length = 0;
+    while (data != NULL && length < SF_PREVIEW_MAX_BYTES) {
+      ssize_t n =
+          pread(fd, data + length, SF_PREVIEW_MAX_BYTES - length, length);
+      if (n <= 0) {
+        break;
+      }
+      length += (uint32_t)n;
+    }
+
+    if (data != NULL) {
+      read->preview = sf_preview_render(&st, data, length);
+      if (read->preview != NULL) {
+        sf_preview_cache_insert(read->preview);
+      }
+    }
+    free(data);
+  }
+  close(fd);
+
+  SF_TRACE_END(
+      trace_start,
+      SF_TRACE_IO,
+      "preview",
+      read->name,
+      read->preview != NULL ? read->preview->line_count : 0);
+}
+
+void sf_preview_job_complete(sf_job_t *job) {
+  sf_preview_job_t *read = (sf_preview_job_t *)job;
+
+  if (sf_side_view.preview_pending == read) {
+    sf_side_view.preview_pending = NULL;
+    sf_side_view.preview = read->preview;
+    read->preview = NULL;
+    sf_side_view.generation++;
+  }
+
+  sf_preview_release(read->preview);
+  close(read->dirfd);
+  free(read);
+}
+
+/*
+ * File operation functions
+ */
+
+/*
+ * Wakes up the main loop to draw the progress of op and patch listings with
+ * the entries done, at most every SF_SCAN_PROGRESS_INTERVAL_MS
+ */
+void sf_op_publish(sf_op_t *op) {
+  int64_t now = sf_now_ms();
+  int_fast64_t published = atomic_load(&op->published_ms);
+  if (now - published < SF_SCAN_PROGRESS_INTERVAL_MS ||
+      !atomic_compare_exchange_strong(&op->published_ms, &published, now)) {
+    return;
+  }
+
+  sf_notify(sf_op_pool.notify_fds[1]);
+}
+
+/*
+ * Records errno as the error of op unless one was hit already
+ */
+void sf_op_fail(sf_op_t *op) {
+  if (op->error == 0) {
+    op->error = errno;
+  }
+}
+
+/*
+ * Copies the contents of src_fd to dest_fd. Copies are cloned on
+ * filesystems sharing extents, and otherwise copied by the kernel where it
+ * can, without passing through sf.
+ */
+bool sf_op_copy_data(sf_op_t *op, int src_fd, int dest_fd) {
+  char *buffer = NULL;
+  bool offload = true;
+
+#ifdef __linux__
+  struct stat st;
+  if (ioctl(dest_fd, FICLONE, src_fd) == 0 && fstat(src_fd, &st) == 0) {
+    atomic_fetch_add(&op->bytes_done, (uint64_t)st.st_size);
+    return true;
+  }
+#else
+  offload = false;
+#endif
+
+  for (;;) {
+    if (atomic_load(&op->job.cancelled)) {
+      free(buffer);
+      errno = ECANCELED;
+      return false;
+    }
+
+    ssize_t n;
+#ifdef __linux__
+    if (offload) {
+      n = copy_file_range(src_fd, NULL, dest_fd, NULL, SF_OP_CHUNK_SIZE, 0);
+      if (n == -1 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+                      errno == EOPNOTSUPP)) {
+        // Both offsets moved by what was copied, reads carry on from there
+        offload = false;
+        continue;
+      }
+    } else
+#endif
+    {
+      if (buffer == NULL && (buffer = malloc(SF_OP_BUFFER_SIZE)) == NULL) {
+        return false;
+      }
+
+      n = read(src_fd, buffer, SF_OP_BUFFER_SIZE);
+      for (ssize_t written = 0; n > 0 && written < n;) {
+        ssize_t w = write(dest_fd, buffer + written, n - written);
+        if (w == -1 && errno != EINTR) {
+          free(buffer);
+          return false;
+        }
+        written += w > 0 ? w : 0;
+      }
+    }
+
+    if (n == -1 && errno == EINTR) {
+      continue;
+    } else if (n <= 0) {
+      free(buffer);
+      return n == 0;
+    }
+
+    atomic_fetch_add(&op->bytes_done, (uint64_t)n);
+    sf_op_publish(op);
+  }
+}
+
+/*
+ * Copies the entry name of src_dirfd, and everything below it if it's a
+ * directory, to the same name in dest_dirfd. Nothing is overwritten.
+ */
+bool sf_op_copy_entry(
+    sf_op_t *op, int src_dirfd, const char *name, int dest_dirfd) {
+  struct stat st;
+  if (fstatat(src_dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+    sf_op_fail(op);
+    return false;
+  }
+
+  if (S_ISREG(st.st_mode)) {
+    int src_fd = openat(src_dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (src_fd == -1) {
+      sf_op_fail(op);
+      return false;
+    }
+
+    int dest_fd = openat(
+        dest_dirfd,
+        name,
+        O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+        st.st_mode & 07777);
+    if (dest_fd == -1) {
+      sf_op_fail(op);
+      close(src_fd);
+      return false;
+    }
+
+    bool copied = sf_op_copy_data(op, src_fd, dest_fd);
+    if (!copied) {
+      sf_op_fail(op);
+      unlinkat(dest_dirfd, name, 0);
+    }
+    close(src_fd);
+    close(dest_fd);
+    return copied;
+  } else if (S_ISLNK(st.st_mode)) {
+    char target[PATH_MAX];
+    ssize_t length = readlinkat(src_dirfd, name, target, sizeof(target) - 1);
+    if (length == -1) {
+      sf_op_fail(op);
+      return false;
+    }
+    target[length] = '\0';
+
+    if (symlinkat(target, dest_dirfd, name) != 0) {
+      sf_op_fail(op);
+      return false;
+    }
+    return true;
+  } else if (!S_ISDIR(st.st_mode)) {
+    if (mknodat(dest_dirfd, name, st.st_mode, st.st_rdev) != 0) {
+      sf_op_fail(op);
+      return false;
+    }
+    return true;
+  }
+
+  // A directory being copied into itself would be copied forever
+  if (st.st_dev == op->dest_dev && st.st_ino == op->dest_ino) {
+    errno = EINVAL;
+    sf_op_fail(op);
+    return false;
+  }
+
+  int src_fd =
+      openat(src_dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  DIR *dir = src_fd != -1 ? fdopendir(src_fd) : NULL;
+  if (dir == NULL) {
+    sf_op_fail(op);
+    if (src_fd != -1) {
+      close(src_fd);
+    }
+    return false;
+  }
+
+  // Writable until everything below was copied
+  int dest_fd = -1;
+  if (mkdirat(dest_dirfd, name, 0700) == 0) {
+    dest_fd = openat(
+        dest_dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  }
+  if (dest_fd == -1) {
+    sf_op_fail(op);
+    closedir(dir);
+    return false;
+  }
+
+  bool copied = true;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL && !atomic_load(&op->job.cancelled)) {
+    if (IS_VALID_ENTRY(entry->d_name)) {
+      copied &= sf_op_copy_entry(op, dirfd(dir), entry->d_name, dest_fd);
+    }
+  }
+
+  if (atomic_load(&op->job.cancelled)) {
+    errno = ECANCELED;
+    sf_op_fail(op);
+    copied = false;
+  }
+
+  fchmod(dest_fd, st.st_mode & 07777);
+  close(dest_fd);
+  closedir(dir);
+  return copied;
+}
+
+/*
+ * Deletes the entry name of parent_fd, and everything below it if it's a
+ * directory
+ */
+bool sf_op_delete_entry(sf_op_t *op, int parent_fd, const char *name) {
+  struct stat st;
+  if (fstatat(parent_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+    sf_op_fail(op);
+    return false;
+  }
+
+  if (!S_ISDIR(st.st_mode)) {
+    if (unlinkat(parent_fd, name, 0) != 0) {
+      sf_op_fail(op);
+      return false;
+    }
+    // Moves already counted what they copied
+    if (op->kind == SF_OP_DELETE) {
+      atomic_fetch_add(&op->bytes_done, (uint64_t)st.st_size);
+    }
+    return true;
+  }
+
+  int fd =
+      openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  DIR *dir = fd != -1 ? fdopendir(fd) : NULL;
+  if (dir == NULL) {
+    sf_op_fail(op);
+    if (fd != -1) {
+      close(fd);
+    }
+    return false;
+  }
+
+  bool deleted = true;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL && !atomic_load(&op->job.cancelled)) {
+    if (IS_VALID_ENTRY(entry->d_name)) {
+      deleted &= sf_op_delete_entry(op, dirfd(dir), entry->d_name);
+    }
+  }
+  closedir(dir);
+
+  if (!deleted || unlinkat(parent_fd, name, AT_REMOVEDIR) != 0) {
+    sf_op_fail(op);
+    return false;
+  }
+  sf_op_publish(op);
+  return true;
+}
+
+/*
+ * Moves the entry name of src_dirfd to dest_dirfd, renaming it within a
+ * filesystem and copying it across them. Nothing is overwritten.
+ */
+bool sf_op_move_entry(
+    sf_op_t *op, int src_dirfd, const char *name, int dest_dirfd) {
+#ifdef __linux__
+  if (renameat2(src_dirfd, name, dest_dirfd, name, RENAME_NOREPLACE) == 0) {
+    return true;
+  }
+#else
+  struct stat st;
+  if (fstatat(dest_dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+    errno = EEXIST;
+  } else if (renameat(src_dirfd, name, dest_dirfd, name) == 0) {
+    return true;
+  }
+#endif
+
+  if (errno != EXDEV) {
+    sf_op_fail(op);
+    return false;
+  }
+
+  return sf_op_copy_entry(op, src_dirfd, name, dest_dirfd) &&
+         sf_op_delete_entry(op, src_dirfd, name);
+}
+
+void sf_op_run(sf_job_t *job) {
+  sf_op_t *op = (sf_op_t *)job;
+  SF_TRACE_BEGIN(trace_start);
+
+  for (uint32_t i = 0; i < op->names.count && !atomic_load(&job->cancelled);
+       i++) {
+    const char *name = sf_listing_name(&op->names, i);
+
+    bool done = false;
+    switch (op->kind) {
+    case SF_OP_COPY:
+      done = sf_op_copy_entry(op, op->src_fd, name, op->dest_fd);
+      break;
+    case SF_OP_MOVE:
+      done = sf_op_move_entry(op, op->src_fd, name, op->dest_fd);
+      break;
+    case SF_OP_DELETE:
+      done = sf_op_delete_entry(op, op->src_fd, name);
+      break;
+    }
+
+    if (done) {
+      pthread_mutex_lock(&op->mutex);
+      sf_listing_push(&op->done, name, DT_UNKNOWN);
+      pthread_mutex_unlock(&op->mutex);
+    } else {
+      op->failed++;
+    }
+
+    atomic_fetch_add(&op->entries_done, 1);
+    sf_op_publish(op);
+  }
+
+  SF_TRACE_END(
+      trace_start,
+      SF_TRACE_IO,
+      op->kind == SF_OP_COPY   ? "copy"
+      : op->kind == SF_OP_MOVE ? "move"
+                               : "delete",
+      op->src_path,
+      op->names.count);
+}
+
+/*
+ * Patches the open directories op changed with the entries it finished
+ * since the last call. The watches report the same changes again later,
+ * which leaves listings as they are.
+ */
+void sf_op_take_progress(sf_op_t *op) {
+  sf_listing_t done = {0};
+  pthread_mutex_lock(&op->mutex);
+  sf_listing_move(&done, &op->done);
+  pthread_mutex_unlock(&op->mutex);
+
+  // Directories still being read see the changes themselves
+  sf_dir_t *src = op->kind != SF_OP_COPY ? sf_dir_find(op->src_path) : NULL;
+  if (src != NULL && src->pending == NULL && done.count > 0) {
+    for (uint32_t i = 0; i < done.count; i++) {
+      sf_dir_handle_event(src, IN_DELETE, sf_listing_name(&done, i));
+    }
+    sf_dir_touch(src);
+  }
+
+  sf_dir_t *dest =
+      op->kind != SF_OP_DELETE ? sf_dir_find(op->dest_path) : NULL;
+  if (dest != NULL && dest->pending == NULL && done.count > 0) {
+    for (uint32_t i = 0; i < done.count; i++) {
+      sf_dir_handle_event(dest, IN_CREATE, sf_listing_name(&done, i));
+    }
+    sf_dir_touch(dest);
+  }
+
+  sf_listing_destroy(&done);
+  sf_header_pane.dirty = true;
+}
+
+void sf_op_complete(sf_job_t *job) {
+  sf_op_t *op = (sf_op_t *)job;
+
+  sf_op_take_progress(op);
+
+  for (sf_op_t **link = &sf_ops; *link != NULL; link = &(*link)->next) {
+    if (*link == op) {
+      *link = op->next;
+      break;
+    }
+  }
+
+  uint32_t skipped = op->names.count - atomic_load(&op->entries_done);
+  if (op->failed > 0 || skipped > 0) {
+    snprintf(
+        sf_op_message,
+        sizeof(sf_op_message),
+        "%s: %u of %u failed, %s",
+        op->kind == SF_OP_COPY   ? "copy"
+        : op->kind == SF_OP_MOVE ? "move"
+                                 : "delete",
+        op->failed + skipped,
+        op->names.count,
+        strerror(op->error != 0 ? op->error : ECANCELED));
+  }
+
+  close(op->src_fd);
+  if (op->dest_fd != -1) {
+    close(op->dest_fd);
+  }
+  sf_listing_destroy(&op->names);
+  sf_listing_destroy(&op->done);
+  pthread_mutex_destroy(&op->mutex);
+  free(op);
+}
+
+/*
+ * Starts copying, moving or deleting names, entries of the directory src,
+ * in the background. Copies and moves go to the directory dest.
+ */
+bool sf_op_start(
+    sf_op_kind_t kind,
+    const sf_dir_t *src,
+    const sf_listing_t *names,
+    const sf_dir_t *dest) {
+  if (names->count == 0 || src->dirfd == -1 ||
+      (kind != SF_OP_DELETE && dest->dirfd == -1)) {
+    return false;
+  }
+
+  sf_op_t *op = calloc(1, sizeof(sf_op_t));
+  if (op == NULL) {
+    return false;
+  }
+
+  op->kind = kind;
+  op->src_fd = fcntl(src->dirfd, F_DUPFD_CLOEXEC, 0);
+  op->dest_fd = -1;
+  strcpy(op->src_path, src->path);
+
+  struct stat st;
+  if (kind != SF_OP_DELETE) {
+    strcpy(op->dest_path, dest->path);
+    op->dest_fd = fcntl(dest->dirfd, F_DUPFD_CLOEXEC, 0);
+    if (op->dest_fd != -1 && fstat(op->dest_fd, &st) == 0) {
+      op->dest_dev = st.st_dev;
+      op->dest_ino = st.st_ino;
+    }
+  }
+
+  if (op->src_fd == -1 || (kind != SF_OP_DELETE && op->dest_fd == -1) ||
+      !sf_listing_copy(&op->names, names)) {
+    if (op->src_fd != -1) {
+      close(op->src_fd);
+    }
+    if (op->dest_fd != -1) {
+      close(op->dest_fd);
+    }
+    free(op);
+    return false;
+  }
+
+  op->job.run = sf_op_run;
+  op->job.complete = sf_op_complete;
+  atomic_init(&op->entries_done, 0);
+  atomic_init(&op->bytes_done, 0);
+  atomic_init(&op->published_ms, 0);
+  op->started_ms = sf_now_ms();
+  pthread_mutex_init(&op->mutex, NULL);
+
+  op->next = sf_ops;
+  sf_ops = op;
+  sf_op_message[0] = '\0';
+  sf_header_pane.dirty = true;
+
+  sf_pool_submit(&sf_op_pool, &op->job);
+  return true;
+}
+
+/*
+ * Side view functions
+ */
+void sf_side_view_scan_run(sf_job_t *job) {
+  sf_scan_job_t *scan = (sf_scan_job_t *)job;
+
+  scan->fd =
+      openat(scan->dirfd, scan->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (scan->fd == -1) {
+    scan->success = false;
+    return;
+  }
+
+  scan->watch = sf_watch_open(scan->fd);
+  scan->success = sf_get_entries(
+      scan->fd,
+      ".",
+      scan->path,
+      &job->cancelled,
+      NULL,
+      &scan->listing);
+}
+
+void sf_side_view_scan_complete(sf_job_t *job) {
+  sf_scan_job_t *scan = (sf_scan_job_t *)job;
+
+  if (sf_side_view.pending == scan) {
+    sf_side_view.pending = NULL;
+
+    if (scan->success) {
+      // A view may have opened the directory in the meantime
+      sf_dir_t *dir = sf_dir_find(scan->path);
+      if (dir != NULL) {
+        dir->refs++;
+      } else {
+        dir = sf_dir_create(scan->path, scan->fd, scan->watch);
+        scan->fd = scan->watch = -1;
+        if (dir != NULL) {
+          sf_listing_move(&dir->listing, &scan->listing);
+          // Changes made while it was read
+          sf_dir_apply_events(dir);
+        }
+      }
+      sf_side_view.dir = dir;
+    }
+
+    sf_side_view.generation++;
+  }
+
+  sf_listing_destroy(&scan->listing);
+  sf_watch_close(&scan->watch);
+  if (scan->fd != -1) {
+    close(scan->fd);
+  }
+  close(scan->dirfd);
+  free(scan);
+}
+
+/*
+ * Clears the side view and cancels any scan in flight
+ */
+void sf_side_view_clear(sf_side_view_t *side_view) {
+  if (side_view->pending != NULL) {
+    atomic_store(&side_view->pending->job.cancelled, true);
+    side_view->pending = NULL;
+  }
+
+  sf_dir_release(side_view->dir);
+  side_view->dir = NULL;
+  sf_du_release(side_view->du);
+  side_view->du = NULL;
+
+  if (side_view->preview_pending != NULL) {
+    atomic_store(&side_view->preview_pending->job.cancelled, true);
+    side_view->preview_pending = NULL;
+  }
+  sf_preview_release(side_view->preview);
+  side_view->preview = NULL;
+
+  side_view->generation++;
+  side_view->target[0] = '\0';
+}
+
+/*
+ * Shows the directory name in view. Directories that are open already are
+ * shown right away, others show a loading placeholder until they're read in
+ * the background.
+ */
+void sf_side_view_set_path(
+    sf_side_view_t *side_view, sf_view_t *view, const char *name) {
+  sf_side_view_clear(side_view);
+
+  char path[PATH_MAX];
+  if (!sf_path_join(view->dir->path, name, path)) {
+    return;
+  }
+  strcpy(side_view->target, path);
+  side_view->du = sf_du_start(view->dir->dirfd, name);
+
+  side_view->dir = sf_dir_find(path);
+  if (side_view->dir != NULL) {
+    side_view->dir->refs++;
+    return;
+  }
+
+  sf_scan_job_t *scan = calloc(1, sizeof(sf_scan_job_t));
+  if (scan == NULL) {
+    return;
+  }
+
+  // The view may move on and close its fd while the scan runs
+  scan->dirfd = fcntl(view->dir->dirfd, F_DUPFD_CLOEXEC, 0);
+  if (scan->dirfd == -1) {
+    free(scan);
+    return;
+  }
+
+  scan->job.run = sf_side_view_scan_run;
+  scan->job.complete = sf_side_view_scan_complete;
+  scan->fd = scan->watch = -1;
+  strncpy(scan->name, name, sizeof(scan->name) - 1);
+  strcpy(scan->path, path);
+
+  side_view->pending = scan;
+  sf_pool_submit(&sf_pool, &scan->job);
+}
+
+/*
+ * Previews the file name in view. At most SF_PREVIEW_MAX_BYTES of it are
+ * read in the background, unless a preview of it is cached.
+ */
+void sf_side_view_set_file(
+    sf_side_view_t *side_view, sf_view_t *view, const char *name) {
+  sf_side_view_clear(side_view);
+
+  if (!sf_path_join(view->dir->path, name, side_view->target)) {
+    side_view->target[0] = '\0';
+    return;
+  }
+
+  sf_preview_job_t *read = calloc(1, sizeof(sf_preview_job_t));
+  if (read == NULL) {
+    return;
+  }
+
+  read->dirfd = fcntl(view->dir->dirfd, F_DUPFD_CLOEXEC, 0);
+  if (read->dirfd == -1) {
+    free(read);
+    return;
+  }
+
+  read->job.run = sf_preview_job_run;
+  read->job.complete = sf_preview_job_complete;
+  strncpy(read->name, name, sizeof(read->name) - 1);
+
+  side_view->preview_pending = read;
+  sf_pool_submit(&sf_pool, &read->job);
+}
+
+void sf_side_view_init(sf_side_view_t *side_view) {
+  side_view->dir = NULL;
+  side_view->generation = 0;
+  side_view->du = NULL;
+  side_view->pending = NULL;
+  side_view->preview = NULL;
+  side_view->preview_pending = NULL;
+  side_view->outdated = true;
+  side_view->target[0] = '\0';
+}
+
+void sf_side_view_destroy(sf_side_view_t *side_view) {
+  sf_side_view_clear(side_view);
+}
+
+void sf_side_view_invalidate(sf_side_view_t *side_view) {
+  side_view->outdated = true;
+}
+
+/*
+ * Changes whenever what the side view shows may have
+ */
+uint64_t sf_side_view_version(const sf_side_view_t *side_view) {
+  uint32_t dir_generation =
+      side_view->dir != NULL ? side_view->dir->generation : 0;
+  return ((uint64_t)side_view->generation << 32) | dir_generation;
+}
+
+/*
+ * Points the side view at the selection of view if it may have changed
+ */
+void sf_side_view_sync(sf_side_view_t *side_view, sf_view_t *view) {
+  if (!side_view->outdated) {
+    return;
+  }
+  side_view->outdated = false;
+  SF_TRACE_BEGIN(trace_start);
+
+  sf_listing_t *listing = &view->dir->listing;
+
+  // Nothing is selected if everything is filtered out
+  if (sf_view_row_count(view) == 0) {
+    sf_side_view_clear(side_view);
+  } else if (sf_listing_type(listing, view->selected_entry) ==
+      SF_ENTRY_DIRECTORY) {
+    // Show directory in side pane, unless it's already shown or loading
+    const char *name = sf_listing_name(listing, view->selected_entry);
+    char path[PATH_MAX];
+    if (!sf_path_join(view->dir->path, name, path)) {
+      // Entries whose path is too long can't be opened to show
+      sf_side_view_clear(side_view);
+    } else if (strcmp(path, side_view->target) != 0) {
+      sf_side_view_set_path(side_view, view, name);
+    }
+  } else if (
+      sf_listing_type(listing, view->selected_entry) == SF_ENTRY_FILE ||
+      sf_listing_type(listing, view->selected_entry) == SF_ENTRY_LINK) {
+    // Links are resolved when read, only links to files are previewed
+    const char *name = sf_listing_name(listing, view->selected_entry);
+    char path[PATH_MAX];
+    if (!sf_path_join(view->dir->path, name, path)) {
+      // Entries whose path is too long can't be opened to show
+      sf_side_view_clear(side_view);
+    } else if (strcmp(path, side_view->target) != 0) {
+      sf_side_view_set_file(side_view, view, name);
+    }
+  } else if (side_view->target[0] != '\0' || side_view->pending != NULL) {
+    sf_side_view_clear(side_view);
+  }
+
+  SF_TRACE_END(
+      trace_start,
+      SF_TRACE_SIDE_VIEW,
+      "side view update",
+      side_view->target,
+      side_view->dir != NULL ? side_view->dir->listing.count : 0);
+}
+
+void sf_side_view_sync_metadata(sf_side_view_t *side_view) {
+  if (side_view->dir != NULL) {
+    sf_dir_sync_metadata(side_view->dir);
+  }
+}
+
+/*
+ * View functions
+ */
+
+/*
+ * Changes whenever what the view shows may have: what it selects or
+ * filters, or the listing of its directory
+ */
+uint64_t sf_view_version(const sf_view_t *view) {
+  return ((uint64_t)view->generation << 32) | view->dir->generation;
+}
+
+bool sf_view_hides_entries(const sf_view_t *view) {
+  return !sf_show_hidden_files && view->dir->listing.hidden_count > 0;
+}
+
+/*
+ * Whether rows index the matches rather than every position. Listings hold
+ * hidden entries too, so hiding them is a filter that never reads names.
+ */
+bool sf_view_filtered(const sf_view_t *view) {
+  return view->filter[0] != '\0' || sf_view_hides_entries(view);
+}
+
+/*
+ * Number of entries shown, rows index the matches if the view is filtered
+ */
+uint32_t sf_view_row_count(const sf_view_t *view) {
+  return sf_view_filtered(view) ? view->match_count : view->dir->listing.count;
+}
+
+/*
+ * Listing position of the entry shown at row
+ */
+uint32_t sf_view_row_position(const sf_view_t *view, uint32_t row) {
+  return sf_view_filtered(view) ? view->matches[row] : row;
+}
+
+/*
+ * Row of the selected entry, or of the closest match after it if it's
+ * filtered out
+ */
+uint32_t sf_view_selected_row(const sf_view_t *view) {
+  if (!sf_view_filtered(view)) {
+    return view->selected_entry;
+  }
+
+  uint32_t low = 0;
+  uint32_t high = view->match_count;
+  while (low < high) {
+    uint32_t middle = low + (high - low) / 2;
+    if (view->matches[middle] < view->selected_entry) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+
+  if (low == view->match_count && low > 0) {
+    low--;
+  }
+  return low;
+}
+
+/*
+ * Moves the selection onto a match once the matches changed
+ */
+void sf_view_filter_settle(sf_view_t *view) {
+  if (view->match_count > 0) {
+    view->selected_entry = view->matches[sf_view_selected_row(view)];
+  }
+
+  view->generation++;
+  view->filter_version = sf_view_version(view);
+  if (view == &sf_views[sf_current_view]) {
+    sf_side_view_invalidate(&sf_side_view);
+  }
+}
+
+/*
+ * Matches the filter against every shown entry, or only against the current
+ * matches if refine is set: anything matching an extended filter matched
+ * the shorter one. Names are matched in the order they're stored so the
+ * arena is read front to back, then the matches are collected in display
+ * order.
+ */
+void sf_view_filter_match(sf_view_t *view, bool refine) {
+  sf_listing_t *listing = &view->dir->listing;
+
+  if (listing->count > view->match_capacity) {
+    uint32_t *matches =
+        realloc(view->matches, listing->count * sizeof(uint32_t));
+    if (matches == NULL) {
+      view->match_count = 0;
+      sf_view_filter_settle(view);
+      return;
+    }
+    view->matches = matches;
+    view->match_capacity = listing->count;
+  }
+
+  uint8_t *matched = calloc(listing->entry_count, 1);
+  if (matched == NULL) {
+    view->match_count = 0;
+    sf_view_filter_settle(view);
+    return;
+  }
+
+  if (refine) {
+    for (uint32_t i = 0; i < view->match_count; i++) {
+      matched[listing->order[view->matches[i]]] = true;
+    }
+  } else if (sf_view_hides_entries(view)) {
+    for (uint32_t i = 0; i < listing->entry_count; i++) {
+      matched[i] = !listing->entries[i].hidden;
+    }
+  } else {
+    memset(matched, true, listing->entry_count);
+  }
+
+  uint32_t filter_length = strlen(view->filter);
+  bool ignore_case = sf_filter_ignores_case(view->filter);
+  for (uint32_t i = 0; filter_length > 0 && i < listing->entry_count; i++) {
+    if (matched[i]) {
+      matched[i] = sf_listing_matches(
+          listing, i, view->filter, filter_length, ignore_case);
+    }
+  }
+
+  view->match_count = 0;
+  for (uint32_t i = 0; i < listing->count; i++) {
+    if (matched[listing->order[i]]) {
+      view->matches[view->match_count++] = i;
+    }
+  }
+
+  free(matched);
+  sf_view_filter_settle(view);
+}
+
+/*
+ * Rematches the filter if the listing changed since it was last matched
+ */
+void sf_view_sync_filter(sf_view_t *view) {
+  if (sf_view_filtered(view) &&
+      view->filter_version != sf_view_version(view)) {
+    sf_view_filter_match(view, false);
+  }
+}
+
+/*
+ * Appends c to the filter, or removes its last character if c is
+ * backspace
+ */
+void sf_view_edit_filter(sf_view_t *view, int c) {
+  uint32_t length = strlen(view->filter);
+  bool current = sf_view_filtered(view) &&
+                 view->filter_version == sf_view_version(view);
+
+  if (c == KEY_BACKSPACE || c == 127 || c == '\b') {
+    if (length == 0) {
+      return;
+    }
+    view->filter[length - 1] = '\0';
+    if (sf_view_filtered(view)) {
+      sf_view_filter_match(view, false);
+    } else {
+      view->match_count = 0;
+      view->generation++;
+    }
+  } else if (length + 1 < sizeof(view->filter)) {
+    view->filter[length] = (char)c;
+    view->filter[length + 1] = '\0';
+    sf_view_filter_match(view, current);
+  }
+}
+
+/*
+ * Shows every entry again, the selection stays where it is
+ */
+void sf_view_clear_filter(sf_view_t *view) {
+  view->filter[0] = '\0';
+  view->filter_input = false;
+  view->match_count = 0;
+  view->generation++;
+}
+
+void sf_view_set_selected_entry(sf_view_t *view, uint32_t entry_index) {
+  sf_listing_t *listing = &view->dir->listing;
+  view->selected_entry = entry_index;
+
+  if (entry_index >= listing->count) {
+    entry_index = listing->count - 1;
+  }
+
+  if (entry_index < 0) {
+    entry_index = 0;
+  }
+
+  // While the directory is being read, the entry picked is kept selected
+  // once the listing is sorted
+  view->select[0] = '\0';
+  if (view->dir->pending != NULL && view->selected_entry < listing->count) {
+    strncpy(
+        view->select,
+        sf_listing_name(listing, view->selected_entry),
+        sizeof(view->select) - 1);
+  }
+
+  sf_side_view_invalidate(&sf_side_view);
+}
+
+/*
+ * Selects the entry called name, if there's one
+ */
+bool sf_view_select_name(sf_view_t *view, const char *name) {
+  uint32_t position;
+  if (!sf_listing_find(&view->dir->listing, name, &position)) {
+    return false;
+  }
+
+  view->selected_entry = position;
+  return true;
+}
+
+/*
+ * Shows the directory name, relative to dirfd, whose real path is path.
+ * It's shared with the views and preview showing it already, otherwise
+ * it's read in the background. select, if set, is selected once it's read.
+ */
+bool sf_view_set_path(
+    sf_view_t *view,
+    int dirfd,
+    const char *name,
+    const char *path,
+    const char *select) {
+  // path may point into the view's directory, which may be closed below
+  char rpath[PATH_MAX];
+  strncpy(rpath, path, sizeof(rpath) - 1);
+  rpath[sizeof(rpath) - 1] = '\0';
+
+  // The parent of / is / itself, going there keeps the view as it is
+  if (view->dir != NULL && strcmp(rpath, view->dir->path) == 0) {
+    if (select != NULL && select[0] != '\0') {
+      sf_view_select_name(view, select);
+    }
+    return true;
+  }
+
+  sf_dir_t *dir = sf_dir_open(dirfd, name, rpath);
+  if (dir == NULL) {
+    return false;
+  }
+  sf_dir_release(view->dir);
+  view->dir = dir;
+
+  // Nothing of the previous directory is kept selected, filtered or marked
+  view->selected_entry = 0;
+  view->select[0] = '\0';
+  sf_view_clear_filter(view);
+  sf_view_clear_marks(view);
+
+  if (select != NULL) {
+    sf_view_select_name(view, select);
+    if (dir->pending != NULL) {
+      // Found again once the listing is sorted
+      strncpy(view->select, select, sizeof(view->select) - 1);
+    }
+  }
+
+  if (view == &sf_views[sf_current_view]) {
+    sf_side_view_invalidate(&sf_side_view);
+  }
+  return true;
+}
+
+/*
+ * First and past the last row shown when height rows are available
+ */
+void sf_view_visible_range(
+    const sf_view_t *view, int height, uint32_t *first, uint32_t *last) {
+  uint32_t count = sf_view_row_count(view);
+  uint32_t selected = sf_view_selected_row(view);
+
+  int start = selected - (height / 2);
+  start = (start < 0) ? 0 : start;
+
+  int end = start + height;
+  end = (end > count) ? count : end;
+
+  if (((count - selected) < height / 2) && (count > height)) {
+    end = count;
+    start = end - height + 1;
+  }
+
+  if (count < height) {
+    start = 0;
+    end = count;
+  }
+
+  *first = start;
+  *last = end;
+}
+
+/*
+ * Fetches what drawing the view needs: the types the scan couldn't
+ * provide, and the metadata of the height visible rows if the columns are
+ * shown
+ */
+void sf_view_sync_metadata(sf_view_t *view, int height) {
+  sf_dir_t *dir = view->dir;
+  sf_dir_sync_metadata(dir);
+
+  if (sf_show_metadata && dir->pending == NULL) {
+    // Sorting moved the matches
+    sf_view_sync_filter(view);
+
+    uint32_t first, last;
+    sf_view_visible_range(view, height, &first, &last);
+    sf_listing_request_meta(
+        &dir->listing,
+        dir->dirfd,
+        &dir->generation,
+        sf_view_filtered(view) ? view->matches : NULL,
+        first,
+        last,
+        false);
+  }
+}
+
+bool sf_view_is_marked(sf_view_t *view, uint32_t position) {
+  if (view->marks.count == 0) {
+    return false;
+  }
+
+  uint32_t mark;
+  const char *name = sf_listing_name(&view->dir->listing, position);
+  return sf_listing_find(&view->marks, name, &mark);
+}
+
+/*
+ * Marks the selected entry, or unmarks it if it was
+ */
+void sf_view_toggle_mark(sf_view_t *view) {
+  if (sf_view_row_count(view) == 0) {
+    return;
+  }
+
+  const char *name = sf_listing_name(&view->dir->listing, view->selected_entry);
+  uint32_t mark;
+  if (sf_listing_find(&view->marks, name, &mark)) {
+    sf_listing_remove(&view->marks, mark);
+  } else {
+    sf_listing_push(&view->marks, name, DT_UNKNOWN);
+  }
+}
+
+void sf_view_clear_marks(sf_view_t *view) {
+  // Rows only notice marks of entries they show
+  if (view->marks.count > 0) {
+    view->generation++;
+  }
+  sf_listing_destroy(&view->marks);
+}
+
+void sf_view_init(sf_view_t *view) {
+  view->dir = NULL;
+  view->selected_entry = 0;
+  view->generation = 0;
+  view->select[0] = '\0';
+  view->filter[0] = '\0';
+  view->filter_input = false;
+  view->matches = NULL;
+  view->match_count = view->match_capacity = 0;
+  view->filter_version = 0;
+  memset(&view->marks, 0, sizeof(view->marks));
+  view->confirm_delete = false;
+
+  if (!sf_view_set_path(
+          view, AT_FDCWD, sf_initial_path, sf_initial_path, NULL)) {
+    // Shown empty
+    view->dir = sf_dir_find(sf_initial_path);
+    if (view->dir != NULL) {
+      view->dir->refs++;
+    } else {
+      view->dir = sf_dir_create(sf_initial_path, -1, -1);
+    }
+  }
+}
+
+void sf_view_destroy(sf_view_t *view) {
+  sf_dir_release(view->dir);
+  view->dir = NULL;
+  free(view->matches);
+  sf_listing_destroy(&view->marks);
+}
+
+void sf_set_view(uint32_t view_index) {
+  assert(view_index >= 0 && view_index < SF_VIEW_COUNT);
+  if (sf_views[view_index].dir == NULL) {
+    sf_view_init(&sf_views[view_index]);
+  }
+  sf_current_view = view_index;
+
+  // Versions are per view
+  sf_header_pane.dirty = sf_main_pane.dirty = true;
+  sf_side_view_invalidate(&sf_side_view);
+}
+
+/*
+ * Prefetch functions
+ */
+
+/*
+ * Scans the directory name, relative to dirfd, into the listing cache unless
+ * it's cached already, then the first of its subdirectories down to depth
+ * more levels. Runs on the prefetch pool.
+ */
+void sf_prefetch_directory(
+    int dirfd,
+    const char *name,
+    const char *path,
+    bool show_hidden_files,
+    uint32_t depth,
+    const atomic_bool *cancelled) {
+  if (atomic_load(cancelled)) {
+    return;
+  }
+
+  int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1) {
+    return;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return;
+  }
+
+  // The listing is only needed to go further down
+  sf_listing_t listing = {0};
+  if (sf_cache_lookup(
+          &sf_cache, path, &st, true, depth > 0 ? &listing : NULL)) {
+    close(fd);
+  } else {
+    struct timespec scan_start;
+    clock_gettime(CLOCK_REALTIME, &scan_start);
+
+    SF_TRACE_BEGIN(scan_start_us);
+    bool success = sf_scan_fd(fd, cancelled, NULL, &listing);
+    SF_TRACE_END(
+        scan_start_us, SF_TRACE_PREFETCH, "prefetch", path, listing.count);
+    if (!success) {
+      sf_listing_destroy(&listing);
+      return;
+    }
+    sf_listing_sort(&listing);
+    sf_cache_insert(&sf_cache, path, &st, scan_start, true, &listing);
+  }
+
+  // The first subdirectories are the ones previewed and moved to first
+  uint32_t prefetched = 0;
+  for (uint32_t i = 0;
+       depth > 0 && i < listing.count && prefetched <= SF_PREFETCH_SIBLINGS;
+       i++) {
+    if (sf_listing_type(&listing, i) != SF_ENTRY_DIRECTORY ||
+        (!show_hidden_files && sf_listing_entry(&listing, i)->hidden)) {
+      continue;
+    }
+
+    char child[PATH_MAX];
+    if (!sf_path_join(path, sf_listing_name(&listing, i), child)) {
+      continue;
+    }
+    sf_prefetch_directory(
+        AT_FDCWD, child, child, show_hidden_files, depth - 1, cancelled);
+    prefetched++;
+  }
+
+  sf_listing_destroy(&listing);
+}
+
+void sf_prefetch_run(sf_job_t *job) {
+  sf_prefetch_job_t *prefetch = (sf_prefetch_job_t *)job;
+  sf_prefetch_directory(
+      prefetch->dirfd,
+      prefetch->name,
+      prefetch->path,
+      prefetch->show_hidden_files,
+      prefetch->depth,
+      &job->cancelled);
+}
+
+void sf_prefetch_complete(sf_job_t *job) {
+  sf_prefetch_job_t *prefetch = (sf_prefetch_job_t *)job;
+
+  for (sf_prefetch_job_t **link = &sf_prefetcher.jobs; *link != NULL;
+       link = &(*link)->next) {
+    if (*link == prefetch) {
+      *link = prefetch->next;
+      break;
+    }
+  }
+
+  close(prefetch->dirfd);
+  free(prefetch);
+}
+
+/*
+ * Queues a prefetch of the directory name, relative to dirfd, whose path is
+ * path
+ */
+void sf_prefetch_submit(
+    int dirfd, const char *name, const char *path, uint32_t depth) {
+  sf_prefetch_job_t *prefetch = calloc(1, sizeof(sf_prefetch_job_t));
+  if (prefetch == NULL) {
+    return;
+  }
+
+  // The view may move on and close its fd while the prefetch runs
+  prefetch->dirfd = fcntl(dirfd, F_DUPFD_CLOEXEC, 0);
+  if (prefetch->dirfd == -1) {
+    free(prefetch);
+    return;
+  }
+
+  prefetch->job.run = sf_prefetch_run;
+  prefetch->job.complete = sf_prefetch_complete;
+  strncpy(prefetch->name, name, sizeof(prefetch->name) - 1);
+  strncpy(prefetch->path, path, sizeof(prefetch->path) - 1);
+  prefetch->show_hidden_files = sf_show_hidden_files;
+  prefetch->depth = depth;
+
+  prefetch->next = sf_prefetcher.jobs;
+  sf_prefetcher.jobs = prefetch;
+  sf_pool_submit(&sf_prefetch_pool, &prefetch->job);
+}
+
+/*
+ * Prefetches the entry of view shown at row if it's a directory
+ */
+void sf_prefetch_row(sf_view_t *view, uint32_t row) {
+  uint32_t position = sf_view_row_position(view, row);
+  if (sf_listing_type(&view->dir->listing, position) != SF_ENTRY_DIRECTORY) {
+    return;
+  }
+
+  const char *name = sf_listing_name(&view->dir->listing, position);
+  char path[PATH_MAX];
+  if (sf_path_join(view->dir->path, name, path)) {
+    sf_prefetch_submit(view->dir->dirfd, name, path, 0);
+  }
+}
+
+/*
+ * Prefetches where the user can go next from the current view: below the
+ * previewed directory, the directories next to the selection and the
+ * parent, most likely first. Called whenever the main loop is idle, plans
+ * again only once the selection or preview changed.
+ */
+void sf_prefetch_schedule() {
+  sf_view_t *view = &sf_views[sf_current_view];
+  if (view->dir->pending != NULL || sf_side_view.pending != NULL) {
+    // Scans that are waited on go first
+    return;
+  }
+
+  uint32_t count = sf_view_row_count(view);
+  char target[PATH_MAX];
+  if (count == 0 ||
+      !sf_path_join(
+          view->dir->path,
+          sf_listing_name(&view->dir->listing, view->selected_entry),
+          target)) {
+    strcpy(target, view->dir->path);
+  }
+
+  bool preview = sf_side_view.dir != NULL;
+  if (strcmp(target, sf_prefetcher.target) == 0 &&
+      preview == sf_prefetcher.preview) {
+    return;
+  }
+  strncpy(sf_prefetcher.target, target, sizeof(sf_prefetcher.target));
+  sf_prefetcher.preview = preview;
+
+  // Whatever is still queued was planned for another selection
+  for (sf_prefetch_job_t *prefetch = sf_prefetcher.jobs; prefetch != NULL;
+       prefetch = prefetch->next) {
+    atomic_store(&prefetch->job.cancelled, true);
+  }
 
-  sf_set_view(0);
+  if (count > 0) {
+    uint32_t row = sf_view_selected_row(view);
 
-  sf_side_view_update(&sf_side_view, &sf_views[sf_current_view]);
+    // The preview itself was scanned already
+    if (preview && SF_PREFETCH_DEPTH > 0) {
+      sf_prefetch_submit(
+          view->dir->dirfd,
+          sf_listing_name(&view->dir->listing, view->selected_entry),
+          sf_side_view.dir->path,
+          SF_PREFETCH_DEPTH);
+    }
 
-  initscr();
+    for (uint32_t distance = 1; distance <= SF_PREFETCH_SIBLINGS; distance++) {
+      if (row + distance < count) {
+        sf_prefetch_row(view, row + distance);
+      }
+      if (row >= distance) {
+        sf_prefetch_row(view, row - distance);
+      }
+    }
+  }
+
+  if (strcmp(view->dir->path, "/") != 0) {
+    char parent_path[PATH_MAX];
+    sf_get_parent_path(view->dir->path, parent_path);
+    sf_prefetch_submit(view->dir->dirfd, "..", parent_path, 0);
+  }
+}
+
+/*
+ * Memory accounting functions
+ */
+
+/*
+ * Sets the budget to SF_MEMORY_MAX_BYTES, or to the SF_MEMORY_MAX
+ * environment variable if it's a valid size
+ */
+void sf_memory_init(sf_memory_t *memory) {
+  memset(memory, 0, sizeof(*memory));
+  memory->max_size = SF_MEMORY_MAX_BYTES;
+
+  const char *value = getenv("SF_MEMORY_MAX");
+  if (value == NULL || !isdigit((unsigned char)value[0])) {
+    return;
+  }
+
+  char *end;
+  unsigned long long size = strtoull(value, &end, 10);
+  int shift = 0;
+  switch (toupper((unsigned char)*end)) {
+  case 'G':
+    shift += 10;
+    // Fall through
+  case 'M':
+    shift += 10;
+    // Fall through
+  case 'K':
+    shift += 10;
+    end++;
+    break;
+  }
+  if (*end == '\0' && size <= (SIZE_MAX >> shift)) {
+    memory->max_size = (size_t)size << shift;
+  }
+}
+
+/*
+ * Bytes held by what's open, which is never evicted, as of the last update
+ */
+size_t sf_memory_live_size(const sf_memory_t *memory) {
+  return memory->sizes[SF_MEMORY_VIEWS] + memory->sizes[SF_MEMORY_SIDE_VIEW] +
+         memory->sizes[SF_MEMORY_FINDER];
+}
+
+size_t sf_preview_memory_size(const sf_preview_t *preview) {
+  return sizeof(sf_preview_t) + preview->text_capacity +
+         sizeof(uint32_t) * preview->line_count;
+}
+
+size_t sf_finder_memory_size(const sf_finder_t *finder) {
+  return finder->paths_capacity +
+         sizeof(uint32_t) * (finder->capacity + finder->match_capacity);
+}
+
+/*
+ * Tallies what everything holds, then evicts cached listings and previews,
+ * least recently used first across both, until they fit in what's open
+ * leaves of the budget. Listings cached by workers until the next update
+ * are held to that too.
+ */
+void sf_memory_update(sf_memory_t *memory) {
+  memset(memory->sizes, 0, sizeof(memory->sizes));
+
+  for (sf_dir_t *dir = sf_dirs; dir != NULL; dir = dir->next) {
+    sf_memory_kind_t kind = SF_MEMORY_SIDE_VIEW;
+    for (uint32_t i = 0; i < SF_VIEW_COUNT; i++) {
+      if (sf_views[i].dir == dir) {
+        kind = SF_MEMORY_VIEWS;
+      }
+    }
+    memory->sizes[kind] += sizeof(sf_dir_t) + sf_listing_size(&dir->listing);
+  }
+
+  for (uint32_t i = 0; i < SF_VIEW_COUNT; i++) {
+    memory->sizes[SF_MEMORY_VIEWS] +=
+        sizeof(uint32_t) * sf_views[i].match_capacity +
+        sf_listing_size(&sf_views[i].marks);
+  }
+
+  sf_preview_t *shown = sf_side_view.preview;
+  if (shown != NULL) {
+    memory->sizes[SF_MEMORY_SIDE_VIEW] += sf_preview_memory_size(shown);
+  }
+
+  memory->sizes[SF_MEMORY_FINDER] = sf_finder_memory_size(&sf_finder);
+
+  size_t live = sf_memory_live_size(memory);
+  size_t room = memory->max_size > live ? memory->max_size - live : 0;
+
+  pthread_mutex_lock(&sf_cache.mutex);
+  pthread_mutex_lock(&sf_preview_cache_mutex);
+
+  sf_cache.max_size = room < SF_CACHE_MAX_BYTES ? room : SF_CACHE_MAX_BYTES;
+  sf_cache.max_prefetched_size =
+      room < SF_PREFETCH_MAX_BYTES ? room : SF_PREFETCH_MAX_BYTES;
+
+  // Evicting the preview shown wouldn't free it
+  size_t previews_size = 0;
+  for (uint32_t i = 0; i < SF_PREVIEW_CACHE_SIZE; i++) {
+    if (sf_preview_cache[i] != NULL && sf_preview_cache[i] != shown) {
+      previews_size += sf_preview_memory_size(sf_preview_cache[i]);
+    }
+  }
+
+  while (sf_cache.size + previews_size > room) {
+    uint32_t oldest = SF_PREVIEW_CACHE_SIZE;
+    for (uint32_t i = 0; i < SF_PREVIEW_CACHE_SIZE; i++) {
+      sf_preview_t *preview = sf_preview_cache[i];
+      if (preview != NULL && preview != shown &&
+          (oldest == SF_PREVIEW_CACHE_SIZE ||
+           preview->used_ms < sf_preview_cache[oldest]->used_ms)) {
+        oldest = i;
+      }
+    }
+
+    sf_cache_entry_t *entry = sf_cache.tail;
+    if (entry == NULL && oldest == SF_PREVIEW_CACHE_SIZE) {
+      break;
+    }
+
+    if (oldest == SF_PREVIEW_CACHE_SIZE ||
+        (entry != NULL &&
+         entry->used_ms <= sf_preview_cache[oldest]->used_ms)) {
+      sf_cache_remove(&sf_cache, entry);
+    } else {
+      previews_size -= sf_preview_memory_size(sf_preview_cache[oldest]);
+      sf_preview_release(sf_preview_cache[oldest]);
+      sf_preview_cache[oldest] = NULL;
+    }
+    memory->evictions++;
+  }
+
+  memory->sizes[SF_MEMORY_CACHE] = sf_cache.size;
+  memory->sizes[SF_MEMORY_PREVIEWS] = previews_size;
+
+  pthread_mutex_unlock(&sf_preview_cache_mutex);
+  pthread_mutex_unlock(&sf_cache.mutex);
+}
+
+/*
+ * List mode functions
+ */
+
+void sf_list_flush(sf_list_output_t *output) {
+  uint32_t written = 0;
+  while (!output->failed && written < output->size) {
+    ssize_t result =
+        write(output->fd, output->data + written, output->size - written);
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    if (result <= 0) {
+      output->failed = true;
+      break;
+    }
+    written += (uint32_t)result;
+  }
+  output->size = 0;
+}
+
+/*
+ * Buffers data, which only reaches the fd SF_LIST_BUFFER_SIZE bytes at a
+ * time or when flushed
+ */
+void sf_list_write(sf_list_output_t *output, const char *data, size_t size) {
+  while (size > 0) {
+    if (output->size == SF_LIST_BUFFER_SIZE) {
+      sf_list_flush(output);
+    }
+
+    size_t chunk = SF_LIST_BUFFER_SIZE - output->size;
+    if (chunk > size) {
+      chunk = size;
+    }
+    memcpy(output->data + output->size, data, chunk);
+    output->size += chunk;
+    data += chunk;
+    size -= chunk;
+  }
+}
+
+/*
+ * Bytes of the well formed UTF-8 character text starts with, 0 if it's
+ * not one. Overlong forms, surrogates and code points past U+10FFFF aren't.
+ */
+uint32_t sf_utf8_length(const char *text, uint32_t length) {
+  const unsigned char *bytes = (const unsigned char *)text;
+
+  uint32_t size;
+  uint32_t min;
+  if (bytes[0] < 0x80) {
+    return 1;
+  } else if (bytes[0] >= 0xc2 && bytes[0] < 0xe0) {
+    size = 2;
+    min = 0x80;
+  } else if ((bytes[0] & 0xf0) == 0xe0) {
+    size = 3;
+    min = 0x800;
+  } else if (bytes[0] >= 0xf0 && bytes[0] < 0xf5) {
+    size = 4;
+    min = 0x10000;
+  } else {
+    return 0;
+  }
+
+  if (size > length) {
+    return 0;
+  }
+
+  uint32_t code = bytes[0] & (0x7f >> size);
+  for (uint32_t i = 1; i < size; i++) {
+    if ((bytes[i] & 0xc0) != 0x80) {
+      return 0;
+    }
+    code = code << 6 | (bytes[i] & 0x3f);
+  }
+
+  if (code < min || code > 0x10ffff || (code >= 0xd800 && code < 0xe000)) {
+    return 0;
+  }
+  return size;
+}
+
+/*
+ * Writes text as a JSON string. Names are bytes, so those that aren't valid
+ * UTF-8 are replaced with U+FFFD to keep the output valid JSON.
+ */
+void sf_list_write_json_string(
+    sf_list_output_t *output, const char *text, uint32_t length) {
+  sf_list_write(output, "\"", 1);
+
+  // Runs of bytes that need no escaping are written at once
+  uint32_t run = 0;
+  uint32_t i = 0;
+  while (i < length) {
+    unsigned char c = (unsigned char)text[i];
+    uint32_t size = c >= 0x20 && c != '"' && c != '\\'
+                        ? sf_utf8_length(text + i, length - i)
+                        : 0;
+    if (size > 0) {
+      i += size;
+      continue;
+    }
+
+    sf_list_write(output, text + run, i - run);
+
+    char escape[8];
+    if (c == '"' || c == '\\') {
+      escape[0] = '\\';
+      escape[1] = (char)c;
+      sf_list_write(output, escape, 2);
+    } else if (c < 0x20) {
+      snprintf(escape, sizeof(escape), "\\u%04x", c);
+      sf_list_write(output, escape, 6);
+    } else {
+      sf_list_write(output, "\xef\xbf\xbd", 3);
+    }
+
+    i++;
+    run = i;
+  }
+
+  sf_list_write(output, text + run, length - run);
+  sf_list_write(output, "\"", 1);
+}
+
+/*
+ * Writes the entry at position. With show_metadata, lines start with the
+ * type, size and modification time in seconds since the epoch, separated by
+ * tabs, with '-' for what couldn't be stat'd; JSON objects get size and
+ * mtime members, null then.
+ */
+void sf_list_write_entry(
+    sf_list_output_t *output,
+    const sf_listing_t *listing,
+    uint32_t position,
+    sf_list_format_t format,
+    bool show_metadata) {
+  const sf_entry_t *entry = sf_listing_entry(listing, position);
+  const char *name = listing->names + entry->name_offset;
+  const sf_entry_meta_t *meta = sf_listing_meta(listing, position);
+  bool known = meta != NULL && meta->state == SF_META_DONE;
+
+  char fields[64];
+  if (format == SF_LIST_JSON) {
+    static const char *type_names[] = {
+        [SF_ENTRY_FILE] = "file",
+        [SF_ENTRY_DIRECTORY] = "directory",
+        [SF_ENTRY_LINK] = "link",
+        [SF_ENTRY_UNKNOWN] = "unknown",
+    };
+
+    sf_list_write(output, "{\"name\":", 8);
+    sf_list_write_json_string(output, name, entry->name_length);
+    int length = snprintf(
+        fields, sizeof(fields), ",\"type\":\"%s\"", type_names[entry->type]);
+    sf_list_write(output, fields, length);
+    if (show_metadata) {
+      length = known ? snprintf(
+                           fields,
+                           sizeof(fields),
+                           ",\"size\":%" PRId64 ",\"mtime\":%" PRId64,
+                           meta->size,
+                           meta->mtime)
+                     : snprintf(
+                           fields,
+                           sizeof(fields),
+                           ",\"size\":null,\"mtime\":null");
+      sf_list_write(output, fields, length);
+    }
+    sf_list_write(output, "}", 1);
+    return;
+  }
+
+  if (show_metadata) {
+    static const char type_chars[] = {
+        [SF_ENTRY_FILE] = '-',
+        [SF_ENTRY_DIRECTORY] = 'd',
+        [SF_ENTRY_LINK] = 'l',
+        [SF_ENTRY_UNKNOWN] = '?',
+    };
+
+    int length = known ? snprintf(
+                             fields,
+                             sizeof(fields),
+                             "%c\t%" PRId64 "\t%" PRId64 "\t",
+                             type_chars[entry->type],
+                             meta->size,
+                             meta->mtime)
+                       : snprintf(
+                             fields,
+                             sizeof(fields),
+                             "%c\t-\t-\t",
+                             type_chars[entry->type]);
+    sf_list_write(output, fields, length);
+  }
+
+  // Names can't contain NUL bytes, but they can contain newlines
+  sf_list_write(output, name, entry->name_length);
+  sf_list_write(output, format == SF_LIST_NUL ? "" : "\n", 1);
+}
+
+/*
+ * Writes the entries of a directory to stdout in the order sf shows them,
+ * without touching the terminal, for scripts:
+ *
+ *   sf --list [-a] [-l] [-0 | --json] [--sort ORDER] [DIR]
+ *
+ * -a includes hidden entries, -l their metadata. Returns the exit status.
+ */
+int sf_list(int argc, char **argv) {
+  bool show_hidden = false;
+  bool show_metadata = false;
+  sf_list_format_t format = SF_LIST_LINES;
+  sf_sort_t sort = SF_SORT_NAME;
+  const char *dir = NULL;
+
+  for (int i = 0; i < argc; i++) {
+    const char *arg = argv[i];
+    if (strcmp(arg, "-a") == 0) {
+      show_hidden = true;
+    } else if (strcmp(arg, "-l") == 0) {
+      show_metadata = true;
+    } else if (strcmp(arg, "-0") == 0) {
+      format = SF_LIST_NUL;
+    } else if (strcmp(arg, "--json") == 0) {
+      format = SF_LIST_JSON;
+    } else if (strcmp(arg, "--sort") == 0 && i + 1 < argc) {
+      i++;
+      uint32_t found = 0;
+      while (found < SF_SORT_COUNT &&
+             strcmp(argv[i], sf_sort_name((sf_sort_t)found)) != 0) {
+        found++;
+      }
+      if (found == SF_SORT_COUNT) {
+        fprintf(stderr, "sf: unknown sort order: %s\n", argv[i]);
+        return 2;
+      }
+      sort = (sf_sort_t)found;
+    } else if (arg[0] == '-' || dir != NULL) {
+      fprintf(
+          stderr,
+          "usage: sf --list [-a] [-l] [-0 | --json] "
+          "[--sort name|size|modified|extension|version] [dir]\n");
+      return 2;
+    } else {
+      dir = arg;
+    }
+  }
+  if (dir == NULL) {
+    dir = ".";
+  }
+
+  sf_init_locale();
+
+  // Nothing is cached, listings are bigger than the cache and never copied
+  sf_cache_init(&sf_cache, 0, 0);
+
+  char path[PATH_MAX];
+  sf_listing_t listing = {0};
+  int dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dirfd == -1 || realpath(dir, path) == NULL ||
+      !sf_get_entries(dirfd, ".", path, NULL, NULL, &listing)) {
+    fprintf(stderr, "sf: %s: %s\n", dir, strerror(errno));
+    if (dirfd != -1) {
+      close(dirfd);
+    }
+    sf_cache_destroy(&sf_cache);
+    return 1;
+  }
+
+  sf_listing_set_sort(&listing, sort);
+
+  // Like views, the types readdir didn't give are fetched, and every entry
+  // is stat'd if its metadata is shown or sorted by
+  bool stat_all = show_metadata || sf_sort_uses_meta(sort);
+  if ((stat_all || listing.unknown_count > 0) &&
+      sf_pool_init(&sf_stat_pool, SF_STAT_WORKER_COUNT, false)) {
+    uint32_t generation = 0;
+    sf_listing_request_meta(
+        &listing, dirfd, &generation, NULL, 0, listing.count, !stat_all);
+    while (listing.stat_jobs != NULL) {
+      struct pollfd fd = {.fd = sf_stat_pool.notify_fds[0], .events = POLLIN};
+      poll(&fd, 1, -1);
+      sf_pool_dispatch(&sf_stat_pool);
+    }
+    sf_pool_destroy(&sf_stat_pool);
+  }
+
+  if (listing.unsorted) {
+    sf_listing_sort(&listing);
+  }
+
+  sf_list_output_t *output = malloc(sizeof(sf_list_output_t));
+  if (output == NULL) {
+    fprintf(stderr, "sf: %s\n", strerror(errno));
+    close(dirfd);
+    sf_listing_destroy(&listing);
+    sf_cache_destroy(&sf_cache);
+    return 1;
+  }
+  output->fd = STDOUT_FILENO;
+  output->failed = false;
+  output->size = 0;
+
+  if (format == SF_LIST_JSON) {
+    sf_list_write(output, "[", 1);
+  }
+
+  bool first = true;
+  for (uint32_t position = 0; position < listing.count; position++) {
+    if (!show_hidden && sf_listing_entry(&listing, position)->hidden) {
+      continue;
+    }
+
+    if (format == SF_LIST_JSON) {
+      sf_list_write(output, first ? "\n" : ",\n", first ? 1 : 2);
+    }
+    first = false;
+
+    sf_list_write_entry(output, &listing, position, format, show_metadata);
+  }
+
+  if (format == SF_LIST_JSON) {
+    sf_list_write(output, first ? "]\n" : "\n]\n", first ? 2 : 3);
+  }
+
+  sf_list_flush(output);
+  bool failed = output->failed;
+  if (failed) {
+    fprintf(stderr, "sf: write error: %s\n", strerror(errno));
+  }
+
+  free(output);
+  close(dirfd);
+  sf_listing_destroy(&listing);
+  sf_cache_destroy(&sf_cache);
+  return failed ? 1 : 0;
+}
+
+/*
+ * Pane functions
+ */
+void sf_pane_init(sf_pane_t *pane, int height, int width, int y, int x) {
+  pane->window = newwin(height, width, y, x);
+  pane->dirty = true;
+  pane->version = 0;
+  pane->row_count = height;
+  pane->rows = calloc(height, sizeof(sf_row_t));
+}
+
+void sf_pane_resize(sf_pane_t *pane, int height, int width, int y, int x) {
+  delwin(pane->window);
+  free(pane->rows);
+  sf_pane_init(pane, height, width, y, x);
+}
+
+void sf_pane_destroy(sf_pane_t *pane) {
+  delwin(pane->window);
+  free(pane->rows);
+}
+
+/*
+ * Lays the panes out again once curses knows the new terminal size
+ */
+void sf_resize_screen() {
+  sf_pane_resize(
+      &sf_header_pane,
+      SF_HEADER_HEIGHT,
+      SF_HEADER_WIDTH,
+      SF_HEADER_Y,
+      SF_HEADER_X);
+  sf_pane_resize(
+      &sf_main_pane,
+      SF_MAIN_PANE_HEIGHT,
+      SF_MAIN_PANE_WIDTH,
+      SF_MAIN_PANE_Y,
+      SF_MAIN_PANE_X);
+  sf_pane_resize(
+      &sf_side_pane,
+      SF_SIDE_PANE_HEIGHT,
+      SF_SIDE_PANE_WIDTH,
+      SF_SIDE_PANE_Y,
+      SF_SIDE_PANE_X);
+  erase();
+  refresh();
+}
+
+void sf_init_locale() {
+  // Decode names in the user's encoding to measure and draw them
+  setlocale(LC_CTYPE, "");
+
+  // Sort names the way the user's locale does
+  const char *collate = setlocale(LC_COLLATE, "");
+  sf_collate_bytewise = collate == NULL || strcmp(collate, "C") == 0 ||
+                        strcmp(collate, "POSIX") == 0;
+}
+
+/*
+ * Sets up everything but the terminal: listings, workers and views of the
+ * current directory
+ */
+void sf_init_state() {
+#ifdef SF_TRACE
+  sf_tracer.started_us = sf_trace_now_us();
+#endif
+
+  sf_should_quit = false;
+  sf_show_hidden_files = false;
+#ifdef SF_SHOW_METADATA
+  sf_show_metadata = true;
+#else
+  sf_show_metadata = false;
+#endif
+
+  getcwd(sf_initial_path, sizeof(sf_initial_path));
+
+  // Resizes are handled and programs left running reaped from the main loop.
+  // On Linux both signals stay blocked and are read from a signalfd, so
+  // nothing runs in a signal handler and blocking calls aren't interrupted.
+#ifdef __linux__
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGWINCH);
+  sigaddset(&signals, SIGCHLD);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+  sf_signal_fds[0] = sf_signal_fds[1] =
+      signalfd(-1, &signals, SFD_CLOEXEC | SFD_NONBLOCK);
+#else
+  if (pipe2(sf_signal_fds, O_CLOEXEC | O_NONBLOCK) == 0) {
+    struct sigaction action = {
+        .sa_handler = sf_on_child_exit,
+        .sa_flags = SA_RESTART | SA_NOCLDSTOP,
+    };
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGCHLD, &action, NULL);
+  }
+#endif
+
+#ifdef SF_TRACE
+  const char *trace_path = getenv("SF_TRACE");
+  if (trace_path != NULL && trace_path[0] != '\0') {
+    sf_trace_open(trace_path);
+  }
+#endif
+
+  sf_init_locale();
+
+  sf_memory_init(&sf_memory);
+  sf_cache_init(&sf_cache, SF_CACHE_MAX_BYTES, SF_PREFETCH_MAX_BYTES);
+  sf_pool_init(&sf_pool, SF_WORKER_COUNT, false);
+  sf_pool_init(&sf_stat_pool, SF_STAT_WORKER_COUNT, false);
+  sf_pool_init(&sf_prefetch_pool, SF_PREFETCH_WORKER_COUNT, true);
+  sf_pool_init(&sf_du_pool, SF_DU_WORKER_COUNT, false);
+  sf_pool_init(&sf_find_pool, SF_FIND_WORKER_COUNT, false);
+  sf_pool_init(&sf_op_pool, SF_OP_WORKER_COUNT, false);
+
+  // Directory watches are added as directories are opened
+  sf_watch_init();
+
+#ifdef __linux__
+  sf_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  int source_fds[SF_EVENT_SOURCE_COUNT] = {
+      [SF_EVENT_INPUT] = STDIN_FILENO,
+      [SF_EVENT_SIGNAL] = sf_signal_fds[0],
+      [SF_EVENT_WATCH] = sf_inotify_fd,
+      [SF_EVENT_POOL] = sf_pool.notify_fds[0],
+      [SF_EVENT_STAT_POOL] = sf_stat_pool.notify_fds[0],
+      [SF_EVENT_PREFETCH_POOL] = sf_prefetch_pool.notify_fds[0],
+      [SF_EVENT_DU_POOL] = sf_du_pool.notify_fds[0],
+      [SF_EVENT_FIND_POOL] = sf_find_pool.notify_fds[0],
+      [SF_EVENT_OP_POOL] = sf_op_pool.notify_fds[0],
+  };
+  for (uint32_t i = 0; i < SF_EVENT_SOURCE_COUNT; i++) {
+    struct epoll_event event = {.events = EPOLLIN, .data.u64 = i};
+    if (source_fds[i] != -1) {
+      epoll_ctl(sf_epoll_fd, EPOLL_CTL_ADD, source_fds[i], &event);
+    }
+  }
+#endif
 
+  // The other views are set up when they're first switched to
+  memset(sf_views, 0, sizeof(sf_views));
+  sf_view_init(&sf_views[0]);
+
+  sf_side_view_init(&sf_side_view);
+
+  sf_set_view(0);
+}
+
+/*
+ * Sets up the current curses screen and the panes drawn on it
+ */
+void sf_init_screen() {
   noecho();
   cbreak();
   raw();
 
+  // Input is waited on in sf_poll_events so background work can land
+  nodelay(stdscr, TRUE);
+
   // Hide cursor
   curs_set(0);
 
@@ -448,22 +6956,90 @@ void sf_init() {
       SF_SIDE_PANE_X);
 }
 
+void sf_init() {
+  sf_init_state();
+  initscr();
+  sf_init_screen();
+}
+
 void sf_destroy() {
+  // Operations in flight stop at their next chunk instead of holding up
+  // quitting until they're done
+  for (sf_op_t *op = sf_ops; op != NULL; op = op->next) {
+    atomic_store(&op->job.cancelled, true);
+  }
+  sf_pool_destroy(&sf_op_pool);
+
+  sf_pool_destroy(&sf_pool);
+  sf_pool_destroy(&sf_stat_pool);
+  sf_pool_destroy(&sf_prefetch_pool);
+  sf_pool_destroy(&sf_du_pool);
+  sf_finder_stop(&sf_finder);
+  sf_pool_destroy(&sf_find_pool);
   for (uint32_t i = 0; i < SF_VIEW_COUNT; i++) {
     sf_view_destroy(&sf_views[i]);
   }
   sf_side_view_destroy(&sf_side_view);
+  sf_watch_destroy();
+  sf_cache_destroy(&sf_cache);
+  for (uint32_t i = 0; i < SF_PREVIEW_CACHE_SIZE; i++) {
+    sf_preview_release(sf_preview_cache[i]);
+    sf_preview_cache[i] = NULL;
+  }
   sf_pane_destroy(&sf_header_pane);
   sf_pane_destroy(&sf_side_pane);
   sf_pane_destroy(&sf_main_pane);
   noraw();
   endwin();
+
+#ifdef __linux__
+  close(sf_epoll_fd);
+  sf_epoll_fd = -1;
+#else
+  signal(SIGCHLD, SIG_DFL);
+#endif
+  if (sf_signal_fds[0] != -1) {
+    sf_notifier_close(sf_signal_fds);
+    sf_signal_fds[0] = sf_signal_fds[1] = -1;
+  }
+#ifdef SF_TRACE
+  sf_trace_close();
+#endif
+}
+
+/*
+ * Draws the first length bytes of text at the cursor, sanitized unless
+ * sf_text_measure found text plain
+ */
+void sf_draw_text(
+    WINDOW *window, const char *text, uint32_t length, bool plain) {
+  if (plain) {
+    waddnstr(window, text, (int)length);
+    return;
+  }
+
+  char sanitized[PATH_MAX];
+  if (length > sizeof(sanitized) - 1) {
+    length = sizeof(sanitized) - 1;
+  }
+  sf_text_sanitize(text, length, sanitized);
+  waddnstr(window, sanitized, (int)length);
 }
 
-void sf_draw_header(sf_pane_t *pane) {
+void sf_draw_header(sf_pane_t *pane) {
+  sf_view_t *view = &sf_views[sf_current_view];
+
+  // The finder's counts change with every batch of paths it takes
+  uint64_t version = sf_view_version(view);
+#if !defined(SF_DRAW_CACHE_STATS) && !defined(SF_DRAW_TRACE_STATS)
+  if (!pane->dirty && pane->version == version && !sf_finder.active) {
+    return;
+  }
+#endif
+  pane->dirty = false;
+  pane->version = version;
+
   werase(pane->window);
-
-  sf_view_t *view = &sf_views[sf_current_view];
   wmove(pane->window, 0, 0);
 
   wprintw(pane->window, "[");
@@ -481,269 +7057,936 @@ void sf_draw_header(sf_pane_t *pane) {
       wprintw(pane->window, " ");
     }
   }
-  wprintw(pane->window, "] %s", view->path);
+  wprintw(pane->window, "] %s", view->dir->path);
+
+  if (sf_sort != SF_SORT_NAME) {
+    wprintw(pane->window, " [by %s]", sf_sort_name(sf_sort));
+  }
+
+  if (view->dir->pending != NULL) {
+    wprintw(pane->window, " [reading, %u entries]", view->dir->listing.count);
+  }
+
+  if (view->marks.count > 0) {
+    wprintw(pane->window, " [%u marked]", view->marks.count);
+  }
+
+  if (sf_ops != NULL) {
+    // The oldest operation runs first
+    sf_op_t *op = sf_ops;
+    uint32_t queued = 0;
+    for (; op->next != NULL; op = op->next) {
+      queued++;
+    }
+
+    char bytes[16], rate[16];
+    uint64_t done = atomic_load(&op->bytes_done);
+    int64_t elapsed_ms = sf_now_ms() - op->started_ms;
+    sf_format_size(done, bytes, sizeof(bytes));
+    sf_format_size(
+        elapsed_ms > 0 ? done * 1000 / (uint64_t)elapsed_ms : 0,
+        rate,
+        sizeof(rate));
+    wprintw(
+        pane->window,
+        " [%s %u/%u, %s at %s/s",
+        op->kind == SF_OP_COPY   ? "copying"
+        : op->kind == SF_OP_MOVE ? "moving"
+                                 : "deleting",
+        atomic_load(&op->entries_done),
+        op->names.count,
+        bytes,
+        rate);
+    if (queued > 0) {
+      wprintw(pane->window, ", %u queued", queued);
+    }
+    wprintw(pane->window, "]");
+  } else if (sf_op_message[0] != '\0') {
+    wprintw(pane->window, " [%s]", sf_op_message);
+  }
+
+  if (view->confirm_delete) {
+    wprintw(
+        pane->window,
+        " delete %u marked entries? [%c/N]",
+        view->marks.count,
+        SF_KEY_CONFIRM);
+  } else if (sf_finder.active) {
+    wprintw(
+        pane->window,
+        " find: %s [%u/%u%s%s]",
+        sf_finder.query,
+        sf_finder.match_count,
+        sf_finder.count,
+        sf_finder.walk != NULL ? ", searching" : "",
+        sf_finder.truncated ? ", stopped" : "");
+  } else if (view->filter_input || view->filter[0] != '\0') {
+    uint32_t shown = view->dir->listing.count;
+    if (sf_view_hides_entries(view)) {
+      shown -= view->dir->listing.hidden_count;
+    }
+    wprintw(
+        pane->window,
+        " /%s [%u/%u]",
+        view->filter,
+        sf_view_row_count(view),
+        shown);
+  }
+
+#ifdef SF_DRAW_CACHE_STATS
+  wprintw(
+      pane->window,
+      " [cache %lu/%lu hits, %u dirs, %zu KiB]",
+      (unsigned long)sf_cache.hits,
+      (unsigned long)(sf_cache.hits + sf_cache.misses),
+      sf_cache.entry_count,
+      sf_cache.size / 1024);
+#endif
+
+#ifdef SF_DRAW_TRACE_STATS
+  const sf_trace_stat_t *last = sf_tracer.last;
+  wprintw(
+      pane->window,
+      " [scan %.1f ms %" PRIu64 ", sort %.1f ms %" PRIu64 ", draw %.1f ms]",
+      last[SF_TRACE_SCAN].duration_us / 1000.0,
+      last[SF_TRACE_SCAN].entries,
+      last[SF_TRACE_SORT].duration_us / 1000.0,
+      last[SF_TRACE_SORT].entries,
+      last[SF_TRACE_DRAW].duration_us / 1000.0);
+
+  static const char *memory_names[SF_MEMORY_KIND_COUNT] = {
+      [SF_MEMORY_VIEWS] = "views",
+      [SF_MEMORY_SIDE_VIEW] = "side",
+      [SF_MEMORY_CACHE] = "cache",
+      [SF_MEMORY_PREVIEWS] = "previews",
+      [SF_MEMORY_FINDER] = "find",
+  };
+  size_t memory_total = 0;
+  for (uint32_t i = 0; i < SF_MEMORY_KIND_COUNT; i++) {
+    memory_total += sf_memory.sizes[i];
+  }
+  char size[16], max_size[16];
+  sf_format_size(memory_total, size, sizeof(size));
+  sf_format_size(sf_memory.max_size, max_size, sizeof(max_size));
+  wprintw(pane->window, " [mem %s/%s", size, max_size);
+  for (uint32_t i = 0; i < SF_MEMORY_KIND_COUNT; i++) {
+    sf_format_size(sf_memory.sizes[i], size, sizeof(size));
+    wprintw(pane->window, " %s %s", memory_names[i], size);
+  }
+  wprintw(pane->window, ", %" PRIu64 " evicted]", sf_memory.evictions);
+#endif
 
-  wrefresh(pane->window);
+  wnoutrefresh(pane->window);
 }
 
 void sf_draw_side_pane(sf_pane_t *pane) {
+  uint64_t version = sf_side_view_version(&sf_side_view);
+  if (!pane->dirty && pane->version == version) {
+    return;
+  }
+  pane->dirty = false;
+  pane->version = version;
+
   werase(pane->window);
 
   int width, height;
   getmaxyx(pane->window, height, width);
 
-  if (sf_side_view.has_dir) {
+  sf_dir_t *dir = sf_side_view.dir;
+  sf_du_t *du = sf_side_view.du;
+  sf_preview_t *preview = sf_side_view.preview;
+
+  // The bottom row is kept for the recursive size
+  int rows = du != NULL ? height - 1 : height;
+
+  if (sf_side_view.pending != NULL || (dir != NULL && dir->pending != NULL)) {
+    mvwprintw(pane->window, 1, 2, "loading...");
+  } else if (dir != NULL) {
+    sf_listing_t *listing = &dir->listing;
+    uint32_t shown = listing->count;
+    if (!sf_show_hidden_files) {
+      shown -= listing->hidden_count;
+    }
 
-    if (sf_side_view.entry_count <= 0) {
+    if (shown <= 0) {
       sf_pcolor_on(pane, SF_EMPTY_PAIR);
       mvwprintw(pane->window, 1, 2, "empty");
       sf_pcolor_off(pane, SF_EMPTY_PAIR);
     } else {
-      for (uint32_t i = 0;
-           i < (sf_side_view.entry_count > height ? height
-                                                  : sf_side_view.entry_count);
-           i++) {
-        if (sf_side_view.entries[i].type == SF_ENTRY_DIRECTORY) {
-          sf_pcolor_on(pane, SF_HIGHLIGHT_PAIR);
+      // Only the first rows are drawn, hidden entries are skipped over
+      int y = 1;
+      for (uint32_t i = 0; i < listing->count && y < rows; i++) {
+        if (!sf_show_hidden_files && sf_listing_entry(listing, i)->hidden) {
+          continue;
         }
 
-        int y = i + 1;
-        int x = 1;
+        if (sf_listing_type(listing, i) == SF_ENTRY_DIRECTORY) {
+          sf_pcolor_on(pane, SF_HIGHLIGHT_PAIR);
+        }
 
-        char row[PATH_MAX] = "";
-        strcat(row, " ");
-        strncat(row, sf_side_view.entries[i].name, width - 2 - 1);
+        int columns = width > 3 ? width - 3 : 0;
+        sf_entry_layout_t layout = sf_listing_layout(listing, i, columns);
 
-        mvwprintw(pane->window, y, x, "%s", row);
+        mvwaddch(pane->window, y, 1, ' ');
+        sf_draw_text(
+            pane->window,
+            sf_listing_name(listing, i),
+            layout.fit_length,
+            layout.plain);
+        y++;
 
-        if (sf_side_view.entries[i].type == SF_ENTRY_DIRECTORY) {
+        if (sf_listing_type(listing, i) == SF_ENTRY_DIRECTORY) {
           sf_pcolor_off(pane, SF_HIGHLIGHT_PAIR);
         }
       }
     }
+  } else if (preview != NULL) {
+    if (preview->binary || preview->line_count == 0) {
+      char size[16];
+      sf_format_size((uint64_t)preview->size, size, sizeof(size));
+
+      sf_pcolor_on(pane, SF_EMPTY_PAIR);
+      mvwprintw(
+          pane->window,
+          1,
+          2,
+          preview->binary ? "binary, %s" : "empty",
+          size);
+      sf_pcolor_off(pane, SF_EMPTY_PAIR);
+    } else {
+      int columns = width > 3 ? width - 3 : 0;
+      int y = 1;
+      for (uint32_t line = 0; line < preview->line_count && y < rows; line++) {
+        const char *text = preview->text + preview->lines[line];
+        uint32_t line_width, fit_length;
+        bool plain = sf_text_measure(
+            text, strlen(text), columns, &line_width, &fit_length);
+
+        mvwaddch(pane->window, y++, 1, ' ');
+        sf_draw_text(pane->window, text, fit_length, plain);
+      }
+    }
   }
 
 #ifdef SF_DRAW_BORDERS
   box(pane->window, 0, 0);
 #endif
 
-  wrefresh(pane->window);
+  if (du != NULL && width > 4) {
+    char size[16];
+    sf_format_size(atomic_load(&du->bytes), size, sizeof(size));
+
+    char total[64];
+    snprintf(
+        total,
+        sizeof(total),
+        " %s in %" PRIu64 " files%s%s ",
+        size,
+        (uint64_t)atomic_load(&du->files),
+        atomic_load(&du->truncated) ? ", partial" : "",
+        du->done ? "" : "...");
+    mvwprintw(pane->window, height - 1, 2, "%.*s", width - 4, total);
+  }
+
+  wnoutrefresh(pane->window);
 }
 
-void sf_draw_main_pane(sf_pane_t *pane) {
-  werase(pane->window);
+/*
+ * Draws one row of the main pane over whatever it showed before
+ */
+void sf_draw_main_row(
+    sf_pane_t *pane, sf_listing_t *listing, sf_row_t row, int y, int width) {
+  int x = 0;
+
+  if (row.entry == SF_ROW_NONE) {
+    wmove(pane->window, y, x);
+    whline(pane->window, ' ', width);
+    return;
+  }
+
+  if (row.selected) {
+    wattron(pane->window, A_REVERSE);
+  }
+  if (row.marked) {
+    wattron(pane->window, A_BOLD);
+  }
+
+  if (sf_listing_type(listing, row.entry) == SF_ENTRY_DIRECTORY) {
+    sf_pcolor_on(pane, SF_HIGHLIGHT_PAIR);
+  }
+
+  // Columns only take space the names can spare
+  int name_width = width - 2 - 2;
+  bool columns =
+      sf_show_metadata &&
+      name_width - (SF_META_COLUMNS_WIDTH + 1) >= SF_META_MIN_NAME_WIDTH;
+  if (columns) {
+    name_width -= SF_META_COLUMNS_WIDTH + 1;
+  }
+
+  sf_entry_layout_t layout = sf_listing_layout(
+      listing, row.entry, name_width > 0 ? name_width : 0);
+
+  mvwaddstr(pane->window, y, x, row.marked ? " +" : "  ");
+  sf_draw_text(
+      pane->window,
+      sf_listing_name(listing, row.entry),
+      layout.fit_length,
+      layout.plain);
+
+  // Pad to the edge so the row overwrites what was there before
+  int length = getcurx(pane->window);
+  if (length < width) {
+    if (!row.selected) {
+      sf_pcolor_off(pane, SF_HIGHLIGHT_PAIR);
+    }
+    whline(pane->window, ' ' | getattrs(pane->window), width - length);
+  }
+
+  if (columns) {
+    char meta[SF_META_COLUMNS_WIDTH + 1];
+    sf_format_meta(
+        sf_listing_meta(listing, row.entry),
+        sf_listing_type(listing, row.entry),
+        meta);
+    mvwprintw(
+        pane->window, y, width - 2 - SF_META_COLUMNS_WIDTH, "%s", meta);
+  }
+
+  if (sf_listing_type(listing, row.entry) == SF_ENTRY_DIRECTORY) {
+    sf_pcolor_off(pane, SF_HIGHLIGHT_PAIR);
+  }
+
+  if (row.marked) {
+    wattroff(pane->window, A_BOLD);
+  }
+  if (row.selected) {
+    wattroff(pane->window, A_REVERSE);
+  }
+}
 
+void sf_draw_main_pane(sf_pane_t *pane) {
   sf_view_t *view = &sf_views[sf_current_view];
+  sf_listing_t *listing = &view->dir->listing;
 
   int width, height;
   getmaxyx(pane->window, height, width);
   height--; // border
 
-  if (view->entry_count == 0) {
-    sf_pcolor_on(pane, SF_EMPTY_PAIR);
-    mvwprintw(pane->window, 1, 2, "empty");
-    sf_pcolor_off(pane, SF_EMPTY_PAIR);
+  // A different view or listing invalidates every row, otherwise only rows
+  // whose entry or selection changed are redrawn
+  uint64_t version = sf_view_version(view);
+  bool full = pane->dirty || pane->version != version;
+  pane->dirty = false;
+  pane->version = version;
+
+  if (sf_view_row_count(view) == 0) {
+    if (!full) {
+      return;
+    }
+
+    werase(pane->window);
+    if (view->filter[0] != '\0' && listing->count > 0) {
+      mvwprintw(pane->window, 1, 2, "no matches");
+    } else if (view->dir->pending != NULL) {
+      mvwprintw(pane->window, 1, 2, "loading...");
+    } else {
+      sf_pcolor_on(pane, SF_EMPTY_PAIR);
+      mvwprintw(pane->window, 1, 2, "empty");
+      sf_pcolor_off(pane, SF_EMPTY_PAIR);
+    }
+
+    for (int y = 0; y < pane->row_count; y++) {
+      pane->rows[y].entry = SF_ROW_NONE;
+    }
   } else {
-    int first = view->selected_entry - (height / 2);
-    first = (first < 0) ? 0 : first;
+    uint32_t first, last;
+    sf_view_visible_range(view, height, &first, &last);
+
+    if (full) {
+      werase(pane->window);
+    }
+
+    bool damaged = full;
+    for (int y = 1; y < pane->row_count; y++) {
+      sf_row_t row = {
+          .entry = SF_ROW_NONE, .selected = false, .marked = false};
+      uint32_t i = first + (y - 1);
+      if (i < last) {
+        row.entry = sf_view_row_position(view, i);
+        row.selected = row.entry == view->selected_entry;
+        row.marked = sf_view_is_marked(view, row.entry);
+      }
 
-    int last = first + height;
-    last = (last > view->entry_count) ? view->entry_count : last;
+      if (full || pane->rows[y].entry != row.entry ||
+          pane->rows[y].selected != row.selected ||
+          pane->rows[y].marked != row.marked) {
+        if (!full || row.entry != SF_ROW_NONE) {
+          sf_draw_main_row(pane, listing, row, y, width);
+        }
+        pane->rows[y] = row;
+        damaged = true;
+      }
+    }
 
-    if ((((view->entry_count) - view->selected_entry) < height / 2) &&
-        (view->entry_count > height)) {
-      last = view->entry_count;
-      first = last - height + 1;
+    if (!damaged) {
+      return;
     }
+  }
+
+#ifdef SF_DRAW_BORDERS
+  box(pane->window, 0, 0);
+#endif
+
+  wnoutrefresh(pane->window);
+}
+
+/*
+ * Draws the ranked matches of the finder in place of the view
+ */
+void sf_draw_finder_pane(sf_pane_t *pane) {
+  if (!pane->dirty && pane->version == sf_finder.version) {
+    return;
+  }
+  pane->dirty = false;
+  pane->version = sf_finder.version;
 
-    if (view->entry_count < height) {
-      first = 0;
-      last = view->entry_count;
+  int width, height;
+  getmaxyx(pane->window, height, width);
+  height--; // border
+
+  werase(pane->window);
+
+  if (sf_finder.ranked_count == 0) {
+    mvwprintw(
+        pane->window,
+        1,
+        2,
+        sf_finder.walk != NULL ? "searching..." : "no matches");
+  } else {
+    // The selection is kept in the middle while there are more below
+    uint32_t rows = height > 1 ? (uint32_t)height - 1 : 1;
+    uint32_t first = sf_finder.selected > rows / 2
+                         ? sf_finder.selected - rows / 2
+                         : 0;
+    if (first + rows > sf_finder.ranked_count) {
+      first = sf_finder.ranked_count > rows ? sf_finder.ranked_count - rows
+                                            : 0;
     }
 
-    int y = 1;
-    int x = 0;
+    for (uint32_t i = first; i < sf_finder.ranked_count && i < first + rows;
+         i++) {
+      int y = 1 + (int)(i - first);
+      const char *path =
+          sf_finder.paths + sf_finder.offsets[sf_finder.ranked[i]];
+      bool directory = path[-1] == SF_ENTRY_DIRECTORY;
+      bool selected = i == sf_finder.selected;
 
-    for (uint32_t i = first; i < last; i++) {
-      if (i == view->selected_entry) {
+      if (selected) {
         wattron(pane->window, A_REVERSE);
       }
-
-      if (view->entries[i].type == SF_ENTRY_DIRECTORY) {
+      if (directory) {
         sf_pcolor_on(pane, SF_HIGHLIGHT_PAIR);
       }
 
-      char row[PATH_MAX] = "";
-      strcat(row, "  ");
-      strncat(row, view->entries[i].name, width - 2 - 2);
+      int path_width = width - 2 - 2;
+      uint32_t drawn_width, fit_length;
+      bool plain = sf_text_measure(
+          path,
+          strlen(path),
+          path_width > 0 ? path_width : 0,
+          &drawn_width,
+          &fit_length);
+      mvwaddstr(pane->window, y, 0, "  ");
+      sf_draw_text(pane->window, path, fit_length, plain);
 
-      mvwprintw(pane->window, y, x, "%s", row);
-
-      uint32_t length = strlen(row) + x;
-      if (i == view->selected_entry && length < width) {
-        uint32_t spaces = width - length;
-        for (uint32_t j = 0; j < spaces; j++) {
-          mvwprintw(pane->window, y, length + j, " ");
+      int length = getcurx(pane->window);
+      if (length < width) {
+        if (!selected) {
+          sf_pcolor_off(pane, SF_HIGHLIGHT_PAIR);
         }
+        whline(pane->window, ' ' | getattrs(pane->window), width - length);
       }
 
-      if (view->entries[i].type == SF_ENTRY_DIRECTORY) {
+      if (directory) {
         sf_pcolor_off(pane, SF_HIGHLIGHT_PAIR);
       }
-
-      if (i == view->selected_entry) {
+      if (selected) {
         wattroff(pane->window, A_REVERSE);
       }
-
-      y++;
     }
   }
 
+  // Every row is drawn again once the view is shown
+  for (int y = 0; y < pane->row_count; y++) {
+    pane->rows[y].entry = SF_ROW_NONE;
+  }
+
 #ifdef SF_DRAW_BORDERS
   box(pane->window, 0, 0);
 #endif
 
-  wrefresh(pane->window);
+  wnoutrefresh(pane->window);
 }
 
-int main() {
-  sf_init();
+/*
+ * Resolves and draws the final state of everything handled since the last
+ * frame
+ */
+void sf_draw_frame() {
+#ifdef SF_TRACE
+  sf_trace_end_frame();
+#endif
+  SF_TRACE_BEGIN(frame_start);
 
-  while (!sf_should_quit) {
-    sf_view_t *view = &sf_views[sf_current_view];
+  sf_view_t *view = &sf_views[sf_current_view];
+  sf_view_sync_metadata(view, sf_main_pane.row_count - 1);
+  sf_view_sync_filter(view);
+  sf_side_view_sync(&sf_side_view, view);
+  sf_side_view_sync_metadata(&sf_side_view);
+  sf_memory_update(&sf_memory);
 
+  // Panes only queue their changes, the terminal is updated once
+  SF_TRACE_BEGIN(draw_start);
+  if (sf_finder.active) {
+    sf_draw_finder_pane(&sf_main_pane);
+  } else {
     sf_draw_main_pane(&sf_main_pane);
-    sf_draw_side_pane(&sf_side_pane);
-    sf_draw_header(&sf_header_pane);
-
-    int c;
-    switch (c = getch()) {
-    case SF_KEY_BACKWARD: {
-      // Go back a directory
-      char prev_name[NAME_MAX];
-      sf_get_top_dir_from_path(view->path, prev_name);
-      if (sf_view_set_path(view, "..")) {
-        for (uint32_t i = 0; i < view->entry_count; i++) {
-          if (strcmp(prev_name, view->entries[i].name) == 0) {
-            sf_view_set_selected_entry(view, i);
-          }
-        }
-      }
-      break;
+  }
+  sf_draw_side_pane(&sf_side_pane);
+  sf_draw_header(&sf_header_pane);
+  SF_TRACE_END(draw_start, SF_TRACE_DRAW, "draw panes", NULL, 0);
+
+  SF_TRACE_BEGIN(update_start);
+  doupdate();
+  SF_TRACE_END(update_start, SF_TRACE_DRAW, "doupdate", NULL, 0);
+
+  SF_TRACE_END(frame_start, SF_TRACE_FRAME, "frame", view->dir->path, 0);
+
+#ifdef SF_TRACE
+  if (!sf_tracer.first_frame_traced) {
+    sf_tracer.first_frame_traced = true;
+    sf_trace_span(
+        SF_TRACE_FRAME,
+        "time to first frame",
+        sf_tracer.started_us,
+        view->dir->path,
+        view->dir->listing.count);
+  }
+#endif
+}
+
+/*
+ * Handles what woke up the main loop, input being left to the caller
+ */
+void sf_handle_event_source(sf_event_source_t source) {
+  switch (source) {
+  case SF_EVENT_INPUT: {
+    break;
+  }
+  case SF_EVENT_SIGNAL: {
+    sf_handle_signals();
+    break;
+  }
+  case SF_EVENT_WATCH: {
+    // Completions never close directories, only keys do, so the list stays
+    // valid while changes are applied
+    sf_watch_take_events();
+    for (sf_dir_t *dir = sf_dirs; dir != NULL; dir = dir->next) {
+      sf_dir_apply_events(dir);
     }
-    case SF_KEY_FORWARD: {
-      sf_entry_t *entry = &view->entries[view->selected_entry];
-      if (entry->type == SF_ENTRY_DIRECTORY) {
-        // Go into directory
-        char path[PATH_MAX];
-        realpath(entry->name, path);
-        if (sf_view_set_path(view, path)) {
-          sf_view_set_selected_entry(view, 0);
-        }
-      } else {
-        // TODO: handle links and stuff
-      }
-      break;
+    break;
+  }
+  case SF_EVENT_POOL: {
+    // Scans publish their progress through the same notifier
+    for (sf_dir_t *dir = sf_dirs; dir != NULL; dir = dir->next) {
+      sf_dir_take_progress(dir);
     }
-    case SF_KEY_DOWN: {
-      // Move down
-      if (view->selected_entry < view->entry_count - 1) {
-        sf_view_set_selected_entry(view, view->selected_entry + 1);
-      }
-      break;
+    sf_pool_dispatch(&sf_pool);
+    break;
+  }
+  case SF_EVENT_STAT_POOL: {
+    sf_pool_dispatch(&sf_stat_pool);
+    break;
+  }
+  case SF_EVENT_PREFETCH_POOL: {
+    sf_pool_dispatch(&sf_prefetch_pool);
+    break;
+  }
+  case SF_EVENT_DU_POOL: {
+    // Walks publish their partial totals through the same notifier
+    if (sf_side_view.du != NULL) {
+      sf_side_view.generation++;
     }
-    case SF_KEY_UP: {
-      // Move up
-      if (view->selected_entry > 0) {
-        sf_view_set_selected_entry(view, view->selected_entry - 1);
-      }
-      break;
+    sf_pool_dispatch(&sf_du_pool);
+    break;
+  }
+  case SF_EVENT_FIND_POOL: {
+    // Walks hand over what they found through the same notifier
+    sf_finder_take_results(&sf_finder);
+    sf_pool_dispatch(&sf_find_pool);
+    break;
+  }
+  case SF_EVENT_OP_POOL: {
+    // Operations publish their progress through the same notifier
+    for (sf_op_t *op = sf_ops; op != NULL; op = op->next) {
+      sf_op_take_progress(op);
     }
-    case SF_KEY_OPEN: {
-      // Open file
-      sf_entry_t *entry = &view->entries[view->selected_entry];
-      if (entry->type == SF_ENTRY_FILE) {
-        char path[PATH_MAX];
-        realpath(entry->name, path);
+    sf_pool_dispatch(&sf_op_pool);
+    break;
+  }
+  case SF_EVENT_SOURCE_COUNT: {
+    break;
+  }
+  }
+}
 
-        char *const args[] = {SF_OPENER, path, NULL};
-        sf_spawn(args, SF_FLAG_NOTRACE | SF_FLAG_NOWAIT);
-      }
-      break;
+/*
+ * Waits up to timeout_ms (-1 for no limit) for input, running the completion
+ * of background jobs and applying directory changes in the meantime.
+ * Returns once input is available, something changed or the time is up.
+ * Nothing is polled, so sf takes no CPU time while nothing happens.
+ */
+#ifdef __linux__
+void sf_poll_events(int timeout_ms) {
+  struct epoll_event events[SF_EVENT_SOURCE_COUNT];
+  int count =
+      epoll_wait(sf_epoll_fd, events, SF_EVENT_SOURCE_COUNT, timeout_ms);
+
+  for (int i = 0; i < count; i++) {
+    sf_handle_event_source((sf_event_source_t)events[i].data.u64);
+  }
+}
+#else
+void sf_poll_events(int timeout_ms) {
+  struct pollfd fds[SF_EVENT_SOURCE_COUNT] = {
+      [SF_EVENT_INPUT] = {.fd = STDIN_FILENO, .events = POLLIN},
+      [SF_EVENT_SIGNAL] = {.fd = sf_signal_fds[0], .events = POLLIN},
+      [SF_EVENT_WATCH] = {.fd = sf_inotify_fd, .events = POLLIN},
+      [SF_EVENT_POOL] = {.fd = sf_pool.notify_fds[0], .events = POLLIN},
+      [SF_EVENT_STAT_POOL] = {.fd = sf_stat_pool.notify_fds[0],
+                              .events = POLLIN},
+      [SF_EVENT_PREFETCH_POOL] = {.fd = sf_prefetch_pool.notify_fds[0],
+                                  .events = POLLIN},
+      [SF_EVENT_DU_POOL] = {.fd = sf_du_pool.notify_fds[0], .events = POLLIN},
+      [SF_EVENT_FIND_POOL] = {.fd = sf_find_pool.notify_fds[0],
+                              .events = POLLIN},
+      [SF_EVENT_OP_POOL] = {.fd = sf_op_pool.notify_fds[0], .events = POLLIN},
+  };
+  if (poll(fds, SF_EVENT_SOURCE_COUNT, timeout_ms) <= 0) {
+    return;
+  }
+
+  for (uint32_t i = 0; i < SF_EVENT_SOURCE_COUNT; i++) {
+    if (fds[i].revents & POLLIN) {
+      sf_handle_event_source((sf_event_source_t)i);
     }
-    case SF_KEY_EDIT: {
-      sf_entry_t *entry = &view->entries[view->selected_entry];
+  }
+}
+#endif
 
-      char path[PATH_MAX];
-      realpath(entry->name, path);
+/*
+ * Handles a key typed while the filter is edited
+ */
+void sf_handle_filter_key(sf_view_t *view, int c) {
+  switch (c) {
+  case SF_KEY_CANCEL: {
+    sf_view_clear_filter(view);
+    break;
+  }
+  case SF_KEY_OPEN: {
+    // Keep the filter, keys navigate again
+    view->filter_input = false;
+    sf_header_pane.dirty = true;
+    break;
+  }
+  case KEY_BACKSPACE:
+  case 127:
+  case '\b': {
+    if (view->filter[0] == '\0') {
+      view->filter_input = false;
+      sf_header_pane.dirty = true;
+    } else {
+      sf_view_edit_filter(view, c);
+    }
+    break;
+  }
+  default: {
+    if (c >= ' ' && c <= UCHAR_MAX) {
+      sf_view_edit_filter(view, c);
+    }
+    break;
+  }
+  }
+}
 
-      char *const args[] = {SF_EDITOR, path, NULL};
-      sf_spawn(args, SF_FLAG_TERM);
-      break;
+/*
+ * Handles a key typed while the finder is shown
+ */
+void sf_handle_finder_key(sf_view_t *view, int c) {
+  switch (c) {
+  case SF_KEY_CANCEL: {
+    sf_finder_stop(&sf_finder);
+    break;
+  }
+  case SF_KEY_OPEN: {
+    sf_finder_open_selected(&sf_finder, view);
+    sf_finder_stop(&sf_finder);
+    break;
+  }
+  case SF_KEY_FIND_NEXT: {
+    if (sf_finder.selected + 1 < sf_finder.ranked_count) {
+      sf_finder.selected++;
+      sf_finder.version++;
     }
-    case SF_KEY_TOGGLE_HIDDEN: {
-      sf_show_hidden_files = !sf_show_hidden_files;
-      char name[NAME_MAX];
-      strncpy(
-          name,
-          view->entries[view->selected_entry].name,
-          strlen(view->entries[view->selected_entry].name) + 1);
-      sf_view_update_entries(view);
-      sf_view_set_selected_entry(view, 0);
-      for (uint32_t i = 0; i < view->entry_count; i++) {
-        if (strcmp(name, view->entries[i].name) == 0) {
-          sf_view_set_selected_entry(view, i);
-          break;
-        }
-      }
+    break;
+  }
+  case SF_KEY_FIND_PREV: {
+    if (sf_finder.selected > 0) {
+      sf_finder.selected--;
+      sf_finder.version++;
+    }
+    break;
+  }
+  case KEY_BACKSPACE:
+  case 127:
+  case '\b': {
+    sf_finder_edit_query(&sf_finder, c);
+    break;
+  }
+  default: {
+    if (c >= ' ' && c <= UCHAR_MAX) {
+      sf_finder_edit_query(&sf_finder, c);
+    }
+    break;
+  }
+  }
+}
+
+/*
+ * Handles the key answering whether the entries marked in view are deleted,
+ * which can't be undone
+ */
+void sf_handle_delete_key(sf_view_t *view, int c) {
+  view->confirm_delete = false;
+  sf_header_pane.dirty = true;
+  if (c == SF_KEY_CONFIRM &&
+      sf_op_start(SF_OP_DELETE, view->dir, &view->marks, NULL)) {
+    sf_view_clear_marks(view);
+  }
+}
+
+void sf_handle_key(int c) {
+  sf_view_t *view = &sf_views[sf_current_view];
+  sf_listing_t *listing = &view->dir->listing;
+
+  // Rows index the matches, which have to be current
+  sf_view_sync_filter(view);
+
+  if (sf_finder.active && c != KEY_RESIZE) {
+    sf_handle_finder_key(view, c);
+    return;
+  }
+
+  if (view->filter_input && c != KEY_RESIZE) {
+    sf_handle_filter_key(view, c);
+    return;
+  }
+
+  if (view->confirm_delete && c != KEY_RESIZE) {
+    sf_handle_delete_key(view, c);
+    return;
+  }
+
+  switch (c) {
+  case SF_KEY_BACKWARD: {
+    // Go back a directory
+    char prev_name[NAME_MAX + 1];
+    char parent_path[PATH_MAX];
+    sf_get_top_dir_from_path(view->dir->path, prev_name);
+    sf_get_parent_path(view->dir->path, parent_path);
+    sf_view_set_path(view, view->dir->dirfd, "..", parent_path, prev_name);
+    break;
+  }
+  case SF_KEY_FORWARD: {
+    if (sf_view_row_count(view) == 0) {
       break;
     }
-    case '1':
-    case '2':
-    case '3':
-    case '4':
-    case '5':
-    case '6':
-    case '7':
-    case '8':
-    case '9': {
-      uint32_t view_index = (uint32_t)(c - '1');
-      if (view_index >= 0 && view_index < SF_VIEW_COUNT) {
-        sf_set_view(view_index);
+    if (sf_listing_type(listing, view->selected_entry) ==
+        SF_ENTRY_DIRECTORY) {
+      // Go into directory
+      const char *name = sf_listing_name(listing, view->selected_entry);
+      char path[PATH_MAX];
+      // The preview's listing is shared rather than read again
+      if (sf_path_join(view->dir->path, name, path) &&
+          sf_view_set_path(view, view->dir->dirfd, name, path, NULL)) {
+        sf_view_set_selected_entry(view, 0);
       }
+    } else {
+      // TODO: handle links and stuff
+    }
+    break;
+  }
+  case SF_KEY_DOWN: {
+    // Move down
+    uint32_t row = sf_view_selected_row(view);
+    if (row + 1 < sf_view_row_count(view)) {
+      sf_view_set_selected_entry(view, sf_view_row_position(view, row + 1));
+    }
+    break;
+  }
+  case SF_KEY_UP: {
+    // Move up
+    uint32_t row = sf_view_selected_row(view);
+    if (row > 0 && row - 1 < sf_view_row_count(view)) {
+      sf_view_set_selected_entry(view, sf_view_row_position(view, row - 1));
+    }
+    break;
+  }
+  case SF_KEY_OPEN: {
+    // Open file
+    if (sf_view_row_count(view) == 0) {
       break;
     }
-    case SF_KEY_QUIT: {
-      sf_should_quit = true;
+    const char *name = sf_listing_name(listing, view->selected_entry);
+    char path[PATH_MAX];
+    if (sf_listing_type(listing, view->selected_entry) == SF_ENTRY_FILE &&
+        sf_path_join(view->dir->path, name, path)) {
+      char *const args[] = {SF_OPENER, path, NULL};
+      sf_spawn(args, view->dir->dirfd, SF_FLAG_NOTRACE | SF_FLAG_NOWAIT);
+    }
+    break;
+  }
+  case SF_KEY_EDIT: {
+    if (sf_view_row_count(view) == 0) {
       break;
     }
-    case KEY_RESIZE: {
-      sf_pane_resize(
-          &sf_header_pane,
-          SF_HEADER_HEIGHT,
-          SF_HEADER_WIDTH,
-          SF_HEADER_Y,
-          SF_HEADER_X);
-      sf_pane_resize(
-          &sf_main_pane,
-          SF_MAIN_PANE_HEIGHT,
-          SF_MAIN_PANE_WIDTH,
-          SF_MAIN_PANE_Y,
-          SF_MAIN_PANE_X);
-      sf_pane_resize(
-          &sf_side_pane,
-          SF_SIDE_PANE_HEIGHT,
-          SF_SIDE_PANE_WIDTH,
-          SF_SIDE_PANE_Y,
-          SF_SIDE_PANE_X);
-      erase();
-      refresh();
+
+    const char *name = sf_listing_name(listing, view->selected_entry);
+    char path[PATH_MAX];
+    if (!sf_path_join(view->dir->path, name, path)) {
       break;
     }
+
+    char *const args[] = {SF_EDITOR, path, NULL};
+    sf_spawn(args, view->dir->dirfd, SF_FLAG_TERM);
+    break;
+  }
+  case SF_KEY_FILTER: {
+    view->filter_input = true;
+    sf_header_pane.dirty = true;
+    break;
+  }
+  case SF_KEY_CANCEL: {
+    if (view->filter[0] != '\0') {
+      sf_view_clear_filter(view);
+    }
+    break;
+  }
+  case SF_KEY_FIND: {
+    sf_finder_start(&sf_finder, view);
+    break;
+  }
+  case SF_KEY_MARK: {
+    sf_view_toggle_mark(view);
+    sf_header_pane.dirty = true;
+
+    uint32_t row = sf_view_selected_row(view);
+    if (row + 1 < sf_view_row_count(view)) {
+      sf_view_set_selected_entry(view, sf_view_row_position(view, row + 1));
+    }
+    break;
+  }
+  case SF_KEY_COPY:
+  case SF_KEY_MOVE: {
+    // Entries marked in other views are brought into this one's directory
+    for (uint32_t i = 0; i < SF_VIEW_COUNT; i++) {
+      sf_view_t *other = &sf_views[i];
+      if (other->dir != view->dir && other->marks.count > 0 &&
+          sf_op_start(
+              c == SF_KEY_COPY ? SF_OP_COPY : SF_OP_MOVE,
+              other->dir,
+              &other->marks,
+              view->dir)) {
+        sf_view_clear_marks(other);
+      }
+    }
+    break;
+  }
+  case SF_KEY_DELETE: {
+    // Deletes are recursive, they only start once the prompt is answered
+    if (view->marks.count > 0) {
+      view->confirm_delete = true;
+      sf_header_pane.dirty = true;
+    }
+    break;
+  }
+  case SF_KEY_SORT: {
+    // Listings are sorted again as they're drawn
+    sf_sort = (sf_sort + 1) % SF_SORT_COUNT;
+    sf_header_pane.dirty = true;
+    break;
+  }
+  case SF_KEY_TOGGLE_METADATA: {
+    sf_show_metadata = !sf_show_metadata;
+    sf_main_pane.dirty = true;
+    break;
+  }
+  case SF_KEY_TOGGLE_HIDDEN: {
+    // Listings hold hidden entries too, every view is refiltered as it's
+    // drawn and the preview is only redrawn
+    sf_show_hidden_files = !sf_show_hidden_files;
+    for (uint32_t i = 0; i < SF_VIEW_COUNT; i++) {
+      sf_views[i].generation++;
+    }
+    sf_side_view_invalidate(&sf_side_view);
+    sf_side_pane.dirty = true;
+    // Different siblings are shown
+    sf_prefetcher.target[0] = '\0';
+    break;
+  }
+  case '1':
+  case '2':
+  case '3':
+  case '4':
+  case '5':
+  case '6':
+  case '7':
+  case '8':
+  case '9': {
+    uint32_t view_index = (uint32_t)(c - '1');
+    if (view_index >= 0 && view_index < SF_VIEW_COUNT) {
+      sf_set_view(view_index);
     }
+    break;
+  }
+  case SF_KEY_QUIT: {
+    sf_should_quit = true;
+    break;
+  }
+#ifndef __linux__
+  // On Linux resizes arrive through sf_signal_fds, and the KEY_RESIZE
+  // resizeterm queues then is ignored
+  case KEY_RESIZE: {
+    sf_resize_screen();
+    break;
   }
+#endif
+  }
+}
+
+/*
+ * Handles every key that's already available. Returns false if there was
+ * none.
+ */
+bool sf_handle_pending_keys() {
+  bool handled = false;
 
-  sf_destroy();
+  int c;
+  while (!sf_should_quit && (c = getch()) != ERR) {
+    sf_handle_key(c);
+    handled = true;
+  }
 
-  return 0;
+  return handled;
 }
@@ -0,0 +1,1326 @@
+/* Core of sf shared by the program and the benchmarks */
+
+#ifndef SF_H
+#define SF_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "config.h"
+#include <assert.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <locale.h>
+#include <ncurses.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <wchar.h>
+
+#if defined(SF_DRAW_TRACE_STATS) && !defined(SF_TRACE)
+#define SF_TRACE
+#endif
+
+#define SF_HIGHLIGHT_PAIR 1
+#define SF_EMPTY_PAIR 2
+
+/*
+ * sf_spawn flags
+ */
+#define SF_FLAG_NOTRACE 1 << 0 // Disable child output
+#define SF_FLAG_TERM 1 << 1    // Exit curses white process is running
+#define SF_FLAG_NOWAIT 1 << 2  // Don't wait for the child process to exit
+
+/*
+ * Tracing, the spans compile to nothing without SF_TRACE.
+ * SF_TRACE_BEGIN(start) declares start, SF_TRACE_END(start, ...) records the
+ * span from it to now.
+ */
+#ifdef SF_TRACE
+#define SF_TRACE_BEGIN(start) int64_t start = sf_trace_now_us()
+#define SF_TRACE_END(start, category, name, detail, entries)                   \
+  sf_trace_span(category, name, start, detail, entries)
+#else
+#define SF_TRACE_BEGIN(start)
+#define SF_TRACE_END(start, category, name, detail, entries)
+#endif
+
+/*
+ * Directory scanning
+ */
+#define SF_SCAN_BUFFER_SIZE (256 * 1024) // Bytes read per getdents64 call
+#define SF_SCAN_INITIAL_CAPACITY 64
+// Entries read by a view's scan are shown at most this often until it
+// completes
+#define SF_SCAN_PROGRESS_INTERVAL_MS 50
+// Arena bytes of removed entries tolerated before a listing is compacted
+#define SF_LISTING_MAX_GARBAGE (64 * 1024)
+
+// Snapshots written by another version of the format are ignored
+#define SF_SNAPSHOT_MAGIC "sf-list"
+#define SF_SNAPSHOT_VERSION 1
+
+#define SF_ROW_NONE UINT32_MAX
+
+// Size and modification time shown at the end of main pane rows
+#define SF_META_SIZE_WIDTH 6
+#define SF_META_COLUMNS_WIDTH (SF_META_SIZE_WIDTH + 1 + 16)
+#define SF_META_MIN_NAME_WIDTH 12 // Narrower panes only show names
+
+// Recursive walks keep the directories above the one they walk open, up to
+// SF_WALK_MAX_DEPTH per worker. Deeper subdirectories are queued, as are
+// ones handed to idle workers, by their path from the root of the walk so
+// queued jobs don't hold fds.
+#define SF_WALK_MAX_DEPTH 16
+
+// Recursive directory sizes are redrawn at most this often while they're
+// added up, and workers check the time every SF_DU_PROGRESS_BATCH entries
+#define SF_DU_PROGRESS_INTERVAL_MS 50
+#define SF_DU_PROGRESS_BATCH 256
+
+// Finder workers hand over the paths they found in batches of up to
+// SF_FIND_BATCH_SIZE bytes, and wake up the main loop at most every
+// SF_FIND_PROGRESS_INTERVAL_MS, checking the time every
+// SF_FIND_PROGRESS_BATCH entries. Past SF_FIND_MAX_BYTES of paths the walk
+// stops. The best SF_FIND_RANKED_COUNT matches are kept ranked.
+#define SF_FIND_BATCH_SIZE (16 * 1024)
+#define SF_FIND_PROGRESS_INTERVAL_MS 50
+#define SF_FIND_PROGRESS_BATCH 256
+#define SF_FIND_MAX_BYTES (1024 * 1024 * 1024)
+#define SF_FIND_RANKED_COUNT 1024
+
+// Bytes copied per copy_file_range call, and per read where it's not
+// supported. Progress is published every SF_SCAN_PROGRESS_INTERVAL_MS.
+#define SF_OP_CHUNK_SIZE (4 * 1024 * 1024)
+#define SF_OP_BUFFER_SIZE (256 * 1024)
+
+// File preview lines are cut at this many columns, tabs are expanded to
+// multiples of SF_PREVIEW_TAB_WIDTH
+#define SF_PREVIEW_MAX_COLUMNS 512
+#define SF_PREVIEW_TAB_WIDTH 8
+
+// sf --list writes its output this many bytes at a time
+#define SF_LIST_BUFFER_SIZE (256 * 1024)
+
+#define SF_HEADER_WIDTH COLS
+#define SF_HEADER_HEIGHT 1
+#define SF_HEADER_Y 0
+#define SF_HEADER_X 0
+
+#define SF_MAIN_PANE_WIDTH (int)(COLS * (SF_PANE_RATIO))
+#define SF_MAIN_PANE_HEIGHT (LINES - SF_HEADER_HEIGHT)
+#define SF_MAIN_PANE_Y 1
+#define SF_MAIN_PANE_X 0
+
+#define SF_SIDE_PANE_WIDTH (COLS - SF_MAIN_PANE_WIDTH)
+#define SF_SIDE_PANE_HEIGHT (LINES - SF_HEADER_HEIGHT)
+#define SF_SIDE_PANE_Y 1
+#define SF_SIDE_PANE_X (SF_MAIN_PANE_WIDTH)
+
+typedef enum sf_entry_type_t {
+  SF_ENTRY_FILE,
+  SF_ENTRY_DIRECTORY,
+  SF_ENTRY_LINK,
+  SF_ENTRY_UNKNOWN,
+} sf_entry_type_t;
+
+/*
+ * Orders listings can be shown in. Directories always come first, and
+ * entries that tie are ordered by name.
+ */
+typedef enum sf_sort_t {
+  SF_SORT_NAME,
+  SF_SORT_SIZE,  // Largest first
+  SF_SORT_MTIME, // Most recently modified first
+  SF_SORT_EXTENSION,
+  SF_SORT_VERSION, // Numbers in names by their value, like ls -v
+  SF_SORT_COUNT,
+} sf_sort_t;
+
+/*
+ * Entries only reference their name, which lives in the name arena of the
+ * listing that owns them, so they stay small and cheap to sort
+ */
+typedef struct sf_entry_t {
+  uint32_t name_offset; // Offset of the NUL terminated name in the arena
+  uint32_t key_offset;  // Offset of the collation key in the key arena
+  uint16_t name_length;
+  uint16_t key_length;
+  uint8_t type;       // sf_entry_type_t
+  uint8_t sort_class; // Directories come first
+  uint8_t hidden;     // The name starts with a dot
+  // First bytes of the collation key in big endian order, so most
+  // comparisons are a single integer compare
+  uint64_t key_prefix;
+} sf_entry_t;
+
+/*
+ * stat data of an entry, fetched lazily by the metadata stage
+ */
+typedef enum sf_meta_state_t {
+  SF_META_NONE,
+  SF_META_PENDING, // Requested, a stat job is in flight
+  SF_META_DONE,
+  SF_META_FAILED,
+} sf_meta_state_t;
+
+typedef struct sf_entry_meta_t {
+  int64_t size;
+  int64_t mtime; // Seconds since the epoch
+  uint8_t state; // sf_meta_state_t
+} sf_entry_meta_t;
+
+/*
+ * How the name of an entry is drawn, measured when it's first drawn
+ */
+typedef struct sf_entry_layout_t {
+  uint16_t width;       // Display width of the name plus one, 0 if unmeasured
+  uint16_t fit_columns; // Columns fit_length was measured for
+  uint16_t fit_length;  // Bytes of the name that fit in fit_columns
+  bool plain;           // The name draws as it is, see sf_text_measure
+} sf_entry_layout_t;
+
+typedef struct sf_listing_t {
+  // Entries in the order they were added. They're never reordered, so an
+  // entry's index identifies it until the listing is compacted.
+  uint32_t entry_count;
+  uint32_t entry_capacity;
+  sf_entry_t *entries;
+
+  // Display order: order[position] is the index of the entry shown at that
+  // position. Removed entries are only dropped from here.
+  uint32_t count;
+  uint32_t *order;
+  uint8_t sort; // sf_sort_t the display order is, or is to be, sorted in
+
+  // Display orders of other sorts computed before, NULL where there's none,
+  // so switching back to them is instant. They're dropped whenever entries
+  // are added, removed or turn out to be directories.
+  uint32_t *orders[SF_SORT_COUNT];
+
+  // Indexed like entries, allocated when metadata is first requested
+  sf_entry_meta_t *meta;
+  bool meta_requested; // Every entry's metadata is being or was fetched
+  // Indexed like entries, allocated when the listing is first drawn
+  sf_entry_layout_t *layouts;
+  uint32_t unknown_count; // Entries scanned without a type
+  uint32_t hidden_count;  // Live entries with a hidden name
+  bool types_requested;   // Unknown types are being or were fetched
+  // The display order isn't sorted: entries are in the order they were
+  // read, or fetched types changed where they belong
+  bool unsorted;
+
+  // Open addressing hash of the live entries' names. Slots hold an entry
+  // index plus one, 0 marks an empty slot.
+  uint32_t hash_capacity; // A power of two
+  uint32_t *hash_slots;
+
+  // Names stored back to back
+  uint32_t names_size;
+  uint32_t names_capacity;
+  char *names;
+
+  // strxfrm keys stored back to back. NULL when the locale collates
+  // bytewise, in which case the names are their own keys.
+  uint32_t keys_size;
+  uint32_t keys_capacity;
+  char *keys;
+
+  // Arena bytes left behind by removed entries
+  uint32_t garbage_size;
+
+  // Metadata jobs in flight for this listing
+  struct sf_stat_job_t *stat_jobs;
+
+  // Set if entries, order, the hash and the arenas point into map_size bytes
+  // of a snapshot mapped privately. They can be written to but not
+  // reallocated, so sf_listing_push and sf_listing_append copy them out
+  // first.
+  void *map;
+  size_t map_size;
+} sf_listing_t;
+
+/*
+ * Start of a listing snapshot file. The sections follow at the given
+ * offsets, laid out as they are in memory so the file is mapped and used
+ * as it is. The directory's real path follows the header.
+ */
+typedef struct sf_snapshot_header_t {
+  char magic[8];
+  uint32_t version;
+  uint32_t entry_size; // sizeof(sf_entry_t) of the sf that wrote it
+  uint64_t dev;
+  uint64_t ino;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  char collate[64]; // LC_COLLATE the keys were made in, empty if bytewise
+  uint32_t path_length;
+  uint32_t count; // Entries, all live and in display order
+  uint32_t unknown_count;
+  uint32_t hidden_count;
+  uint32_t hash_capacity;
+  uint32_t names_size;
+  uint32_t keys_size;
+  uint64_t entries_offset;
+  uint64_t order_offset;
+  uint64_t hash_offset;
+  uint64_t names_offset;
+  uint64_t keys_offset;
+} sf_snapshot_header_t;
+
+/*
+ * Parsed and sorted listing cached by real path, validated against the
+ * directory's identity and modification time before being reused
+ */
+typedef struct sf_cache_entry_t {
+  char *path;
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  size_t size; // Bytes held by the listing
+  sf_listing_t listing;
+  bool prefetched; // Scanned ahead of time and not looked up since
+  int64_t used_ms; // Last inserted or looked up
+
+  // LRU list, most recently used first
+  struct sf_cache_entry_t *prev;
+  struct sf_cache_entry_t *next;
+} sf_cache_entry_t;
+
+typedef struct sf_cache_t {
+  // Listings are loaded from worker threads too
+  pthread_mutex_t mutex;
+
+  sf_cache_entry_t *head;
+  sf_cache_entry_t *tail;
+  uint32_t entry_count;
+  size_t size;
+  size_t max_size;
+  // Prefetched listings are evicted among themselves to stay under their
+  // own budget, so they never push out listings that were used
+  size_t prefetched_size;
+  size_t max_prefetched_size;
+
+  uint64_t hits;
+  uint64_t misses;
+} sf_cache_t;
+
+/*
+ * Work handed to the worker pool. run is called on a worker thread, then
+ * complete is called on the main thread, which owns the job again.
+ * complete is always called exactly once, even if the job was cancelled
+ * before it ran.
+ */
+typedef struct sf_job_t {
+  void (*run)(struct sf_job_t *job);
+  void (*complete)(struct sf_job_t *job);
+  atomic_bool cancelled;
+  struct sf_job_t *next;
+} sf_job_t;
+
+typedef struct sf_pool_t {
+  pthread_t *threads;
+  uint32_t thread_count;
+
+  bool idle; // Workers only run when nothing else wants the CPU or disk
+
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  bool stopping;
+  sf_job_t *pending_head;
+  sf_job_t *pending_tail;
+  sf_job_t *done;
+
+  // Signalled with sf_notify whenever a job finishes, to wake the main loop.
+  // Both are the same eventfd on Linux, the ends of a pipe elsewhere.
+  int notify_fds[2];
+} sf_pool_t;
+
+/*
+ * Watch of a directory on the shared inotify instance. Watching a directory
+ * twice yields the same descriptor, so watches are counted. Events are
+ * queued with their watch as they're read and applied by the directory
+ * once it isn't being read, so changes made meanwhile aren't missed.
+ */
+typedef struct sf_watch_t {
+  int wd;
+  uint32_t refs;
+  bool overflowed; // Events were lost
+
+  // Each event is its uint32_t mask followed by the NUL terminated name
+  char *events;
+  uint32_t events_size;
+  uint32_t events_capacity;
+
+  struct sf_watch_t *next;
+} sf_watch_t;
+
+/*
+ * Entries read by a scan that's still running, handed over to the main
+ * thread in chunks so huge directories show up before the scan completes
+ */
+typedef struct sf_scan_progress_t {
+  pthread_mutex_t mutex;
+  sf_listing_t chunk; // Read since the main thread last took them
+  int64_t published_ms;
+  int wake_fd; // Signalled whenever a chunk is published
+} sf_scan_progress_t;
+
+/*
+ * Directory scan run on the worker pool
+ */
+typedef struct sf_scan_job_t {
+  sf_job_t job;
+  int dirfd; // Owned by the job
+  char name[NAME_MAX + 1];
+  char path[PATH_MAX];
+  bool success;
+  sf_listing_t listing;
+  int fd;    // The scanned directory
+  int watch; // Watched before scanning so no change is missed
+
+  // Scans of open directories stream their entries while they run. NULL
+  // once the scan is cancelled.
+  struct sf_dir_t *dir;
+  sf_scan_progress_t progress;
+  int64_t started_ms;
+} sf_scan_job_t;
+
+/*
+ * Batch of entries stat'd on the metadata pool
+ */
+typedef struct sf_stat_job_t {
+  sf_job_t job;
+  int dirfd;                  // Owned by the job
+  sf_listing_t *listing;      // NULL once the listing is gone
+  uint32_t *generation;       // Of the listing's owner, bumped on completion
+  struct sf_stat_job_t *next; // Next job of the same listing
+
+  uint32_t count;
+  uint32_t done; // Entries stat'd when the job finished or was cancelled
+  uint32_t indices[SF_STAT_BATCH_SIZE];
+  uint32_t name_offsets[SF_STAT_BATCH_SIZE];
+
+  // Copies of the names, the listing's arena may move while the job runs
+  uint32_t names_size;
+  uint32_t names_capacity;
+  char *names;
+
+  sf_entry_meta_t meta[SF_STAT_BATCH_SIZE];
+  unsigned char types[SF_STAT_BATCH_SIZE]; // d_type from the stat mode
+} sf_stat_job_t;
+
+/*
+ * Directory scanned into the listing cache ahead of time on the prefetch
+ * pool, in case it's opened next
+ */
+typedef struct sf_prefetch_job_t {
+  sf_job_t job;
+  int dirfd; // Owned by the job
+  char name[NAME_MAX + 1];
+  char path[PATH_MAX];
+  bool show_hidden_files; // Hidden subdirectories aren't prefetched
+  uint32_t depth; // Levels of subdirectories prefetched below it
+  struct sf_prefetch_job_t *next; // Next job in flight
+} sf_prefetch_job_t;
+
+/*
+ * Prefetches in flight, and the selection they were planned for so they
+ * are only planned again once it changes
+ */
+typedef struct sf_prefetcher_t {
+  sf_prefetch_job_t *jobs;
+  char target[PATH_MAX]; // Path of the selection, or of the view if empty
+  bool preview;          // The selection was previewed
+} sf_prefetcher_t;
+
+typedef struct sf_du_link_t {
+  dev_t dev;
+  ino_t ino;
+} sf_du_link_t;
+
+/*
+ * Recursive size of a directory. Jobs walking parts of it add to the totals
+ * as they go, so partial sums can be drawn before the walk completes.
+ */
+typedef struct sf_du_t {
+  // Identity of the directory when the walk started, results are memoized
+  // by it
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  int fd; // The directory, queued jobs open theirs relative to it
+
+  atomic_uint_fast64_t bytes; // Disk usage, as counted by du
+  atomic_uint_fast64_t files; // Entries other than directories
+
+  // Files with several links seen so far, whose blocks are only counted once
+  pthread_mutex_t links_mutex;
+  sf_du_link_t *links; // Open addressing, empty slots are zeroed
+  uint32_t link_capacity;
+  uint32_t link_count;
+
+  atomic_bool cancelled;
+  atomic_bool truncated; // Directories were left out, out of fds
+  atomic_uint jobs;      // Submitted and not completed yet
+  atomic_uint queued;    // Submitted and not running yet
+  atomic_int_fast64_t published_ms;
+
+  bool done;
+  bool released; // Freed once its last job completes
+} sf_du_t;
+
+typedef struct sf_du_job_t {
+  sf_job_t job;
+  sf_du_t *du;
+  bool ran;
+  char path[]; // Directory walked relative to the root, ending with '/'
+} sf_du_job_t;
+
+/*
+ * Walk of a subtree for the finder. Jobs walking parts of it collect the
+ * paths they find and hand them over in found, which the main thread takes
+ * from as they come in.
+ */
+typedef struct sf_find_walk_t {
+  bool show_hidden_files; // Hidden entries aren't found or walked into
+  int fd; // The root, queued jobs open their directory relative to it
+
+  atomic_bool cancelled;
+  atomic_bool truncated; // Directories were left out, out of fds
+  atomic_uint jobs;      // Submitted and not completed yet
+  atomic_uint queued;    // Submitted and not running yet
+  atomic_int_fast64_t published_ms;
+
+  // Found since the main thread last took them. Each path is relative to
+  // the root, preceded by its sf_entry_type_t and terminated by NUL.
+  pthread_mutex_t mutex;
+  char *found;
+  uint32_t found_size;
+  uint32_t found_capacity;
+
+  bool released; // Freed once its last job completes
+} sf_find_walk_t;
+
+/*
+ * Paths a worker found and hasn't handed over yet, stored like found
+ */
+typedef struct sf_find_batch_t {
+  char data[SF_FIND_BATCH_SIZE];
+  uint32_t size;
+} sf_find_batch_t;
+
+typedef struct sf_find_job_t {
+  sf_job_t job;
+  sf_find_walk_t *walk;
+  bool ran;
+  char path[]; // Directory walked relative to the root, ending with '/'
+} sf_find_job_t;
+
+/*
+ * Beginning of a file as drawn in the side pane, of at most
+ * SF_PREVIEW_MAX_BYTES of it. Previews are immutable once read, and shared
+ * by the side view and the preview cache.
+ */
+typedef struct sf_preview_t {
+  // Identity of the file when it was read, the cache is keyed by it
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  off_t size;
+
+  bool binary; // A NUL byte was read, no lines are kept then
+  char *text;  // Lines terminated by NUL, with control characters replaced
+  uint32_t text_capacity; // Bytes allocated for text
+  uint32_t *lines;        // Offset of each line in text
+  uint32_t line_count;
+
+  atomic_uint refs;
+  int64_t used_ms; // Last cached or looked up, guarded by the cache's mutex
+} sf_preview_t;
+
+typedef struct sf_preview_job_t {
+  sf_job_t job;
+  int dirfd; // Owned by the job
+  char name[NAME_MAX + 1];
+  sf_preview_t *preview; // NULL if the entry isn't a readable regular file
+} sf_preview_job_t;
+
+typedef enum sf_op_kind_t {
+  SF_OP_COPY,
+  SF_OP_MOVE,
+  SF_OP_DELETE,
+} sf_op_kind_t;
+
+/*
+ * Copy, move or delete of entries of one directory, run on sf_op_pool.
+ * Entries done are handed over to the main thread as they are, which
+ * patches the listings of the open directories involved.
+ */
+typedef struct sf_op_t {
+  sf_job_t job;
+  sf_op_kind_t kind;
+  int src_fd;  // Owned by the operation
+  int dest_fd; // Owned by the operation, -1 for deletes
+  char src_path[PATH_MAX];
+  char dest_path[PATH_MAX];
+  dev_t dest_dev; // Directories aren't copied into themselves
+  ino_t dest_ino;
+  sf_listing_t names; // Entries of the source operated on
+
+  atomic_uint entries_done;
+  atomic_uint_fast64_t bytes_done;
+  atomic_int_fast64_t published_ms;
+  int64_t started_ms;
+
+  // Entries done since the main thread last took them
+  pthread_mutex_t mutex;
+  sf_listing_t done;
+
+  // Only written by the worker, read once the operation completes
+  uint32_t failed;
+  int error; // First error hit
+
+  struct sf_op_t *next; // Next operation in flight
+} sf_op_t;
+
+typedef struct sf_du_memo_t {
+  bool valid;
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  uint64_t bytes;
+  uint64_t files;
+} sf_du_memo_t;
+
+/*
+ * A directory open in views or the side view. Views showing the same
+ * directory share it, so it's read and kept current once, while what they
+ * select or filter stays their own. Only the main thread touches it.
+ */
+typedef struct sf_dir_t {
+  char path[PATH_MAX]; // Resolved once when the directory is opened
+  int dirfd;
+  int watch; // Descriptor of the watch of dirfd, -1 if it isn't watched
+  sf_listing_t listing;
+  uint32_t generation; // Bumped whenever the listing changes
+  uint32_t refs;       // Views and side view showing it
+
+  // Scan in flight. Until it completes the listing holds the entries read
+  // so far, in the order they were read.
+  sf_scan_job_t *pending;
+
+  struct sf_dir_t *next; // Next open directory
+} sf_dir_t;
+
+typedef struct sf_view_t {
+  sf_dir_t *dir;
+  uint32_t selected_entry;
+  uint32_t generation; // Bumped whenever the directory or its filter changes
+
+  // Entry to select once the scan of the directory has read it, or to keep
+  // selected once the listing is sorted
+  char select[NAME_MAX + 1];
+
+  // Only entries whose name matches filter are shown, unless it's empty,
+  // and hidden entries only if sf_show_hidden_files is set. The positions
+  // shown are kept in matches in display order, and are current if
+  // filter_version is the same as the view's version.
+  char filter[NAME_MAX + 1];
+  bool filter_input; // Keys edit the filter
+  uint32_t *matches;
+  uint32_t match_count;
+  uint32_t match_capacity;
+  uint64_t filter_version;
+
+  // Names of the entries marked for copying, moving or deleting. Marks are
+  // dropped when the view changes directories or they're acted on.
+  sf_listing_t marks;
+  bool confirm_delete; // The next key answers whether marks are deleted
+} sf_view_t;
+
+typedef struct sf_side_view_t {
+  sf_dir_t *dir;       // NULL unless a directory is shown
+  uint32_t generation; // Bumped whenever the directory shown changes
+  sf_du_t *du;         // Recursive size of the target, NULL if unknown
+
+  // Scan in flight for the current selection, superseded by newer ones
+  sf_scan_job_t *pending;
+
+  // Preview of the target if it's a file, and the one being read
+  sf_preview_t *preview;
+  sf_preview_job_t *preview_pending;
+
+  // Set when the selection may have changed. The preview is resolved once
+  // per frame, so a burst of cursor moves only loads the final selection.
+  bool outdated;
+  char target[PATH_MAX]; // Path shown or being loaded, empty if none
+} sf_side_view_t;
+
+/*
+ * Recursive search below the directory of the current view. Paths stream in
+ * from walk as they're found and are matched against query as they arrive.
+ * The best matches are kept ranked, and are ranked again from scratch
+ * whenever query changes.
+ */
+typedef struct sf_finder_t {
+  bool active; // Keys edit the query and pick a match
+  char root[PATH_MAX];
+  char query[NAME_MAX + 1];
+  sf_find_walk_t *walk; // NULL once the whole tree was walked
+  bool truncated; // Stopped out of memory or fds, some paths aren't found
+
+  // Paths found so far, stored like in sf_find_walk_t
+  char *paths;
+  uint32_t paths_size;
+  uint32_t paths_capacity;
+  uint32_t *offsets; // Of each path in paths
+  uint32_t count;
+  uint32_t capacity;
+
+  // Paths matching query in the order they were found, current for the
+  // first matched paths. Longer queries only look through these.
+  uint32_t *matches;
+  uint32_t match_count;
+  uint32_t match_capacity;
+  uint32_t matched;
+
+  // Best matches, from the best one down
+  uint32_t ranked[SF_FIND_RANKED_COUNT];
+  uint32_t scores[SF_FIND_RANKED_COUNT];
+  uint32_t ranked_count;
+  uint32_t selected; // Rank of the selected match
+
+  uint64_t version; // Bumped whenever what's drawn changes
+} sf_finder_t;
+
+/*
+ * How sf --list writes entries
+ */
+typedef enum sf_list_format_t {
+  SF_LIST_LINES, // One name per line
+  SF_LIST_NUL,   // Names terminated by NUL bytes, like find -print0
+  SF_LIST_JSON,  // An array of objects
+} sf_list_format_t;
+
+/*
+ * What memory is accounted to. Directories shown by both a view and the
+ * side view count as the views'.
+ */
+typedef enum sf_memory_kind_t {
+  SF_MEMORY_VIEWS,     // Directories open in views, their filters and marks
+  SF_MEMORY_SIDE_VIEW, // Directory or preview shown in the side pane
+  SF_MEMORY_CACHE,     // Cached listings
+  SF_MEMORY_PREVIEWS,  // Cached previews not shown
+  SF_MEMORY_FINDER,    // Paths found and matched
+  SF_MEMORY_KIND_COUNT,
+} sf_memory_kind_t;
+
+/*
+ * Bytes held across the program, tallied once per frame. What's open is
+ * kept whatever it takes, the caches share what it leaves of max_size.
+ */
+typedef struct sf_memory_t {
+  size_t max_size;
+  size_t sizes[SF_MEMORY_KIND_COUNT];
+  uint64_t evictions; // Cached listings and previews evicted to fit
+} sf_memory_t;
+
+typedef struct sf_list_output_t {
+  int fd;
+  bool failed; // A write failed, the rest of the output is dropped
+  uint32_t size;
+  char data[SF_LIST_BUFFER_SIZE];
+} sf_list_output_t;
+
+/*
+ * What the main loop waits on
+ */
+typedef enum sf_event_source_t {
+  SF_EVENT_INPUT,
+  SF_EVENT_SIGNAL,
+  SF_EVENT_WATCH, // Changes of the watched directories
+  SF_EVENT_POOL,
+  SF_EVENT_STAT_POOL,
+  SF_EVENT_PREFETCH_POOL,
+  SF_EVENT_DU_POOL,
+  SF_EVENT_FIND_POOL,
+  SF_EVENT_OP_POOL,
+  SF_EVENT_SOURCE_COUNT,
+} sf_event_source_t;
+
+typedef enum sf_trace_category_t {
+  SF_TRACE_FRAME,
+  SF_TRACE_DRAW,
+  SF_TRACE_SCAN,
+  SF_TRACE_SORT,
+  SF_TRACE_SIDE_VIEW,
+  SF_TRACE_PREFETCH,
+  SF_TRACE_SPAWN,
+  SF_TRACE_IO, // Opening and resolving paths
+  SF_TRACE_CATEGORY_COUNT,
+} sf_trace_category_t;
+
+/*
+ * Time spent and entries handled in one category
+ */
+typedef struct sf_trace_stat_t {
+  int64_t duration_us;
+  uint64_t entries;
+} sf_trace_stat_t;
+
+typedef struct sf_trace_total_t {
+  atomic_int_fast64_t duration_us;
+  atomic_uint_fast64_t entries;
+} sf_trace_total_t;
+
+typedef struct sf_tracer_t {
+  FILE *file; // NULL unless a trace is being written
+  bool has_events;
+  // Totals since the last frame, added to by every thread
+  sf_trace_total_t totals[SF_TRACE_CATEGORY_COUNT];
+  // Totals of the last frame that did work of each category, so a scan stays
+  // readable after the frame it finished in
+  sf_trace_stat_t last[SF_TRACE_CATEGORY_COUNT];
+  // Startup is traced from started_us to the first frame and to the first
+  // listing read, once each
+  int64_t started_us;
+  bool first_frame_traced;
+  bool first_listing_traced;
+} sf_tracer_t;
+
+/*
+ * What a pane row displayed when it was last drawn
+ */
+typedef struct sf_row_t {
+  uint32_t entry; // SF_ROW_NONE for blank rows
+  bool selected;
+  bool marked;
+} sf_row_t;
+
+typedef struct sf_pane_t {
+  WINDOW *window;
+
+  // Damage tracking: a pane is only redrawn when its version changes, and
+  // rows only when their content does
+  bool dirty; // Everything needs to be redrawn
+  uint64_t version;
+  int row_count;
+  sf_row_t *rows;
+} sf_pane_t;
+
+// Path when the program was launched
+extern char sf_initial_path[PATH_MAX];
+
+extern bool sf_should_quit;
+
+// Readable once SIGWINCH or SIGCHLD arrived: a signalfd on Linux (both are
+// the same fd then), elsewhere a pipe the SIGCHLD handler writes to
+extern int sf_signal_fds[2];
+
+#ifdef __linux__
+// Waits on input, signals, pool completions and directory watches at once
+extern int sf_epoll_fd;
+#endif
+
+// inotify instance every directory is watched on, -1 if there's none, and
+// its watches. Workers add watches too.
+extern int sf_inotify_fd;
+extern sf_watch_t *sf_watches;
+extern pthread_mutex_t sf_watches_mutex;
+
+extern bool sf_show_hidden_files;
+
+// Order listings are shown in, they're sorted again as they're drawn
+extern sf_sort_t sf_sort;
+
+extern uint32_t sf_current_view;
+
+extern sf_view_t sf_views[SF_VIEW_COUNT];
+
+// Directories shown by the views and the side view
+extern sf_dir_t *sf_dirs;
+
+extern sf_side_view_t sf_side_view;
+
+extern sf_cache_t sf_cache;
+
+extern sf_memory_t sf_memory;
+
+extern sf_pool_t sf_pool;
+
+extern sf_pool_t sf_stat_pool;
+
+extern sf_pool_t sf_prefetch_pool;
+
+extern sf_prefetcher_t sf_prefetcher;
+
+extern sf_pool_t sf_du_pool;
+
+extern sf_pool_t sf_find_pool;
+
+extern sf_finder_t sf_finder;
+
+extern sf_pool_t sf_op_pool;
+
+// File operations in flight, and what went wrong with the last one to fail
+extern sf_op_t *sf_ops;
+extern char sf_op_message[128];
+
+// Previews read lately, the least recently used one is replaced. Workers
+// look previews up in it before reading a file.
+extern sf_preview_t *sf_preview_cache[SF_PREVIEW_CACHE_SIZE];
+extern pthread_mutex_t sf_preview_cache_mutex;
+
+// Recursive sizes of directories walked lately
+extern sf_du_memo_t sf_du_memo[SF_DU_MEMO_SIZE];
+extern uint32_t sf_du_memo_next;
+
+#ifdef SF_TRACE
+extern sf_tracer_t sf_tracer;
+#endif
+
+extern bool sf_show_metadata;
+
+// Whether LC_COLLATE orders strings by their bytes (C and POSIX locales)
+extern bool sf_collate_bytewise;
+
+extern sf_pane_t sf_header_pane;
+extern sf_pane_t sf_main_pane;
+extern sf_pane_t sf_side_pane;
+
+/*
+ * Tracing functions
+ */
+#ifdef SF_TRACE
+int64_t sf_trace_now_us();
+void sf_trace_open(const char *path);
+void sf_trace_close();
+void sf_trace_span(
+    sf_trace_category_t category,
+    const char *name,
+    int64_t start_us,
+    const char *detail,
+    uint64_t entries);
+void sf_trace_end_frame();
+#endif
+
+/*
+ * Process and path helpers
+ */
+void sf_spawn(char *const argv[], int cwd_fd, uint32_t flags);
+#ifndef __linux__
+void sf_on_child_exit(int signal);
+#endif
+void sf_reap_children();
+void sf_handle_signals();
+int64_t sf_now_ms();
+uint32_t sf_get_path_level(const char *path);
+bool sf_path_join(const char *dir, const char *name, char *dest);
+void sf_get_parent_path(const char *path, char *dest);
+void sf_get_top_dir_from_path(const char *path, char *dest);
+
+/*
+ * Listing functions
+ */
+const sf_entry_t *
+sf_listing_entry(const sf_listing_t *listing, uint32_t position);
+const char *sf_listing_name(const sf_listing_t *listing, uint32_t position);
+sf_entry_type_t
+sf_listing_type(const sf_listing_t *listing, uint32_t position);
+const sf_entry_meta_t *
+sf_listing_meta(const sf_listing_t *listing, uint32_t position);
+void sf_listing_destroy(sf_listing_t *listing);
+void sf_listing_move(sf_listing_t *dest, sf_listing_t *src);
+bool sf_listing_copy(sf_listing_t *dest, const sf_listing_t *src);
+size_t sf_listing_size(const sf_listing_t *listing);
+bool sf_sort_uses_meta(sf_sort_t sort);
+const char *sf_sort_name(sf_sort_t sort);
+uint32_t sf_name_extension(const char *name, uint32_t length);
+int sf_version_cmp(const char *a, const char *b);
+uint64_t
+sf_listing_sort_prefix(const sf_listing_t *listing, const sf_entry_t *entry);
+void sf_listing_sort(sf_listing_t *listing);
+void sf_listing_drop_orders(sf_listing_t *listing);
+bool sf_listing_set_sort(sf_listing_t *listing, sf_sort_t sort);
+uint64_t sf_key_prefix(const char *key, size_t length);
+bool sf_listing_reserve(sf_listing_t *listing, uint32_t capacity);
+bool sf_listing_push(
+    sf_listing_t *listing, const char *name, unsigned char d_type);
+bool sf_listing_append(
+    sf_listing_t *dest, const sf_listing_t *src, uint32_t first);
+bool sf_listing_insert(
+    sf_listing_t *listing,
+    const char *name,
+    unsigned char d_type,
+    uint32_t *position);
+uint32_t sf_listing_position(sf_listing_t *listing, uint32_t index);
+bool sf_listing_find(
+    sf_listing_t *listing, const char *name, uint32_t *position);
+bool sf_listing_compact(sf_listing_t *listing);
+void sf_listing_remove(sf_listing_t *listing, uint32_t position);
+
+/*
+ * Directory scanning
+ */
+bool sf_scan_fd(
+    int fd,
+    const atomic_bool *cancelled,
+    sf_scan_progress_t *progress,
+    sf_listing_t *listing);
+bool sf_get_entries(
+    int dirfd,
+    const char *name,
+    const char *path,
+    const atomic_bool *cancelled,
+    sf_scan_progress_t *progress,
+    sf_listing_t *listing);
+
+/*
+ * Listing cache functions
+ */
+void sf_cache_init(
+    sf_cache_t *cache, size_t max_size, size_t max_prefetched_size);
+void sf_cache_destroy(sf_cache_t *cache);
+bool sf_cache_lookup(
+    sf_cache_t *cache,
+    const char *path,
+    const struct stat *st,
+    bool prefetch,
+    sf_listing_t *listing);
+void sf_cache_insert(
+    sf_cache_t *cache,
+    const char *path,
+    const struct stat *st,
+    struct timespec scan_start,
+    bool prefetched,
+    const sf_listing_t *listing);
+
+/*
+ * Listing snapshot functions
+ */
+bool sf_listing_unmap(sf_listing_t *listing);
+bool sf_snapshot_path(const char *path, char *dest, bool create);
+bool sf_snapshot_load(
+    const char *path,
+    const struct stat *st,
+    bool stale,
+    sf_listing_t *listing,
+    bool *current);
+void sf_snapshot_save(
+    const char *path, const struct stat *st, const sf_listing_t *listing);
+
+/*
+ * Directory watch functions
+ */
+void sf_watch_init();
+void sf_watch_destroy();
+sf_watch_t *sf_watch_find(int wd);
+int sf_watch_open(int dirfd);
+void sf_watch_take_events();
+bool sf_watch_pending(int wd);
+bool sf_watch_read(
+    int wd,
+    void (*handle)(void *data, uint32_t mask, const char *name),
+    void *data);
+void sf_watch_close(int *wd);
+void sf_listing_apply_event(
+    sf_listing_t *listing,
+    int dirfd,
+    uint32_t mask,
+    const char *name,
+    void (*on_insert)(void *data, uint32_t index),
+    void (*on_remove)(void *data, uint32_t index),
+    void *data);
+
+/*
+ * Worker pool functions
+ */
+bool sf_notifier_open(int fds[2]);
+void sf_notifier_close(int fds[2]);
+void sf_notify(int fd);
+void sf_notify_drain(int fd);
+bool sf_pool_init(sf_pool_t *pool, uint32_t thread_count, bool idle);
+void sf_pool_submit(sf_pool_t *pool, sf_job_t *job);
+bool sf_pool_dispatch(sf_pool_t *pool);
+void sf_pool_destroy(sf_pool_t *pool);
+
+/*
+ * Metadata functions
+ */
+void sf_listing_request_meta(
+    sf_listing_t *listing,
+    int dirfd,
+    uint32_t *generation,
+    const uint32_t *positions,
+    uint32_t first,
+    uint32_t last,
+    bool unknown_only);
+void sf_listing_request_types(
+    sf_listing_t *listing, int dirfd, uint32_t *generation);
+void sf_format_size(uint64_t size, char *dest, size_t dest_size);
+void sf_format_meta(
+    const sf_entry_meta_t *meta, sf_entry_type_t type, char *dest);
+
+/*
+ * Filter matching
+ */
+int32_t sf_find(
+    const char *haystack,
+    uint32_t length,
+    const char *end,
+    const char *needle,
+    uint32_t needle_length,
+    bool ignore_case);
+bool sf_listing_matches(
+    const sf_listing_t *listing,
+    uint32_t index,
+    const char *filter,
+    uint32_t filter_length,
+    bool ignore_case);
+
+/*
+ * Display width functions
+ */
+bool sf_text_next(
+    const char *text,
+    uint32_t length,
+    uint32_t offset,
+    mbstate_t *state,
+    uint32_t *size,
+    uint32_t *width);
+bool sf_text_measure(
+    const char *text,
+    uint32_t length,
+    uint32_t columns,
+    uint32_t *width,
+    uint32_t *fit_length);
+void sf_text_sanitize(const char *text, uint32_t length, char *dest);
+sf_entry_layout_t
+sf_listing_layout(sf_listing_t *listing, uint32_t position, uint32_t columns);
+
+/*
+ * Directory functions
+ */
+sf_dir_t *sf_dir_find(const char *path);
+sf_dir_t *sf_dir_create(const char *path, int fd, int watch);
+sf_dir_t *sf_dir_open(int dirfd, const char *name, const char *path);
+void sf_dir_release(sf_dir_t *dir);
+void sf_dir_touch(sf_dir_t *dir);
+void sf_dir_take_progress(sf_dir_t *dir);
+void sf_dir_cancel_scan(sf_dir_t *dir);
+void sf_dir_load(sf_dir_t *dir);
+void sf_dir_apply_events(sf_dir_t *dir);
+void sf_dir_process_events(sf_dir_t *dir);
+void sf_dir_sort(sf_dir_t *dir);
+void sf_dir_sync_metadata(sf_dir_t *dir);
+
+/*
+ * Directory size functions
+ */
+bool sf_walk_queues(
+    const sf_pool_t *pool, atomic_uint *queued, uint32_t depth);
+int sf_walk_open(int fd, const char *path, atomic_bool *truncated);
+int sf_walk_open_path(
+    int root_fd, char *path, uint32_t length, atomic_bool *truncated);
+bool sf_du_add_link(sf_du_t *du, const struct stat *st);
+void sf_du_walk(
+    sf_du_t *du, int fd, char *path, uint32_t length, uint32_t depth);
+void sf_du_publish(sf_du_t *du);
+bool sf_du_submit(sf_du_t *du, const char *path);
+void sf_du_job_run(sf_job_t *job);
+void sf_du_job_complete(sf_job_t *job);
+sf_du_memo_t *sf_du_memo_find(dev_t dev, ino_t ino);
+sf_du_t *sf_du_start(int dirfd, const char *name);
+void sf_du_free(sf_du_t *du);
+void sf_du_release(sf_du_t *du);
+
+/*
+ * Finder functions
+ */
+void sf_find_publish(sf_find_walk_t *walk, sf_find_batch_t *batch, bool full);
+void sf_find_add(
+    sf_find_walk_t *walk,
+    sf_find_batch_t *batch,
+    sf_entry_type_t type,
+    const char *path,
+    uint32_t length);
+void sf_find_walk(
+    sf_find_walk_t *walk,
+    int fd,
+    char *path,
+    uint32_t length,
+    uint32_t depth,
+    sf_find_batch_t *batch);
+bool sf_find_submit(sf_find_walk_t *walk, const char *path);
+void sf_find_job_run(sf_job_t *job);
+void sf_find_job_complete(sf_job_t *job);
+void sf_find_walk_free(sf_find_walk_t *walk);
+void sf_find_walk_release(sf_find_walk_t *walk);
+uint32_t sf_finder_score(
+    const char *path,
+    uint32_t length,
+    const char *end,
+    const char *query,
+    uint32_t query_length,
+    bool ignore_case);
+void sf_finder_rank(sf_finder_t *finder, uint32_t index, uint32_t score);
+void sf_finder_match(sf_finder_t *finder, bool refine);
+void sf_finder_take_results(sf_finder_t *finder);
+bool sf_finder_start(sf_finder_t *finder, const sf_view_t *view);
+void sf_finder_stop(sf_finder_t *finder);
+void sf_finder_edit_query(sf_finder_t *finder, int c);
+bool sf_finder_open_selected(sf_finder_t *finder, sf_view_t *view);
+
+/*
+ * File preview functions
+ */
+bool sf_preview_split(
+    const char *data, uint32_t length, uint32_t *line_ends, uint32_t *count);
+sf_preview_t *sf_preview_render(
+    const struct stat *st, const char *data, uint32_t length);
+sf_preview_t *sf_preview_cache_find(const struct stat *st);
+void sf_preview_cache_insert(sf_preview_t *preview);
+void sf_preview_release(sf_preview_t *preview);
+void sf_preview_job_run(sf_job_t *job);
+void sf_preview_job_complete(sf_job_t *job);
+
+/*
+ * File operation functions
+ */
+void sf_op_publish(sf_op_t *op);
+void sf_op_fail(sf_op_t *op);
+bool sf_op_copy_data(sf_op_t *op, int src_fd, int dest_fd);
+bool sf_op_copy_entry(
+    sf_op_t *op, int src_dirfd, const char *name, int dest_dirfd);
+bool sf_op_delete_entry(sf_op_t *op, int parent_fd, const char *name);
+bool sf_op_move_entry(
+    sf_op_t *op, int src_dirfd, const char *name, int dest_dirfd);
+void sf_op_run(sf_job_t *job);
+void sf_op_take_progress(sf_op_t *op);
+void sf_op_complete(sf_job_t *job);
+bool sf_op_start(
+    sf_op_kind_t kind,
+    const sf_dir_t *src,
+    const sf_listing_t *names,
+    const sf_dir_t *dest);
+
+/*
+ * Side view functions
+ */
+void sf_side_view_init(sf_side_view_t *side_view);
+void sf_side_view_destroy(sf_side_view_t *side_view);
+void sf_side_view_clear(sf_side_view_t *side_view);
+void sf_side_view_set_path(
+    sf_side_view_t *side_view, sf_view_t *view, const char *name);
+void sf_side_view_set_file(
+    sf_side_view_t *side_view, sf_view_t *view, const char *name);
+void sf_side_view_invalidate(sf_side_view_t *side_view);
+uint64_t sf_side_view_version(const sf_side_view_t *side_view);
+void sf_side_view_sync(sf_side_view_t *side_view, sf_view_t *view);
+void sf_side_view_sync_metadata(sf_side_view_t *side_view);
+
+/*
+ * View functions
+ */
+uint64_t sf_view_version(const sf_view_t *view);
+bool sf_view_hides_entries(const sf_view_t *view);
+bool sf_view_filtered(const sf_view_t *view);
+uint32_t sf_view_row_count(const sf_view_t *view);
+uint32_t sf_view_row_position(const sf_view_t *view, uint32_t row);
+uint32_t sf_view_selected_row(const sf_view_t *view);
+void sf_view_sync_filter(sf_view_t *view);
+void sf_view_edit_filter(sf_view_t *view, int c);
+void sf_view_clear_filter(sf_view_t *view);
+void sf_view_set_selected_entry(sf_view_t *view, uint32_t entry_index);
+bool sf_view_is_marked(sf_view_t *view, uint32_t position);
+void sf_view_toggle_mark(sf_view_t *view);
+void sf_view_clear_marks(sf_view_t *view);
+bool sf_view_select_name(sf_view_t *view, const char *name);
+bool sf_view_set_path(
+    sf_view_t *view,
+    int dirfd,
+    const char *name,
+    const char *path,
+    const char *select);
+void sf_view_visible_range(
+    const sf_view_t *view, int height, uint32_t *first, uint32_t *last);
+void sf_view_sync_metadata(sf_view_t *view, int height);
+void sf_view_init(sf_view_t *view);
+void sf_view_destroy(sf_view_t *view);
+void sf_set_view(uint32_t view_index);
+
+/*
+ * Prefetch functions
+ */
+void sf_prefetch_schedule();
+
+/*
+ * Memory accounting functions
+ */
+void sf_memory_init(sf_memory_t *memory);
+size_t sf_memory_live_size(const sf_memory_t *memory);
+size_t sf_preview_memory_size(const sf_preview_t *preview);
+size_t sf_finder_memory_size(const sf_finder_t *finder);
+void sf_memory_update(sf_memory_t *memory);
+
+/*
+ * List mode functions
+ */
+void sf_list_flush(sf_list_output_t *output);
+void sf_list_write(sf_list_output_t *output, const char *data, size_t size);
+void sf_list_write_json_string(
+    sf_list_output_t *output, const char *text, uint32_t length);
+uint32_t sf_utf8_length(const char *text, uint32_t length);
+void sf_list_write_entry(
+    sf_list_output_t *output,
+    const sf_listing_t *listing,
+    uint32_t position,
+    sf_list_format_t format,
+    bool show_metadata);
+int sf_list(int argc, char **argv);
+
+/*
+ * Program state and drawing
+ */
+void sf_pane_init(sf_pane_t *pane, int height, int width, int y, int x);
+void sf_pane_resize(sf_pane_t *pane, int height, int width, int y, int x);
+void sf_pane_destroy(sf_pane_t *pane);
+void sf_resize_screen();
+void sf_init_locale();
+void sf_init_state();
+void sf_init_screen();
+void sf_init();
+void sf_destroy();
+void sf_draw_text(
+    WINDOW *window, const char *text, uint32_t length, bool plain);
+void sf_draw_header(sf_pane_t *pane);
+void sf_draw_side_pane(sf_pane_t *pane);
+void sf_draw_main_pane(sf_pane_t *pane);
+void sf_draw_finder_pane(sf_pane_t *pane);
+void sf_draw_frame();
+void sf_handle_event_source(sf_event_source_t source);
+void sf_poll_events(int timeout_ms);
+void sf_handle_key(int c);
+bool sf_handle_pending_keys();
+
+#endif